@@ -3,9 +3,14 @@
 
 #include <string>
 #include <map>
+#include <list>
 #include <vector>
+#include <sstream>
+#include <streambuf>
 #include <cstdlib>
 
+#include <sys/uio.h>
+
 #include <sqlite3.h>
 
 namespace cccgi {
@@ -15,6 +20,9 @@ namespace cccgi {
     class Get: public std::map<std::string, std::string> {
         public:
             Get();
+
+            // parses QUERY_STRING again, for the next request of a worker
+            void reset(void);
         private:
             void parseGet(void);
     };
@@ -88,10 +96,128 @@ namespace cccgi {
     };
     */
 
+    // Text that outlives the response, like a string literal.
+    class Text {
+        public:
+            template <size_t N>
+            Text(const char (&s)[N]): p(s), len(N - 1) { }
+            Text(const char *p, size_t len): p(p), len(len) { }
+
+            const char *p;
+            size_t len;
+    };
+
+    // A string to be written with &, <, >, " and ' escaped for HTML.
+    class Html {
+        public:
+            explicit Html(const std::string &s): s(s) { }
+
+            const std::string &s;
+    };
+
+    inline Html html(const std::string &s) { return Html(s); }
+
+    std::ostream &operator << (std::ostream &os, const Html &h);
+
+    /*
+     * The output of a page, kept until it's done and then written with
+     * one writev().  Text is only referred to, everything else is copied
+     * into a buffer that's reused from one request to the next.  While
+     * serve() runs a page, cout writes here as well.
+     */
+    class Response: public std::streambuf {
+
+        public:
+
+            Response();
+
+            Response &operator << (const Text &t);
+            Response &operator << (const Html &h);
+            Response &operator << (const std::string &s);
+            Response &operator << (const char *s);
+            Response &operator << (char *s);
+            Response &operator << (char c);
+            Response &operator << (int i);
+            Response &operator << (unsigned int u);
+            Response &operator << (long l);
+            Response &operator << (unsigned long ul);
+            Response &operator << (double d);
+            Response &operator << (std::ostream &(*manip)(std::ostream &));
+
+            // anything else goes through its ostream operator <<
+            template <class T>
+            Response &operator << (const T &v) {
+                std::ostringstream ss;
+
+                ss << v;
+
+                return *this << ss.str();
+            }
+
+            size_t size(void) const;
+            void clear(void);
+
+            // the whole response, for writev()
+            void iovecs(std::vector<struct iovec> &iov) const;
+            bool writeTo(int fd) const;
+
+            // Compresses the body if it's worth it, adding the headers
+            // that say so; false if it's left as it is.
+            bool gzip(void);
+
+        protected:
+
+            int_type overflow(int_type c);
+            std::streamsize xsputn(const char *s, std::streamsize n);
+
+        private:
+
+            // at p, or at off in buf if p is NULL
+            struct Seg {
+                const char *p;
+                size_t off;
+                size_t len;
+            };
+
+            std::vector<Seg> segs;
+            std::string buf;
+            size_t total;
+
+            void append(const char *s, size_t len);
+            void appendUnsigned(unsigned long ul, bool neg);
+
+            // copying is forbidden (these are only declared but not defined)
+            Response(const Response &r);
+            Response &operator = (const Response &r);
+    };
+
 #ifndef LIBCCCGI_CC
     extern Get GET;
+    extern Response RESPONSE;
 #endif
 
+    // 0 is quiet, 1 logs every query with its timings, 2 every call
+    // into the database classes too; set from CCCGI_TRACE
+    extern int trace_level;
+
+    /*
+     * Runs page once, as a CGI program, unless the program is to be a
+     * FastCGI server: when CCCGI_LISTEN is set to host:port or to the
+     * path of a UNIX socket, or when the web server started it with a
+     * listening socket on stdin.  Then CCCGI_WORKERS (one per CPU by
+     * default) preforked workers accept connections and call page for
+     * every request, with the request's parameters in the environment,
+     * GET parsed again, the request body (POST data) on cin, and what
+     * it writes to cout or RESPONSE sent back.  With CCCGI_GZIP=1
+     * responses are compressed for clients that take gzip.  Whatever
+     * page keeps in statics, like database connections, lives on from
+     * one request to the next.  Workers that die are started again, so
+     * exit() in a page only costs that request.
+     *
+     * cccgipp -w turns the main() of a page into such a page function.
+     */
+    int serve(int argc, char **argv, int (*page)(int, char **));
+
     class DBConnection {
 
         public:
@@ -144,11 +270,25 @@ namespace cccgi {
             bool connect(const std::string &connect_string);
             bool isConnected(void);
 
+            // how many prepared statements not in use are kept around
+            void setStmtCacheSize(size_t n);
+
         private:
 
+            typedef std::list<std::pair<std::string, sqlite3_stmt *> > StmtList;
+
             std::string connect_string;
             sqlite3 *db;
 
+            // statements not in use, the most recently used first
+            StmtList stmts;
+            std::map<std::string, StmtList::iterator> stmt_index;
+            size_t stmt_cache_size;
+
+            sqlite3_stmt *takeStmt(const std::string &sql, bool &cached);
+            void giveStmt(const std::string &sql, sqlite3_stmt *stmt);
+            void trimStmtCache(void);
+
         friend class DBStreamSqlite;
     };
 
@@ -166,31 +306,11 @@ namespace cccgi {
             DBStreamSqlite &operator >> (long &l);
             DBStreamSqlite &operator >> (std::string &s);
 
-            DBStreamSqlite &operator << (long l);
+            DBStreamSqlite &operator << (const long &l);
             DBStreamSqlite &operator << (const std::string &s);
 
         private:
 
-            class Varsubst {
-                
-                public:
-
-                    std::string::size_type pos;
-                    std::string::size_type len;
-                    std::string val;
-
-                    Varsubst():
-                        pos(0), len(0)
-                    {
-                    }
-
-                    Varsubst(std::string::size_type pos, std::string::size_type len):
-                        pos(pos), len(len)
-                    {
-                    }
-            };
-
-            std::string raw_sql;
             std::string sql;
             DBConnectionSqlite &dbconn;
             sqlite3_stmt *stmt;
@@ -201,13 +321,21 @@ namespace cccgi {
 
             int cur_var;
             int nvars;
-            std::vector<Varsubst> var_substs;
+
+            // timings of the query running, logged when it's done with
+            bool timing;
+            bool stmt_cached;
+            double prepare_ms;
+            double step_ms;
+            long nrows;
 
             int nextRow(void);
-            std::vector<Varsubst>::size_type findVars(const std::string &s);
-            void substAllVars(void);
+            int nextVar(void);
+            void varBound(int rc);
             void assignSql(const std::string &s);
-            void execBakedSql(void);
+            void releaseStmt(void);
+            void execStmt(void);
+            void endQuery(void);
     };
 };
 
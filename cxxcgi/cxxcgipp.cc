@@ -49,13 +49,25 @@
     Everything in <= => is copied verbatim like
         cout << somevar + some_other_var
 
+    Inside <: :> and <= =>, delimiters in string and character literals
+    don't count, nor do quotes in comments; :> and => still end a
+    comment.
+
+    With -w the main() of the page is renamed and a main() calling
+    cccgi::serve() with it is added, so the program can also run as a
+    FastCGI server that calls the page for every request.  main() has
+    to take argc and argv then.  The page is written to cccgi::RESPONSE
+    instead of cout, the HTML as cccgi::Text literals that aren't
+    copied, and sent with a single writev() when it's done.
+
 */
 
 #include <iostream>
 #include <string>
 #include <vector>
 #include <fstream>
-#include <algorithm>
+#include <sstream>
+#include <cctype>
 
 #include <unistd.h>
 #include <err.h>
@@ -104,55 +116,31 @@ ostream &operator << (ostream &os, vector<TextBuf> &v) {
     return os;
 }
 
-class Strpos {
-    public:
-        string::size_type pos;
-        string str;
-
-        Strpos(string::size_type pos, const string &str): pos(pos), str(str) {
-        }
-
-        bool operator < (const Strpos &sp) const {
-            return this->pos < sp.pos;
-        }
-        
-        operator string () {
-            return str;
-        }
-
-        bool operator == (const string &s) {
-            return str == s;
-        }
-};
-ostream &operator << (ostream &os, vector<Strpos> &v) {
-    vector<Strpos>::iterator it;
-
-    for (it = v.begin(); it != v.end(); ++it) {
-        if (it != v.begin())
-            os << ", ";
-        os << it->str << " " << it->pos;
-    }
-
-    return os;
-}
-
 void usage(void);
-bool cccgipp(const string &infilename, const string &outfilename);
+bool lex(const string &buf, vector<TextBuf> &bufs, string &error);
+bool cccgipp(const string &infilename, const string &outfilename, bool worker, bool debug);
 
 int
 main(int argc, char **argv) {
-    const char *optstring = "i:o:";
+    const char *optstring = "di:o:w";
     int ch;
     string infilename, outfilename;
+    bool worker = false, debug = false;
 
     while ((ch = getopt(argc, argv, optstring)) != -1) {
         switch (ch) {
+        case 'd':
+            debug = true;
+            break;
         case 'i':
             infilename = optarg;
             break;
         case 'o':
             outfilename = optarg;
             break;
+        case 'w':
+            worker = true;
+            break;
         default:
             usage();
             break;
@@ -173,7 +161,7 @@ main(int argc, char **argv) {
         }
     }
 
-    if (cccgipp(infilename, outfilename))
+    if (cccgipp(infilename, outfilename, worker, debug))
         return 0;
     else
         return 1;
@@ -181,165 +169,198 @@ main(int argc, char **argv) {
 
 void
 usage(void) {
-    cout << "usage: cccgipp -i <input_filename> [-o <output_filename>]" << endl;
+    cout << "usage: cccgipp [-dw] -i <input_filename> [-o <output_filename>]" << endl;
 }
 
-bool
-cccgipp(const string &infilename, const string &outfilename) {
-    ifstream in(infilename.c_str());
-    ofstream out(outfilename.c_str());
-    string buf, line;
-
-    if (!in) {
-        cerr << "failed to open input file " << infilename << endl;
-        return false;
-    }
-    if (!out) {
-        cerr << "failed to open output file " << outfilename << endl;
-        return false;
-    }
-
-    /* Load the input file */
-
-    while (getline(in, line))
-        buf.append(line).append(1, '\n');
-    in.close();
-
-    /* Find all delimiters which separate C++ code from HTML */
-
-    vector<Strpos> mark_posns;
+/*
+ * Adds the HTML between start and end, unless it's only white space.
+ * White space at its end is left out, but for a newline.
+ */
+static void
+add_html(vector<TextBuf> &bufs, const string &buf, string::size_type start, string::size_type end) {
     string::size_type pos;
-    const char *marks[] = { "<:", ":>", "<=", "=>", NULL }, **p;
 
-    for (p = marks; *p; ++p) {
-        for (pos = 0; (pos = buf.find(*p, pos)) != string::npos; pos += 2) {
-            mark_posns.push_back(Strpos(pos, *p));
-        }
-    }
-    sort(mark_posns.begin(), mark_posns.end()); // by position
+    for (pos = start; pos < end && isspace(buf[pos]); ++pos)
+        /* empty */;
+    if (pos == end)
+        return;
 
-    clog << mark_posns << endl;
+    for (pos = end; pos > start && isspace(buf[pos-1]); --pos)
+        /* empty */;
+    if (pos < end && buf[pos] == '\n')
+        ++pos;
 
-    /* Fix up the vector
-     *  - <= and => are legal C++ and might appear inside <: :>, erase them if they do
-     *  - delete those :> which appear inside C++ code inside quotes
-     */
+    bufs.push_back(TextBuf(TextBuf::HTML, buf.substr(start, pos - start)));
+}
 
-    vector<Strpos>::iterator b, e, it;
+static string::size_type
+line_of(const string &buf, string::size_type pos) {
+    string::size_type line = 1, i;
 
-    for (b = mark_posns.begin(); b != mark_posns.end(); /* empty */) {
-        if (*b == "<:") {
-            if ((e = find(b + 1, mark_posns.end(), ":>")) == mark_posns.end()) {
-                cerr << "delimiter mismatch, missing :>" << endl;
-                return false;
-            }
+    for (i = 0; i < pos; ++i)
+        if (buf[i] == '\n')
+            ++line;
+    return line;
+}
 
-            if (b + 1 < e)
-                b = mark_posns.erase(b + 1, e) + 1;
-            else
-                b = e + 1;
-        } else {
-            b += 2;
+/*
+ * Splits the template into HTML, C++ and C++ value pieces, in one pass
+ * over it.  Delimiters can't be nested, so the state is what the piece
+ * being read is, and in C++ whether it's in a literal or a comment.
+ */
+bool
+lex(const string &buf, vector<TextBuf> &bufs, string &error) {
+    enum {
+        CODE,
+        STRING,
+        CHAR,
+        LINE_COMMENT,
+        BLOCK_COMMENT
+    } cc = CODE;
+    TextBuf::e_types type = TextBuf::HTML;
+    string::size_type len = buf.length(), start = 0, open = 0, pos;
+    char c, next, close = '\0';
+    ostringstream ss;
+
+    for (pos = 0; pos < len; ++pos) {
+        c = buf[pos];
+        next = pos + 1 < len ? buf[pos+1] : '\0';
+
+        if (type == TextBuf::HTML) {
+            if (c == '<' && (next == ':' || next == '=')) {
+                add_html(bufs, buf, start, pos);
+                type = next == ':' ? TextBuf::CC : TextBuf::CC_VALUE;
+                close = next;
+                cc = CODE;
+                open = pos++;
+                start = pos + 1;
+            }
+            continue;
         }
-    }
-
-    for (b = mark_posns.begin(); b != mark_posns.end(); /* empty */) {
-        if (*b == "<:") {
-            e = find(b + 1, mark_posns.end(), ":>");
 
-            if (e == mark_posns.end())
-                break;
-        } else {
-            ++b;
+        if (c == close && next == '>' && cc != STRING && cc != CHAR) {
+            bufs.push_back(TextBuf(type, buf.substr(start, pos - start)));
+            // or the comment would swallow the code that follows
+            if (cc == LINE_COMMENT)
+                bufs.back().buf += '\n';
+            type = TextBuf::HTML;
+            start = ++pos + 1;
             continue;
         }
 
-        bool in_quotes = false;
-        for (pos = b->pos + 2; pos < e->pos && pos < buf.length(); ++pos) {
-            if (buf[pos] == '"' && (pos == 0 || buf[pos-1] != '\\'))
-                in_quotes = !in_quotes;
+        switch (cc) {
+        case CODE:
+            if (c == '"') {
+                cc = STRING;
+            } else if (c == '\'') {
+                cc = CHAR;
+            } else if (c == '/' && next == '/') {
+                cc = LINE_COMMENT;
+                ++pos;
+            } else if (c == '/' && next == '*') {
+                cc = BLOCK_COMMENT;
+                ++pos;
+            }
+            break;
+        case STRING:
+        case CHAR:
+            if (c == '\\')
+                ++pos;
+            else if (c == (cc == STRING ? '"' : '\'') || c == '\n')
+                cc = CODE;
+            break;
+        case LINE_COMMENT:
+            if (c == '\n')
+                cc = CODE;
+            break;
+        case BLOCK_COMMENT:
+            if (c == '*' && next == '/') {
+                cc = CODE;
+                ++pos;
+            }
+            break;
         }
-
-        if (in_quotes)
-            b = mark_posns.erase(e);
-        else
-            b = e + 1;
     }
 
-    if (mark_posns.size() % 2 != 0) {
-        cerr << "delimiter mismatch" << endl;
+    if (type != TextBuf::HTML) {
+        ss << "delimiter mismatch, missing " << close << "> for the <" << close
+           << " on line " << line_of(buf, open);
+        error = ss.str();
         return false;
     }
+    add_html(bufs, buf, start, len);
 
-    /* Delete the delimiters from the text, since they will get in the way */
-
-    for (b = mark_posns.begin(); b != mark_posns.end(); ++b) {
-        buf.erase(b->pos, 2);
-        for (it = b + 1; it != mark_posns.end(); ++it)
-            it->pos -= 2;
-    }
-
-    /* Add the non-existent in reality HTML delimiters, to ease further processing */
-
-    for (b = mark_posns.begin(); b != mark_posns.end(); /* empty */) {
-        clog << mark_posns << endl;
+    return true;
+}
 
-        if (b == mark_posns.begin()) {
-            if (b->pos > 0) {
-                b = mark_posns.insert(b, Strpos(b->pos, "H>"));
-                b = mark_posns.insert(b, Strpos(0, "<H"));
-                b += 2;
-            }
-        } else {
-            if (b->pos - (b - 1)->pos > 0) {
-                b = mark_posns.insert(b, Strpos(b->pos, "H>"));
-                b = mark_posns.insert(b, Strpos((b - 1)->pos, "<H"));
-                b += 2;
-            }
+// The text as a C++ string literal.
+static string
+cc_string(const string &s) {
+    string lit;
+    string::size_type pos;
 
-            if (b == (mark_posns.end() - 2) && ((b + 1)->pos < buf.length() - 1)) {
-                mark_posns.insert(mark_posns.end(), Strpos((b + 1)->pos, "<H"));
-                mark_posns.insert(mark_posns.end(), Strpos(buf.length(), "H>"));
-                break;
-            }
+    lit.reserve(s.length() + s.length() / 8 + 2);
+    lit += '"';
+    for (pos = 0; pos < s.length(); ++pos) {
+        switch (s[pos]) {
+        case '"':
+            lit += "\\\"";
+            break;
+        case '\\':
+            lit += "\\\\";
+            break;
+        case '\n':
+            lit += "\\n";
+            break;
+        default:
+            lit += s[pos];
+            break;
         }
-        b += 2;
     }
-    clog << mark_posns << endl;
+    lit += '"';
 
-    /* Split into separate buffers, assigning a type (HTML, C++, C++ value embedded in HTML) */
+    return lit;
+}
 
+bool
+cccgipp(const string &infilename, const string &outfilename, bool worker, bool debug) {
+    ifstream in(infilename.c_str());
+    ofstream out(outfilename.c_str());
     vector<TextBuf> bufs;
+    string buf, line, error;
 
-    for (b = mark_posns.begin(); b != mark_posns.end(); b = e + 1) {
-        e = b + 1;
+    if (!in) {
+        cerr << "failed to open input file " << infilename << endl;
+        return false;
+    }
+    if (!out) {
+        cerr << "failed to open output file " << outfilename << endl;
+        return false;
+    }
 
-        string str(buf.substr(b->pos, e->pos - b->pos));
+    /* Load the input file */
 
-        if (*b == "<:") {
-            bufs.push_back(TextBuf(TextBuf::CC, str));
-        } else if (*b == "<=") {
-            bufs.push_back(TextBuf(TextBuf::CC_VALUE, str));
-        } else if (*b == "<H" && !str.empty() && str.find_first_not_of(" \t\n") != string::npos) {
-            /* leave only one space at the end of the string */
-            for (pos = str.length(); pos > 0 && isspace(str[pos-1]); --pos)
-                /* empty */;
-            if (str[pos] == '\n')
-                ++pos;
-            str.erase(pos, str.length() - pos);
-            clog << "erasing <H from pos " << pos << " (tot len = " << str.length() << ")" << endl;
-            bufs.push_back(TextBuf(TextBuf::HTML, str));
-        }
-    }
+    while (getline(in, line))
+        buf.append(line).append(1, '\n');
+    in.close();
 
-    clog << bufs;
+    /* Split into separate buffers, assigning a type (HTML, C++, C++ value embedded in HTML) */
 
-    clog << buf;
+    if (!lex(buf, bufs, error)) {
+        cerr << infilename << ": " << error << endl;
+        return false;
+    }
+
+    if (debug)
+        clog << bufs;
 
     /* Write the resulting C++ source code file */
 
     bool in_cout = false;
 
+    if (worker)
+        out << "#define main cccgi_page" << endl;
+
     for (vector<TextBuf>::iterator tb = bufs.begin(); tb != bufs.end(); ++tb) {
         string b(tb->buf);
 
@@ -352,15 +373,13 @@ cccgipp(const string &infilename, const string &outfilename) {
             out << b;
             break;
         case TextBuf::HTML:
-            for (pos = 0; (pos = b.find('"', pos)) != string::npos; pos += 2)
-                b.replace(pos, 1, "\\\"");
-            b = '"' + b + '"';
-            for (pos = 0; (pos = b.find('\n', pos)) != string::npos; pos += 2)
-                b.replace(pos, 1, "\\n");
+            b = cc_string(b);
+            if (worker)
+                b = "cccgi::Text(" + b + ")";
             /* fall through */
         case TextBuf::CC_VALUE:
             if (!in_cout) {
-                out << "cout ";
+                out << (worker ? "cccgi::RESPONSE " : "cout ");
                 in_cout = true;
             }
             out << "<< " << b;
@@ -371,6 +390,14 @@ cccgipp(const string &infilename, const string &outfilename) {
         out << ";";
     out << endl;
 
+    if (worker) {
+        out << "#undef main" << endl
+            << "int" << endl
+            << "main(int argc, char **argv) {" << endl
+            << "    return cccgi::serve(argc, argv, cccgi_page);" << endl
+            << "}" << endl;
+    }
+
     out.close();
 
     return true;
@@ -5,13 +5,50 @@
 #include <iomanip>
 #include <iostream>
 #include <vector>
+#include <set>
 #include <stdexcept>
+#include <typeinfo>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <sqlite3.h>
+#include <zlib.h>
 
 #define LIBCCCGI_CC
 #include "cccgi.hh"
 
+#define STMT_CACHE_SIZE 32 // default, per connection
+#define TEXT_COPY_MAX 64    // shorter Text is copied rather than given its own iovec
+#define GZIP_MIN 256        // smaller bodies aren't worth compressing
+
+/*
+ * CCCGI_TRACE=1 in the environment logs a line with the timings of
+ * every query, CCCGI_TRACE=2 also every call into the database classes.
+ * Building with -DCCCGI_NO_TRACE leaves out even the checks.
+ */
+#ifdef CCCGI_NO_TRACE
+#define TRACE_ON(level) false
+#else
+#define TRACE_ON(level) (cccgi::trace_level >= (level))
+#endif
+#define TRACE_CALL() \
+    do { \
+        if (TRACE_ON(2)) \
+            clog << typeid(*this).name() << "::" << __func__ << "()" << endl; \
+    } while (0)
+
 extern char **environ;
 
 using namespace std;
@@ -110,6 +147,12 @@ namespace cccgi {
         parseGet();
     }
 
+    void
+    Get :: reset(void) {
+        clear();
+        parseGet();
+    }
+
     void
     Get :: parseGet(void) {
         int i;
@@ -228,28 +271,347 @@ namespace cccgi {
 
     Get GET;
 
+    int trace_level = getenv("CCCGI_TRACE") ? atoi(getenv("CCCGI_TRACE")) : 0;
+
+    static double
+    now_ms(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+    }
+
+    /*** Response ***/
+
+    Response RESPONSE;
+
+    Response :: Response():
+        total(0)
+    {
+    }
+
+    void
+    Response :: append(const char *s, size_t len) {
+        if (len == 0)
+            return;
+        if (segs.empty() || segs.back().p != NULL) {
+            Seg seg = { NULL, buf.length(), 0 };
+
+            segs.push_back(seg);
+        }
+        buf.append(s, len);
+        segs.back().len += len;
+        total += len;
+    }
+
+    void
+    Response :: appendUnsigned(unsigned long ul, bool neg) {
+        char digits[32], *p = digits + sizeof digits;
+
+        do {
+            *--p = '0' + ul % 10;
+            ul /= 10;
+        } while (ul != 0);
+        if (neg)
+            *--p = '-';
+
+        append(p, digits + sizeof digits - p);
+    }
+
+    Response &
+    Response :: operator << (const Text &t) {
+        if (t.len <= TEXT_COPY_MAX) {
+            append(t.p, t.len);
+        } else {
+            Seg seg = { t.p, 0, t.len };
+
+            segs.push_back(seg);
+            total += t.len;
+        }
+        return *this;
+    }
+
+    static const char *
+    html_entity(char c) {
+        switch (c) {
+        case '&':  return "&amp;";
+        case '<':  return "&lt;";
+        case '>':  return "&gt;";
+        case '"':  return "&quot;";
+        case '\'': return "&#39;";
+        default:   return NULL;
+        }
+    }
+
+    Response &
+    Response :: operator << (const Html &h) {
+        const string &s = h.s;
+        string::size_type start, pos;
+        const char *entity;
+
+        for (start = pos = 0; pos < s.length(); ++pos) {
+            if ((entity = html_entity(s[pos])) == NULL)
+                continue;
+            append(s.data() + start, pos - start);
+            append(entity, strlen(entity));
+            start = pos + 1;
+        }
+        append(s.data() + start, s.length() - start);
+
+        return *this;
+    }
+
+    ostream &
+    operator << (ostream &os, const Html &h) {
+        const string &s = h.s;
+        string::size_type start, pos;
+        const char *entity;
+
+        for (start = pos = 0; pos < s.length(); ++pos) {
+            if ((entity = html_entity(s[pos])) == NULL)
+                continue;
+            os.write(s.data() + start, pos - start) << entity;
+            start = pos + 1;
+        }
+
+        return os.write(s.data() + start, s.length() - start);
+    }
+
+    Response &
+    Response :: operator << (const string &s) {
+        append(s.data(), s.length());
+        return *this;
+    }
+
+    Response &
+    Response :: operator << (const char *s) {
+        append(s, strlen(s));
+        return *this;
+    }
+
+    Response &
+    Response :: operator << (char *s) {
+        append(s, strlen(s));
+        return *this;
+    }
+
+    Response &
+    Response :: operator << (char c) {
+        append(&c, 1);
+        return *this;
+    }
+
+    Response &
+    Response :: operator << (int i) {
+        return *this << (long) i;
+    }
+
+    Response &
+    Response :: operator << (unsigned int u) {
+        appendUnsigned(u, false);
+        return *this;
+    }
+
+    Response &
+    Response :: operator << (long l) {
+        // negated as unsigned, so LONG_MIN comes out right too
+        appendUnsigned(l < 0 ? -(unsigned long) l : (unsigned long) l, l < 0);
+        return *this;
+    }
+
+    Response &
+    Response :: operator << (unsigned long ul) {
+        appendUnsigned(ul, false);
+        return *this;
+    }
+
+    Response &
+    Response :: operator << (double d) {
+        char tmp[32];
+        int n;
+
+        // what cout would print
+        n = snprintf(tmp, sizeof tmp, "%g", d);
+        append(tmp, min((size_t) n, sizeof tmp - 1));
+
+        return *this;
+    }
+
+    Response &
+    Response :: operator << (ostream &(*manip)(ostream &)) {
+        ostream os(this);
+
+        manip(os);
+
+        return *this;
+    }
+
+    Response :: int_type
+    Response :: overflow(int_type c) {
+        if (c != traits_type::eof()) {
+            char ch = traits_type::to_char_type(c);
+
+            append(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    streamsize
+    Response :: xsputn(const char *s, streamsize n) {
+        append(s, n);
+        return n;
+    }
+
+    size_t
+    Response :: size(void) const {
+        return total;
+    }
+
+    // Keeps the memory, for the next request.
+    void
+    Response :: clear(void) {
+        segs.clear();
+        buf.clear();
+        total = 0;
+    }
+
+    void
+    Response :: iovecs(vector<struct iovec> &iov) const {
+        vector<Seg>::const_iterator it;
+        struct iovec v;
+
+        iov.clear();
+        for (it = segs.begin(); it != segs.end(); ++it) {
+            v.iov_base = (void *) (it->p ? it->p : buf.data() + it->off);
+            v.iov_len = it->len;
+            iov.push_back(v);
+        }
+    }
+
+    static bool
+    writev_full(int fd, struct iovec *iov, size_t n) {
+        ssize_t len;
+
+        while (n > 0) {
+            if ((len = writev(fd, iov, min(n, (size_t) IOV_MAX))) == -1 && errno == EINTR)
+                continue;
+            if (len <= 0)
+                return false;
+            for (/* empty */; n > 0 && (size_t) len >= iov->iov_len; --n, ++iov)
+                len -= iov->iov_len;
+            if (n > 0) {
+                iov->iov_base = (char *) iov->iov_base + len;
+                iov->iov_len -= len;
+            }
+        }
+        return true;
+    }
+
+    bool
+    Response :: writeTo(int fd) const {
+        vector<struct iovec> iov;
+
+        iovecs(iov);
+
+        return iov.empty() || writev_full(fd, &iov[0], iov.size());
+    }
+
+    bool
+    Response :: gzip(void) {
+        string all, eol, headers, body;
+        string::size_type end, pos;
+        z_stream zs;
+        int rc;
+
+        all.reserve(total);
+        for (vector<Seg>::iterator it = segs.begin(); it != segs.end(); ++it)
+            all.append(it->p ? it->p : buf.data() + it->off, it->len);
+
+        // CGI headers end with an empty line, \r\n or just \n
+        if ((end = all.find("\n\n")) != string::npos &&
+            (pos = all.find("\r\n\r\n")) != string::npos && pos < end) {
+            end = pos;
+            eol = "\r\n";
+        } else if (end == string::npos && (end = all.find("\r\n\r\n")) != string::npos) {
+            eol = "\r\n";
+        } else if (end != string::npos) {
+            eol = "\n";
+        } else {
+            return false;
+        }
+        if (all.length() - end - 2 * eol.length() < GZIP_MIN)
+            return false;
+
+        headers = all.substr(0, end + eol.length());
+        for (pos = 0; pos < headers.length(); ++pos)
+            headers[pos] = tolower(headers[pos]);
+        if (headers.find("content-encoding:") != string::npos ||
+            headers.find("content-length:") != string::npos)
+            return false;
+        headers = all.substr(0, end + eol.length());
+
+        memset(&zs, 0, sizeof zs);
+        // 16 more window bits for a gzip header
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+        pos = end + 2 * eol.length();
+        body.resize(deflateBound(&zs, all.length() - pos));
+        zs.next_in = (Bytef *) all.data() + pos;
+        zs.avail_in = all.length() - pos;
+        zs.next_out = (Bytef *) &body[0];
+        zs.avail_out = body.length();
+        rc = deflate(&zs, Z_FINISH);
+        body.resize(zs.total_out);
+        deflateEnd(&zs);
+        if (rc != Z_STREAM_END)
+            return false;
+
+        clear();
+        headers.append("Content-Encoding: gzip").append(eol)
+               .append("Vary: Accept-Encoding").append(eol)
+               .append(eol);
+        append(headers.data(), headers.length());
+        append(body.data(), body.length());
+
+        return true;
+    }
+
     /*** DBConnectionSqlite ***/
 
+    /*
+     * Statements are prepared once per SQL text and connection.  A
+     * stream takes one out of the cache for as long as it uses it and
+     * gives it back reset afterwards; the least recently used ones are
+     * finalized when there are more than stmt_cache_size.
+     */
+
     DBConnectionSqlite :: DBConnectionSqlite():
-        db(NULL)
+        db(NULL), stmt_cache_size(STMT_CACHE_SIZE)
     {
     }
 
     DBConnectionSqlite :: DBConnectionSqlite(const string &connect_string):
-        connect_string(connect_string), db(NULL)
+        connect_string(connect_string), db(NULL), stmt_cache_size(STMT_CACHE_SIZE)
     {
         connect(connect_string);
     }
 
     DBConnectionSqlite :: ~DBConnectionSqlite() {
+        stmt_cache_size = 0;
+        trimStmtCache();
         if (db)
             sqlite3_close(db);
     }
 
     bool
     DBConnectionSqlite :: connect(const string &connect_string) {
-        if (sqlite3_open(connect_string.c_str(), &db) == -1)
+        if (sqlite3_open(connect_string.c_str(), &db) != SQLITE_OK) {
+            sqlite3_close(db);
+            db = NULL;
             return false;
+        }
+        return true;
     }
 
     bool
@@ -257,38 +619,99 @@ namespace cccgi {
         return db != NULL;
     }
 
+    void
+    DBConnectionSqlite :: setStmtCacheSize(size_t n) {
+        stmt_cache_size = n;
+        trimStmtCache();
+    }
+
+    sqlite3_stmt *
+    DBConnectionSqlite :: takeStmt(const string &sql, bool &cached) {
+        map<string, StmtList::iterator>::iterator it;
+        sqlite3_stmt *stmt = NULL;
+
+        if ((cached = (it = stmt_index.find(sql)) != stmt_index.end())) {
+            stmt = it->second->second;
+            stmts.erase(it->second);
+            stmt_index.erase(it);
+            return stmt;
+        }
+
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK || stmt == NULL) {
+            ostringstream ss;
+
+            ss << "failed to prepare SQL statement \"" << sql << "\": " << sqlite3_errmsg(db);
+
+            throw runtime_error(ss.str());
+        }
+
+        return stmt;
+    }
+
+    void
+    DBConnectionSqlite :: giveStmt(const string &sql, sqlite3_stmt *stmt) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+
+        // another stream had the same one out at the same time
+        if (stmt_index.find(sql) != stmt_index.end()) {
+            sqlite3_finalize(stmt);
+            return;
+        }
+
+        stmts.push_front(make_pair(sql, stmt));
+        stmt_index[sql] = stmts.begin();
+        trimStmtCache();
+    }
+
+    void
+    DBConnectionSqlite :: trimStmtCache(void) {
+        while (stmts.size() > stmt_cache_size) {
+            sqlite3_finalize(stmts.back().second);
+            stmt_index.erase(stmts.back().first);
+            stmts.pop_back();
+        }
+    }
+
     /*** DBStreamSqlite ***/
 
     DBStreamSqlite :: DBStreamSqlite(DBConnectionSqlite &dbconn):
-        DBStream(dbconn), dbconn(dbconn), stmt(NULL), status(0), cur_col(0), ncols(0), cur_var(0), nvars(0)
+        DBStream(dbconn), dbconn(dbconn), stmt(NULL), status(0), cur_col(0), ncols(0), cur_var(0), nvars(0),
+        timing(false), stmt_cached(false), prepare_ms(0.0), step_ms(0.0), nrows(0)
     {
-        clog << typeid(*this).name() << "::" << __func__ << "1()" << endl;
+        TRACE_CALL();
 
         if (!dbconn.isConnected())
             throw runtime_error("invalid argument: dbconn is not connected");
     }
 
     DBStreamSqlite :: DBStreamSqlite(DBConnectionSqlite &dbconn, const string &s):
-        DBStream(dbconn, s), dbconn(dbconn), stmt(NULL), status(0), cur_col(0), ncols(0), cur_var(0), nvars(0)
+        DBStream(dbconn, s), dbconn(dbconn), stmt(NULL), status(0), cur_col(0), ncols(0), cur_var(0), nvars(0),
+        timing(false), stmt_cached(false), prepare_ms(0.0), step_ms(0.0), nrows(0)
     {
-        clog << typeid(*this).name() << "::" << __func__ << "2()" << endl;
+        TRACE_CALL();
 
         if (!dbconn.isConnected())
             throw runtime_error("invalid argument: dbconn is not connected");
-        
-        this->exec(s);
+
+        // the destructor doesn't run if the constructor throws
+        try {
+            this->exec(s);
+        } catch (...) {
+            this->releaseStmt();
+            throw;
+        }
     }
 
     DBStreamSqlite :: ~DBStreamSqlite() {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+        TRACE_CALL();
 
-        if (stmt)
-            sqlite3_finalize(stmt);
+        this->releaseStmt();
     }
 
     DBStreamSqlite &
     DBStreamSqlite :: exec(const string &s) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+        TRACE_CALL();
 
         this->assignSql(s);
 
@@ -297,20 +720,20 @@ namespace cccgi {
 
     bool
     DBStreamSqlite :: hasRows(void) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+        TRACE_CALL();
 
         return status == SQLITE_ROW;
     }
 
     DBStreamSqlite &
     DBStreamSqlite :: operator >> (long &l) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+        TRACE_CALL();
 
         if (status != SQLITE_ROW) {
             throw runtime_error("there are no rows to fetch");
         }
 
-        l = sqlite3_column_int(stmt, cur_col++);
+        l = sqlite3_column_int64(stmt, cur_col++);
 
         if (cur_col >= ncols)
             this->nextRow();
@@ -320,7 +743,7 @@ namespace cccgi {
 
     DBStreamSqlite &
     DBStreamSqlite :: operator >> (string &s) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+        TRACE_CALL();
 
         if (status != SQLITE_ROW) {
             throw runtime_error("there are no rows to fetch");
@@ -336,53 +759,49 @@ namespace cccgi {
         return *this;
     }
 
+    /*
+     * The :name placeholders in the SQL are SQLite's own parameters; the
+     * values given with << are bound to them in order, and when the last
+     * one is the statement runs.  Giving values again after that runs it
+     * again with the new ones.
+     */
     DBStreamSqlite &
-    DBStreamSqlite :: operator << (long l) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
-
-        ostringstream ss;
-
-        if (nvars == 0)
-            throw runtime_error("there are no variables to be subsituted");
-
-        ss << l;
+    DBStreamSqlite :: operator << (const long &l) {
+        TRACE_CALL();
 
-        var_substs[cur_var++].val = ss.str();
+        int i = this->nextVar();
 
-        if (cur_var >= nvars) {
-            this->substAllVars();
-            this->execBakedSql();
-            sql = raw_sql;
-            cur_var = 0;
-        }
+        this->varBound(sqlite3_bind_int64(stmt, i, l));
 
         return *this;
     }
 
     DBStreamSqlite &
     DBStreamSqlite :: operator << (const string &s) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
-
-        if (nvars == 0)
-            throw runtime_error("there are no variables to be subsituted");
+        TRACE_CALL();
 
-        var_substs[cur_var++].val = s;
+        int i = this->nextVar();
 
-        if (cur_var >= nvars) {
-            this->substAllVars();
-            this->execBakedSql();
-            sql = raw_sql;
-            cur_var = 0;
-        }
+        this->varBound(sqlite3_bind_text(stmt, i, s.data(), s.length(), SQLITE_TRANSIENT));
 
         return *this;
     }
 
     int
     DBStreamSqlite :: nextRow(void) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+        TRACE_CALL();
+
+        double t0 = timing ? now_ms() : 0.0;
+
+        status = sqlite3_step(stmt);
 
-        if ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (timing) {
+            step_ms += now_ms() - t0;
+            if (status == SQLITE_ROW)
+                ++nrows;
+        }
+
+        if (status == SQLITE_ROW) {
             cur_col = 0;
             if (!ncols)
                 ncols = sqlite3_column_count(stmt);
@@ -391,90 +810,81 @@ namespace cccgi {
         return status;
     }
 
-    vector<DBStreamSqlite::Varsubst>::size_type
-    DBStreamSqlite :: findVars(const string &s) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
-
-        string::size_type pos, end_pos, len;
+    // Index of the parameter the next value goes to.
+    int
+    DBStreamSqlite :: nextVar(void) {
+        TRACE_CALL();
 
-        var_substs.clear();
+        if (nvars == 0)
+            throw runtime_error("there are no variables to be subsituted");
 
-        for (pos = 0; (pos = s.find(':', pos)) != string::npos; /* empty */) {
-            if (s[pos] == ':') {
-                if (pos != 0 && s[pos-1] == '\\') {
-                    ++pos;
-                    continue;
-                }
-                for (end_pos = pos + 1; isalnum(s[end_pos]) || s[end_pos] == '_'; ++end_pos)
-                    /* empty */;
-                if ((len = end_pos - pos) > 1) {
-                    var_substs.push_back(Varsubst(pos, len));
-                }
-                pos = end_pos;
-            } else
-                ++pos;
+        if (cur_var == 0 && status != 0) {
+            sqlite3_reset(stmt);
+            status = 0;
+            ncols = 0;
         }
 
-        nvars = var_substs.size();
-
-        return nvars;
+        return ++cur_var;
     }
 
     void
-    DBStreamSqlite :: substAllVars(void) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+    DBStreamSqlite :: varBound(int rc) {
+        TRACE_CALL();
 
-        size_t i;
-        long shift;
+        if (rc != SQLITE_OK) {
+            ostringstream ss;
 
-        for (i = shift = 0; i < var_substs.size(); ++i) {
-            Varsubst &vs = var_substs[i];
+            ss << "failed to bind variable " << cur_var << " of SQL statement \"" << sql << "\": " << sqlite3_errmsg(dbconn.db);
 
-            sql.replace(vs.pos + shift, vs.len, vs.val);
+            throw runtime_error(ss.str());
+        }
 
-            shift -= vs.len;
-            shift += vs.val.length();
+        if (cur_var >= nvars) {
+            this->execStmt();
+            cur_var = 0;
         }
     }
 
     void
     DBStreamSqlite :: assignSql(const string &s) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+        TRACE_CALL();
 
-        ncols = 0;
+        this->releaseStmt();
 
-        if (stmt) {
-            sqlite3_finalize(stmt);
-            stmt = NULL;
-        }
+        ncols = 0;
+        status = 0;
+        cur_var = 0;
 
-        raw_sql = s;
         sql = s;
-
-        this->findVars(raw_sql);
+        double t0 = TRACE_ON(1) ? now_ms() : 0.0;
+        stmt = dbconn.takeStmt(sql, stmt_cached);
+        prepare_ms = TRACE_ON(1) ? now_ms() - t0 : 0.0;
+        nvars = sqlite3_bind_parameter_count(stmt);
 
         if (nvars == 0)
-            this->execBakedSql();
+            this->execStmt();
     }
 
     void
-    DBStreamSqlite :: execBakedSql(void) {
-        clog << typeid(*this).name() << "::" << __func__ << "()" << endl;
+    DBStreamSqlite :: releaseStmt(void) {
+        this->endQuery();
 
         if (stmt) {
-            sqlite3_finalize(stmt);
+            dbconn.giveStmt(sql, stmt);
             stmt = NULL;
         }
+    }
 
-        if (sqlite3_prepare_v2(dbconn.db, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK) {
-            ostringstream ss;
-
-            ss << "failed to prepare SQL statement \"" << sql << "\": " << sqlite3_errmsg(dbconn.db);
+    void
+    DBStreamSqlite :: execStmt(void) {
+        TRACE_CALL();
 
-            throw runtime_error(ss.str());
-        }
+        // the same statement may have run before with other values
+        this->endQuery();
 
-        clog << "executing sql query: " << sql << endl;
+        timing = TRACE_ON(1);
+        step_ms = 0.0;
+        nrows = 0;
 
         this->nextRow();
 
@@ -486,6 +896,554 @@ namespace cccgi {
             throw runtime_error(ss.str());
         }
     }
+
+    // Logs the timings of the query that ran last, once.
+    void
+    DBStreamSqlite :: endQuery(void) {
+        if (!timing)
+            return;
+
+        clog << "query \"" << sql << "\": prepare " << prepare_ms << " ms"
+             << (stmt_cached ? " (cached)" : "")
+             << ", step " << step_ms << " ms, " << nrows << " rows" << endl;
+
+        timing = false;
+        // runs after the first don't prepare it again
+        prepare_ms = 0.0;
+        stmt_cached = true;
+    }
+
+    /*** FastCGI ***/
+
+    /*
+     * Just enough of FastCGI for the responder role: one request at a
+     * time on a connection, which is all the web servers do anyway.
+     */
+
+    enum {
+        FCGI_VERSION_1 = 1,
+
+        FCGI_BEGIN_REQUEST = 1,
+        FCGI_ABORT_REQUEST,
+        FCGI_END_REQUEST,
+        FCGI_PARAMS,
+        FCGI_STDIN,
+        FCGI_STDOUT,
+        FCGI_STDERR,
+        FCGI_DATA,
+        FCGI_GET_VALUES,
+        FCGI_GET_VALUES_RESULT,
+        FCGI_UNKNOWN_TYPE,
+
+        FCGI_RESPONDER = 1,
+        FCGI_KEEP_CONN = 1,
+
+        FCGI_REQUEST_COMPLETE = 0,
+        FCGI_CANT_MPX_CONN,
+        FCGI_OVERLOADED,
+        FCGI_UNKNOWN_ROLE,
+
+        FCGI_MAX_CONTENT = 65535
+    };
+
+    struct FcgiRecord {
+        int type;
+        int id;
+        string content;
+    };
+
+    static bool
+    read_full(int fd, void *buf, size_t len) {
+        char *p = (char *) buf;
+        ssize_t n;
+
+        while (len > 0) {
+            if ((n = read(fd, p, len)) == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    static bool
+    write_full(int fd, const void *buf, size_t len) {
+        const char *p = (const char *) buf;
+        ssize_t n;
+
+        while (len > 0) {
+            if ((n = write(fd, p, len)) == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    static bool
+    fcgi_read(int fd, FcgiRecord &rec) {
+        unsigned char h[8];
+        char pad[255];
+        size_t len;
+
+        if (!read_full(fd, h, sizeof h) || h[0] != FCGI_VERSION_1)
+            return false;
+        rec.type = h[1];
+        rec.id = h[2] << 8 | h[3];
+        len = h[4] << 8 | h[5];
+        rec.content.resize(len);
+        if (len > 0 && !read_full(fd, &rec.content[0], len))
+            return false;
+        return h[6] == 0 || read_full(fd, pad, h[6]);
+    }
+
+    static void
+    fcgi_header(unsigned char *h, int type, int id, size_t len) {
+        h[0] = FCGI_VERSION_1;
+        h[1] = type;
+        h[2] = id >> 8;
+        h[3] = id;
+        h[4] = len >> 8;
+        h[5] = len;
+        h[6] = h[7] = 0;
+    }
+
+    static bool
+    fcgi_write(int fd, int type, int id, const char *buf, size_t len) {
+        unsigned char h[8];
+
+        fcgi_header(h, type, id, len);
+
+        return write_full(fd, h, sizeof h) && (len == 0 || write_full(fd, buf, len));
+    }
+
+    /*
+     * Sends the response as a stream of records, ended by an empty one,
+     * with one writev(): the record headers go in between its pieces.
+     */
+    static bool
+    fcgi_stream(int fd, int type, int id, const Response &r) {
+        static vector<struct iovec> in, out;
+        static vector<unsigned char> headers;
+        vector<struct iovec>::iterator it;
+        struct iovec v;
+        size_t nrecords, rec, left, off, len;
+
+        r.iovecs(in);
+        // a record at most per FCGI_MAX_CONTENT bytes, and the empty one
+        nrecords = r.size() / FCGI_MAX_CONTENT + 2;
+        headers.resize(nrecords * 8);
+        out.clear();
+
+        rec = 0;
+        left = 0;
+        for (it = in.begin(); it != in.end(); ++it) {
+            for (off = 0; off < it->iov_len; off += len) {
+                if (left == 0) {
+                    left = min(r.size() - rec * FCGI_MAX_CONTENT, (size_t) FCGI_MAX_CONTENT);
+                    fcgi_header(&headers[rec * 8], type, id, left);
+                    v.iov_base = &headers[rec++ * 8];
+                    v.iov_len = 8;
+                    out.push_back(v);
+                }
+                len = min(it->iov_len - off, left);
+                v.iov_base = (char *) it->iov_base + off;
+                v.iov_len = len;
+                out.push_back(v);
+                left -= len;
+            }
+        }
+        fcgi_header(&headers[rec * 8], type, id, 0);
+        v.iov_base = &headers[rec * 8];
+        v.iov_len = 8;
+        out.push_back(v);
+
+        return writev_full(fd, &out[0], out.size());
+    }
+
+    static bool
+    fcgi_end_request(int fd, int id, int app_status, int protocol_status) {
+        char body[8];
+
+        body[0] = app_status >> 24;
+        body[1] = app_status >> 16;
+        body[2] = app_status >> 8;
+        body[3] = app_status;
+        body[4] = protocol_status;
+        body[5] = body[6] = body[7] = 0;
+
+        return fcgi_write(fd, FCGI_END_REQUEST, id, body, sizeof body);
+    }
+
+    static bool
+    fcgi_length(const string &s, string::size_type &pos, size_t &len) {
+        const unsigned char *p = (const unsigned char *) s.data() + pos;
+
+        if (pos >= s.length())
+            return false;
+        if (!(p[0] & 0x80)) {
+            len = p[0];
+            pos += 1;
+            return true;
+        }
+        if (pos + 4 > s.length())
+            return false;
+        len = (p[0] & 0x7f) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+        pos += 4;
+        return true;
+    }
+
+    static void
+    fcgi_put_length(string &s, size_t len) {
+        if (len < 0x80) {
+            s += (char) len;
+        } else {
+            s += (char) (len >> 24 | 0x80);
+            s += (char) (len >> 16);
+            s += (char) (len >> 8);
+            s += (char) len;
+        }
+    }
+
+    static bool
+    fcgi_params(const string &s, vector<pair<string, string> > &params) {
+        string::size_type pos = 0;
+        size_t nlen, vlen;
+
+        params.clear();
+        while (pos < s.length()) {
+            if (!fcgi_length(s, pos, nlen) || !fcgi_length(s, pos, vlen) || nlen + vlen > s.length() - pos)
+                return false;
+            params.push_back(make_pair(s.substr(pos, nlen), s.substr(pos + nlen, vlen)));
+            pos += nlen + vlen;
+        }
+        return true;
+    }
+
+    // the variables set for the request being served
+    static vector<string> request_env;
+
+    static void
+    set_request_env(const vector<pair<string, string> > &params) {
+        vector<pair<string, string> >::const_iterator it;
+        vector<string>::iterator name;
+
+        for (name = request_env.begin(); name != request_env.end(); ++name)
+            unsetenv(name->c_str());
+        request_env.clear();
+
+        for (it = params.begin(); it != params.end(); ++it) {
+            if (it->first.empty() || it->first.find('=') != string::npos)
+                continue;
+            setenv(it->first.c_str(), it->second.c_str(), 1);
+            request_env.push_back(it->first);
+        }
+
+        GET.reset();
+    }
+
+    // cout's own buffer while a page writes to RESPONSE instead
+    static streambuf *cout_buf;
+    // the page runs once, as a CGI program
+    static bool cgi;
+
+    static bool
+    gzip_wanted(void) {
+        const char *penv;
+
+        return (penv = getenv("CCCGI_GZIP")) != NULL && atoi(penv) > 0 &&
+               (penv = getenv("HTTP_ACCEPT_ENCODING")) != NULL && strstr(penv, "gzip") != NULL;
+    }
+
+    // A page that calls exit() still gets its output out as a CGI program.
+    static void
+    page_exited(void) {
+        if (cout_buf == NULL)
+            return;
+        cout.flush();
+        cout.rdbuf(cout_buf);
+        cout_buf = NULL;
+        if (cgi)
+            RESPONSE.writeTo(STDOUT_FILENO);
+    }
+
+    // Calls page with cout going to RESPONSE too, and cin reading body
+    // unless it's NULL.
+    static int
+    run_page(int (*page)(int, char **), int argc, char **argv, const string *body) {
+        stringbuf body_buf(body ? *body : string(), ios_base::in);
+        streambuf *cin_buf = NULL;
+        int status;
+
+        RESPONSE.clear();
+        if (body)
+            cin_buf = cin.rdbuf(&body_buf);
+        cout_buf = cout.rdbuf(&RESPONSE);
+        try {
+            status = page(argc, argv);
+            cout.flush();
+        } catch (exception &e) {
+            clog << "uncaught exception: " << e.what() << endl;
+            status = 1;
+            RESPONSE.clear();
+            RESPONSE << Text("Status: 500 Internal Server Error\r\n"
+                             "Content-Type: text/plain\r\n"
+                             "\r\n"
+                             "Internal Server Error\n");
+        }
+        cout.rdbuf(cout_buf);
+        cout_buf = NULL;
+        if (body) {
+            cin.rdbuf(cin_buf);
+            cin.clear();
+        }
+
+        if (gzip_wanted())
+            RESPONSE.gzip();
+
+        return status;
+    }
+
+    // Serves one request on the connection; false if it's to be closed.
+    static bool
+    fcgi_request(int fd, int (*page)(int, char **), int argc, char **argv) {
+        FcgiRecord rec;
+        vector<pair<string, string> > params;
+        string param_data, body, reply;
+        int id = -1, role, status;
+        bool keep_conn = false, params_done = false;
+
+        for (;;) {
+            if (!fcgi_read(fd, rec))
+                return false;
+
+            if (rec.id == 0) {
+                if (rec.type == FCGI_GET_VALUES) {
+                    reply.clear();
+                    fcgi_put_length(reply, sizeof("FCGI_MPXS_CONNS") - 1);
+                    fcgi_put_length(reply, 1);
+                    reply += "FCGI_MPXS_CONNS0";
+                    if (!fcgi_write(fd, FCGI_GET_VALUES_RESULT, 0, reply.data(), reply.length()))
+                        return false;
+                } else {
+                    char body[8] = { (char) rec.type };
+
+                    if (!fcgi_write(fd, FCGI_UNKNOWN_TYPE, 0, body, sizeof body))
+                        return false;
+                }
+                continue;
+            }
+
+            if (rec.type == FCGI_BEGIN_REQUEST) {
+                if (rec.content.length() < 8)
+                    return false;
+                role = (unsigned char) rec.content[0] << 8 | (unsigned char) rec.content[1];
+                if (id != -1) {
+                    if (!fcgi_end_request(fd, rec.id, 0, FCGI_CANT_MPX_CONN))
+                        return false;
+                } else if (role != FCGI_RESPONDER) {
+                    if (!fcgi_end_request(fd, rec.id, 0, FCGI_UNKNOWN_ROLE))
+                        return false;
+                    if (!(rec.content[2] & FCGI_KEEP_CONN))
+                        return false;
+                } else {
+                    id = rec.id;
+                    keep_conn = rec.content[2] & FCGI_KEEP_CONN;
+                }
+                continue;
+            }
+
+            if (rec.id != id)
+                continue;
+
+            if (rec.type == FCGI_ABORT_REQUEST)
+                return fcgi_end_request(fd, id, 0, FCGI_REQUEST_COMPLETE) && keep_conn;
+            if (rec.type == FCGI_PARAMS) {
+                if (rec.content.empty())
+                    params_done = true;
+                else
+                    param_data += rec.content;
+            } else if (rec.type == FCGI_STDIN) {
+                if (!rec.content.empty())
+                    body += rec.content;
+                else if (params_done)
+                    break;
+            }
+        }
+
+        if (!fcgi_params(param_data, params)) {
+            clog << "malformed FastCGI parameters" << endl;
+            return false;
+        }
+        set_request_env(params);
+
+        status = run_page(page, argc, argv, &body);
+
+        return fcgi_stream(fd, FCGI_STDOUT, id, RESPONSE) &&
+               fcgi_end_request(fd, id, status, FCGI_REQUEST_COMPLETE) &&
+               keep_conn;
+    }
+
+    // host:port, :port, or the path of a UNIX socket.
+    static int
+    listen_on(const string &addr) {
+        struct addrinfo hints, *res, *ai;
+        struct sockaddr_un sun;
+        string::size_type colon;
+        string host, port;
+        int fd = -1, on = 1, error;
+
+        if (addr.find('/') != string::npos) {
+            if (addr.length() >= sizeof(sun.sun_path))
+                throw runtime_error("socket path too long: " + addr);
+            memset(&sun, 0, sizeof sun);
+            sun.sun_family = AF_UNIX;
+            strcpy(sun.sun_path, addr.c_str());
+            unlink(sun.sun_path);
+            if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+                bind(fd, (struct sockaddr *) &sun, sizeof sun) == -1 ||
+                listen(fd, SOMAXCONN) == -1)
+                throw runtime_error("failed to listen on " + addr + ": " + strerror(errno));
+            return fd;
+        }
+
+        if ((colon = addr.rfind(':')) == string::npos)
+            throw runtime_error("expected host:port or a socket path: " + addr);
+        host = addr.substr(0, colon);
+        port = addr.substr(colon + 1);
+
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if ((error = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res)) != 0)
+            throw runtime_error("failed to resolve " + addr + ": " + gai_strerror(error));
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+                continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd == -1)
+            throw runtime_error("failed to listen on " + addr + ": " + strerror(errno));
+
+        return fd;
+    }
+
+    // FastCGI servers start the program with its socket as stdin.
+    static bool
+    stdin_is_listening_socket(void) {
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof ss;
+
+        if (getsockname(STDIN_FILENO, (struct sockaddr *) &ss, &len) == -1)
+            return false;
+        len = sizeof ss;
+        return getpeername(STDIN_FILENO, (struct sockaddr *) &ss, &len) == -1 && errno == ENOTCONN;
+    }
+
+    static void
+    worker(int lfd, int (*page)(int, char **), int argc, char **argv) {
+        int fd;
+
+        for (;;) {
+            if ((fd = accept(lfd, NULL, NULL)) == -1) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                clog << "accept: " << strerror(errno) << endl;
+                _exit(1);
+            }
+            while (fcgi_request(fd, page, argc, argv))
+                /* empty */;
+            close(fd);
+        }
+    }
+
+    static volatile sig_atomic_t stopping;
+
+    static void
+    stop(int) {
+        stopping = 1;
+    }
+
+    int
+    serve(int argc, char **argv, int (*page)(int, char **)) {
+        const char *listen_addr, *penv;
+        struct sigaction sa;
+        set<pid_t> workers;
+        set<pid_t>::iterator it;
+        pid_t pid;
+        long nworkers;
+        int lfd, status;
+
+        atexit(page_exited);
+
+        if ((listen_addr = getenv("CCCGI_LISTEN")) != NULL) {
+            lfd = listen_on(listen_addr);
+        } else if (stdin_is_listening_socket()) {
+            lfd = STDIN_FILENO;
+        } else {
+            cgi = true;
+            status = run_page(page, argc, argv, NULL);
+            RESPONSE.writeTo(STDOUT_FILENO);
+            RESPONSE.clear();
+            return status;
+        }
+
+        if ((nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+            nworkers = 1;
+        if ((penv = getenv("CCCGI_WORKERS")) != NULL && atol(penv) > 0)
+            nworkers = atol(penv);
+
+        signal(SIGPIPE, SIG_IGN);
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = stop;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+
+        while (!stopping) {
+            while ((long) workers.size() < nworkers && !stopping) {
+                if ((pid = fork()) == -1) {
+                    clog << "fork: " << strerror(errno) << endl;
+                    break;
+                }
+                if (pid == 0) {
+                    signal(SIGTERM, SIG_DFL);
+                    signal(SIGINT, SIG_DFL);
+                    worker(lfd, page, argc, argv);
+                }
+                workers.insert(pid);
+            }
+            if ((pid = wait(&status)) == -1) {
+                if (errno != EINTR)
+                    sleep(1);
+                continue;
+            }
+            workers.erase(pid);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                clog << "worker " << pid << " died, starting another" << endl;
+                // don't spin if they die straight away
+                sleep(1);
+            }
+        }
+
+        for (it = workers.begin(); it != workers.end(); ++it)
+            kill(*it, SIGTERM);
+        while (!workers.empty() && (pid = wait(&status)) != -1)
+            workers.erase(pid);
+        close(lfd);
+
+        return 0;
+    }
 };
 
 #ifdef TEST_LIBCCCGI
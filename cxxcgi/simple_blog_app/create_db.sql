@@ -15,8 +15,8 @@ create table tags (
 
 create table posts (
     id integer primary key autoincrement,
-    ctime datetime not null default CURRENT_DATETIME,
-    mtime datetime not null default CURRENT_DATETIME,
+    ctime datetime not null default CURRENT_TIMESTAMP,
+    mtime datetime not null default CURRENT_TIMESTAMP,
     title text not null,
     content text not null
 );
@@ -0,0 +1,10 @@
+; ops 400000
+; Non-tail recursion 100000 calls deep, four times.
+(defun depth (n)
+  (cond ((= n 0) 0)
+        ('t (+ 1 (depth (- n 1))))))
+(depth 100000)
+(depth 100000)
+(depth 100000)
+(depth 100000)
+(gc-stats)
@@ -0,0 +1,16 @@
+; ops 1000000
+; Builds, reverses and takes apart lists, 1000000 cons cells in all.
+(defun upto (n acc)
+  (cond ((= n 0) acc)
+        ('t (upto (- n 1) (cons n acc)))))
+(defun rev (l acc)
+  (cond ((null l) acc)
+        ('t (rev (cdr l) (cons (car l) acc)))))
+(defun len (l n)
+  (cond ((null l) n)
+        ('t (len (cdr l) (+ n 1)))))
+(defun round (k)
+  (cond ((= k 0) 0)
+        ('t (+ (len (rev (upto 5000 ()) ()) 0) (round (- k 1))))))
+(round 100)
+(gc-stats)
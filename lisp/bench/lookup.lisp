@@ -0,0 +1,14 @@
+; ops 400000
+; Looks up bindings from under 400 frames of others: 200000 calls
+; each resolve a function and a variable bound at the bottom.
+(defun get (x) x)
+(defun spin (n acc)
+  (cond ((= n 0) acc)
+        ('t (spin (- n 1) (get outer)))))
+(defun a (n p1 p2) (cond ((= n 0) (spin 200000 0)) ('t (b (- n 1) n n))))
+(defun b (n q1 q2) (cond ((= n 0) (spin 200000 0)) ('t (c (- n 1) n n))))
+(defun c (n r1 r2) (cond ((= n 0) (spin 200000 0)) ('t (d (- n 1) n n))))
+(defun d (n s1 s2) (cond ((= n 0) (spin 200000 0)) ('t (a (- n 1) n n))))
+(defun top (outer) (a 400 0 0))
+(top 'x)
+(gc-stats)
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Driver for `make bench'.  Runs the interpreter on every workload, a
+ * lisp file whose first line is "; ops N" and whose last form is
+ * (gc-stats), plus a generated parse-heavy one, and reports wall time
+ * and allocations per operation and peak RSS, the best of RUNS runs.
+ * With -b the results are compared against a baseline file and the
+ * exit status is 1 if any of them got worse by more than its slack;
+ * -w writes them out as the new baseline instead.
+ */
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS		5
+#define NPARSE		20000
+#define TIME_SLACK	1.25		/* wall time is noisy */
+#define ALLOC_SLACK	1.01
+#define RSS_SLACK	1.25
+
+struct result {
+	char            name[64];
+	double          ns;		/* per op */
+	double          allocs;		/* per op */
+	long            rss;		/* KB */
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bench [-b <baseline> | -w <baseline>] <lisp> <workload>...\n");
+	exit(2);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+ops_of(const char *file)
+{
+	FILE           *fp;
+	long            n = 0;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	if (fscanf(fp, "; ops %ld", &n) != 1 || n <= 0)
+		errx(1, "%s: doesn't start with \"; ops N\"", file);
+	fclose(fp);
+	return n;
+}
+
+/* The workload name: the file name without directory and extension. */
+static void
+name_of(const char *file, char *name, size_t size)
+{
+	const char     *s, *e;
+
+	s = (s = strrchr(file, '/')) != NULL ? s + 1 : file;
+	if ((e = strrchr(s, '.')) == NULL)
+		e = s + strlen(s);
+	snprintf(name, size, "%.*s", (int) (e - s), s);
+}
+
+/* Runs lisp on file once, returns the allocation count it printed. */
+static double
+run(const char *lisp, const char *file, double *secs, long *rss)
+{
+	struct rusage   ru;
+	char           *out = NULL, *p;
+	size_t          len = 0, size = 0;
+	ssize_t         n;
+	double          t;
+	pid_t           pid;
+	int             fd[2], status;
+
+	if (pipe(fd) == -1)
+		err(1, "pipe");
+	t = now();
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		dup2(fd[1], 1);
+		close(fd[0]);
+		close(fd[1]);
+		execl(lisp, lisp, file, (char *) NULL);
+		err(127, "%s", lisp);
+	}
+	close(fd[1]);
+	for (;;) {
+		if (len + 4096 > size) {
+			size = size ? size * 2 : 65536;
+			if ((out = realloc(out, size)) == NULL)
+				err(1, "realloc");
+		}
+		if ((n = read(fd[0], out + len, size - len - 1)) <= 0)
+			break;
+		len += n;
+	}
+	close(fd[0]);
+	if (wait4(pid, &status, 0, &ru) == -1)
+		err(1, "wait4");
+	*secs = now() - t;
+	*rss = ru.ru_maxrss;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "%s %s: failed", lisp, file);
+
+	out[len] = '\0';
+	if ((p = strstr(out, "(allocations ")) == NULL)
+		errx(1, "%s: no (gc-stats) output", file);
+	t = strtod(p + strlen("(allocations "), NULL);
+	free(out);
+	return t;
+}
+
+static void
+measure(const char *lisp, const char *file, const char *name, struct result * r)
+{
+	double          secs, best = 0, allocs = 0;
+	long            ops, rss;
+	int             i;
+
+	ops = ops_of(file);
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->rss = 0;
+	for (i = 0; i < RUNS; ++i) {
+		allocs = run(lisp, file, &secs, &rss);
+		if (i == 0 || secs < best)
+			best = secs;
+		if (rss > r->rss)
+			r->rss = rss;
+	}
+	r->ns = best * 1e9 / ops;
+	r->allocs = allocs / ops;
+}
+
+/* NPARSE top-level forms of nested quoted lists with distinct atoms. */
+static char    *
+gen_parse(void)
+{
+	static char     path[] = "/tmp/lisp-bench-XXXXXX";
+	FILE           *fp;
+	int             fd, i;
+
+	if ((fd = mkstemp(path)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+		err(1, "%s", path);
+	fprintf(fp, "; ops %d\n", NPARSE);
+	for (i = 0; i < NPARSE; ++i) {
+		fprintf(fp, "(atom '(defun f%d (a%d b) ; comment\n"
+		    "  (cond ((eq a%d 'x%d) (cons b '(1 2.5 %d)))\n"
+		    "        ('t (f%d (cdr a%d) (list b s%d))))))\n",
+		    i, i % 97, i % 97, i, i, i, i % 97, i);
+	}
+	fprintf(fp, "(gc-stats)\n");
+	if (fclose(fp) == EOF)
+		err(1, "%s", path);
+	return path;
+}
+
+static int
+load_baseline(const char *file, struct result ** base)
+{
+	struct result   r;
+	FILE           *fp;
+	char            line[256];
+	int             n = 0;
+
+	*base = NULL;
+	if ((fp = fopen(file, "r")) == NULL)
+		err(1, "%s", file);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%63s %lf %lf %ld", r.name, &r.ns, &r.allocs, &r.rss) != 4)
+			continue;
+		*base = realloc(*base, (n + 1) * sizeof(**base));
+		(*base)[n++] = r;
+	}
+	fclose(fp);
+	return n;
+}
+
+static double
+change(double now, double then)
+{
+	return then > 0 ? (now / then - 1) * 100 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct result  *res, *base = NULL, *b;
+	const char     *bfile = NULL, *wfile = NULL, *parse;
+	char            name[64];
+	FILE           *fp;
+	int             c, i, j, n, nbase = 0, worse = 0, bad;
+
+	while ((c = getopt(argc, argv, "b:w:")) != -1) {
+		switch (c) {
+		case 'b':
+			bfile = optarg;
+			break;
+		case 'w':
+			wfile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+
+	n = argc - 1;
+	res = calloc(n + 1, sizeof(*res));
+	for (i = 0; i < n; ++i) {
+		name_of(argv[i + 1], name, sizeof(name));
+		measure(argv[0], argv[i + 1], name, &res[i]);
+	}
+	parse = gen_parse();
+	measure(argv[0], parse, "parse", &res[n++]);
+	unlink(parse);
+
+	if (bfile != NULL)
+		nbase = load_baseline(bfile, &base);
+	printf("%-10s %10s %8s %10s %8s %8s %8s\n", "workload", "ns/op", "change",
+	    "allocs/op", "change", "rss-kb", "change");
+	for (i = 0; i < n; ++i) {
+		for (b = NULL, j = 0; j < nbase; ++j) {
+			if (!strcmp(base[j].name, res[i].name))
+				b = &base[j];
+		}
+		if (b == NULL) {
+			printf("%-10s %10.1f %8s %10.2f %8s %8ld\n", res[i].name,
+			    res[i].ns, "", res[i].allocs, "", res[i].rss);
+			continue;
+		}
+		bad = res[i].ns > b->ns * TIME_SLACK ||
+		    res[i].allocs > b->allocs * ALLOC_SLACK ||
+		    res[i].rss > b->rss * RSS_SLACK;
+		worse |= bad;
+		printf("%-10s %10.1f %+7.1f%% %10.2f %+7.1f%% %8ld %+7.1f%%%s\n",
+		    res[i].name, res[i].ns, change(res[i].ns, b->ns),
+		    res[i].allocs, change(res[i].allocs, b->allocs),
+		    res[i].rss, change(res[i].rss, b->rss),
+		    bad ? "  WORSE" : "");
+	}
+
+	if (wfile != NULL) {
+		if ((fp = fopen(wfile, "w")) == NULL)
+			err(1, "%s", wfile);
+		fprintf(fp, "# workload ns/op allocs/op rss-kb\n");
+		for (i = 0; i < n; ++i)
+			fprintf(fp, "%s %.1f %.6g %ld\n", res[i].name, res[i].ns, res[i].allocs, res[i].rss);
+		if (fclose(fp) == EOF)
+			err(1, "%s", wfile);
+	}
+	free(res);
+	free(base);
+	return worse;
+}
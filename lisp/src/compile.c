@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Compiler from expressions to VM code.  Lambda bodies are compiled on
+ * first call and cached: the lambda expression stores an index into
+ * codetab.  Parameters of the lambda being compiled are resolved to
+ * slot numbers, every other atom is looked up through the context
+ * chain at run time, as the dynamic scoping of eval() requires.
+ * Forms the compiler doesn't know are left to the tree-walking eval().
+ *
+ * pmap workers may compile and drop lambdas concurrently: that's done
+ * under codetab_lock, and a codetab that grew is not freed while they
+ * run since others may still be reading it without the lock.
+ */
+
+#include <pthread.h>
+
+#include "lisp.h"
+#include "vm.h"
+#include "eval.h"
+#include "mem.h"
+#include "sym.h"
+#include "num.h"
+#include "pool.h"
+
+struct cstate {
+	struct code    *c;
+	int             depth;
+};
+
+static struct code **codetab;
+static int      ncodetab;
+static int      codetabsize;
+static int     *freecodes;
+static int      nfreecodes;
+static pthread_mutex_t codetab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void     compile_expr(struct cstate * st, const struct expr * e, int tail);
+
+static void
+emit(struct cstate * st, int w)
+{
+	struct code    *c = st->c;
+
+	if (c->nins == c->insize) {
+		c->insize = c->insize ? c->insize * 2 : 32;
+		c->ins = realloc(c->ins, c->insize * sizeof(*c->ins));
+	}
+	c->ins[c->nins++] = w;
+}
+
+static void
+adjust(struct cstate * st, int n)
+{
+	st->depth += n;
+	if (st->depth > st->c->maxstack)
+		st->c->maxstack = st->depth;
+}
+
+/* Takes over the reference to e. */
+static int
+add_const(struct cstate * st, struct expr * e)
+{
+	struct code    *c = st->c;
+
+	if (c->nconsts == c->constsize) {
+		c->constsize = c->constsize ? c->constsize * 2 : 8;
+		c->consts = realloc(c->consts, c->constsize * sizeof(*c->consts));
+	}
+	c->consts[c->nconsts] = e;
+	return c->nconsts++;
+}
+
+static void
+emit_const(struct cstate * st, struct expr * e)
+{
+	emit(st, OP_CONST);
+	emit(st, add_const(st, e));
+	adjust(st, 1);
+}
+
+static void
+emit_form(struct cstate * st, int op, const struct expr * e)
+{
+	emit(st, op);
+	emit(st, add_const(st, exprs_dup(e)));
+	adjust(st, 1);
+}
+
+/* Emit a forward jump, return the position of its offset. */
+static int
+emit_jump(struct cstate * st, int op)
+{
+	emit(st, op);
+	emit(st, 0);
+	return st->c->nins - 1;
+}
+
+static void
+patch_jump(struct cstate * st, int pos)
+{
+	st->c->ins[pos] = st->c->nins - (pos + 1);
+}
+
+static int
+param_index(struct cstate * st, const struct atom * a)
+{
+	int             i;
+
+	for (i = st->c->nparams; i-- > 0;) {
+		if (st->c->params[i] == a)
+			return i;
+	}
+	return -1;
+}
+
+static int
+compile_args(struct cstate * st, const struct expr * e)
+{
+	struct list    *l;
+	int             n = 0;
+
+	for (l = e->v.list->next; l != NULL; l = l->next, ++n)
+		compile_expr(st, l->v, 0);
+	return n;
+}
+
+static void
+compile_cond(struct cstate * st, const struct expr * e, int tail)
+{
+	struct list    *l;
+	int             base, next, *ends, nends = 0;
+
+	for (l = e->v.list->next; l != NULL; l = l->next) {
+		if (TYPE(l->v) != LLIST || list_len(l->v) < 2) {
+			emit_const(st, empty_list());
+			return;
+		}
+	}
+
+	ends = malloc(list_len(e) * sizeof(*ends));
+	base = st->depth;
+	for (l = e->v.list->next; l != NULL; l = l->next) {
+		compile_expr(st, l->v->v.list->v, 0);
+		next = emit_jump(st, OP_JMPNT);
+		adjust(st, -1);
+		compile_expr(st, l->v->v.list->next->v, tail);
+		ends[nends++] = emit_jump(st, OP_JMP);
+		st->depth = base;
+		patch_jump(st, next);
+	}
+	emit_const(st, empty_list());
+	while (nends-- > 0)
+		patch_jump(st, ends[nends]);
+	free(ends);
+}
+
+static void
+compile_builtin(struct cstate * st, const struct expr * e, struct expr * (*op) (struct expr *, struct context *), int tail)
+{
+	int             n, ins;
+
+	n = list_len(e);
+	if (op == quote) {
+		emit_const(st, n < 2 ? empty_list() : exprs_dup(e->v.list->next->v));
+	} else if (op == atom || op == car || op == cdr || op == null || op == not) {
+		if (n < 2) {
+			emit_const(st, empty_list());
+			return;
+		}
+		compile_expr(st, e->v.list->next->v, 0);
+		ins = op == atom ? OP_ATOM : op == car ? OP_CAR : op == cdr ? OP_CDR : OP_NULL;
+		emit(st, ins);
+	} else if (op == eq || op == cons || op == and) {
+		if (n < 3) {
+			emit_const(st, empty_list());
+			return;
+		}
+		compile_expr(st, e->v.list->next->v, 0);
+		compile_expr(st, e->v.list->next->next->v, 0);
+		emit(st, op == eq ? OP_EQ : op == cons ? OP_CONS : OP_AND);
+		adjust(st, -1);
+	} else if (op == list) {
+		if (n < 2) {
+			emit_const(st, empty_list());
+			return;
+		}
+		compile_args(st, e);
+		emit(st, OP_LIST);
+		emit(st, n - 1);
+		adjust(st, -(n - 1) + 1);
+	} else if (n == 3 && (ins = num_op(op)) != -1) {
+		compile_expr(st, e->v.list->next->v, 0);
+		compile_expr(st, e->v.list->next->next->v, 0);
+		emit(st, OP_NUM);
+		emit(st, ins);
+		adjust(st, -1);
+	} else if (op == cond) {
+		if (n < 2)
+			emit_const(st, empty_list());
+		else
+			compile_cond(st, e, tail);
+	} else {
+		emit_form(st, OP_CALLOP, e);
+	}
+}
+
+/* (f args...) where f is not a builtin */
+static void
+compile_call(struct cstate * st, const struct expr * e, int tail)
+{
+	int             n, skip;
+
+	n = list_len(e) - 1;
+	emit(st, OP_FUNC);
+	emit(st, add_const(st, exprs_dup(e->v.list->v)));
+	emit(st, add_const(st, exprs_dup(e)));
+	emit(st, n);
+	emit(st, 0);
+	skip = st->c->nins - 1;
+	adjust(st, 1);
+	compile_args(st, e);
+	emit(st, tail ? OP_TAILCALL : OP_CALL);
+	emit(st, n);
+	adjust(st, -n);
+	patch_jump(st, skip);
+}
+
+/* tail is set when the value of e is the value of the whole code */
+static void
+compile_expr(struct cstate * st, const struct expr * e, int tail)
+{
+	const struct expr *head;
+	int             i, n;
+
+	if (e == NULL) {
+		emit_const(st, empty_list());
+		return;
+	}
+	if (is_number(e)) {
+		emit_const(st, exprs_dup(e));
+		return;
+	}
+	if (e->quoted) {
+		emit_const(st, quote((struct expr *) e, NULL));
+		return;
+	}
+	if (TYPE(e) == LATOM) {
+		if ((i = param_index(st, e->v.atom)) != -1) {
+			emit(st, OP_LOCAL);
+			emit(st, i);
+			adjust(st, 1);
+		} else {
+			emit(st, OP_GLOBAL);
+			emit(st, add_const(st, exprs_dup(e)));
+			adjust(st, 1);
+		}
+		return;
+	}
+	if (TYPE(e) != LLIST) {
+		emit_form(st, OP_EVAL, e);
+		return;
+	}
+	if (e->v.list == NULL) {
+		emit_const(st, exprs_dup(e));
+		return;
+	}
+	head = e->v.list->v;
+	if (is_number(head) || !head->v.list) {
+		emit_const(st, empty_list());
+		return;
+	}
+	if (TYPE(head) == LATOM) {
+		if (head->v.atom->op != NULL)
+			compile_builtin(st, e, head->v.atom->op, tail);
+		else
+			compile_call(st, e, tail);
+	} else if (is_function_call_expr(e) && lambda_nparams(head) == list_len(e) - 1) {
+		emit_const(st, exprs_dup(head));
+		n = compile_args(st, e);
+		emit(st, tail ? OP_TAILCALL : OP_CALL);
+		emit(st, n);
+		adjust(st, -n);
+	} else {
+		emit_form(st, OP_EVAL, e);
+	}
+}
+
+struct code    *
+compile(const struct expr * e, struct atom ** params, int nparams)
+{
+	struct cstate   st;
+
+	st.c = calloc(1, sizeof(*st.c));
+	st.depth = 0;
+	if (nparams > 0) {
+		st.c->params = malloc(nparams * sizeof(*params));
+		memcpy(st.c->params, params, nparams * sizeof(*params));
+	}
+	st.c->nparams = nparams;
+	while (nparams-- > 0)
+		st.c->mask |= SYM_BIT(params[nparams]);
+	compile_expr(&st, e, 1);
+	emit(&st, OP_RET);
+	return st.c;
+}
+
+void
+free_code(struct code * c)
+{
+	int             i;
+
+	if (c == NULL)
+		return;
+	for (i = 0; i < c->nconsts; ++i)
+		free_expr(c->consts[i]);
+	free(c->consts);
+	free(c->ins);
+	free(c->params);
+	free(c);
+}
+
+/*
+ * Number of parameters if lambda is something eval() would call as
+ * a function with every parameter an atom, -1 otherwise.
+ */
+int
+lambda_nparams(const struct expr * lambda)
+{
+	const struct list *l;
+	const struct expr *p;
+	int             n = 0;
+
+	if (!lambda || TYPE(lambda) != LLIST || lambda->v.list == NULL)
+		return -1;
+	if (!lambda->v.list->v || TYPE(lambda->v.list->v) != LATOM || lambda->v.list->v->v.atom != sym_lambda)
+		return -1;
+	if (list_len(lambda) < 3 || (p = lambda->v.list->next->v) == NULL || TYPE(p) != LLIST)
+		return -1;
+	for (l = p->v.list; l != NULL; l = l->next, ++n) {
+		if (l->v == NULL || TYPE(l->v) != LATOM)
+			return -1;
+	}
+	return n;
+}
+
+struct code    *
+code_of(const struct expr * e)
+{
+	int             i;
+
+	i = __atomic_load_n(&e->code, __ATOMIC_ACQUIRE);
+	return i ? __atomic_load_n(&codetab, __ATOMIC_ACQUIRE)[i - 1] : NULL;
+}
+
+static void
+grow_codetab(void)
+{
+	struct code   **old, **new;
+
+	old = codetab;
+	codetabsize = codetabsize ? codetabsize * 2 : 16;
+	new = malloc(codetabsize * sizeof(*new));
+	if (old != NULL)
+		memcpy(new, old, ncodetab * sizeof(*new));
+	__atomic_store_n(&codetab, new, __ATOMIC_RELEASE);
+	freecodes = realloc(freecodes, codetabsize * sizeof(*freecodes));
+	if (!threaded)
+		free(old);
+}
+
+/* lambda must have passed lambda_nparams() */
+struct code    *
+lambda_code(struct expr * lambda)
+{
+	struct atom   **params;
+	struct list    *l;
+	struct code    *c;
+	int             i, n;
+
+	if ((c = code_of(lambda)) != NULL)
+		return c;
+	if (threaded) {
+		pthread_mutex_lock(&codetab_lock);
+		if ((c = code_of(lambda)) != NULL) {
+			pthread_mutex_unlock(&codetab_lock);
+			return c;
+		}
+	}
+
+	n = lambda_nparams(lambda);
+	params = malloc((n + 1) * sizeof(*params));
+	for (i = 0, l = lambda->v.list->next->v->v.list; l != NULL; l = l->next)
+		params[i++] = l->v->v.atom;
+	c = compile(lambda->v.list->next->next->v, params, n);
+	free(params);
+
+	if (nfreecodes > 0) {
+		i = freecodes[--nfreecodes];
+	} else {
+		if (ncodetab == codetabsize)
+			grow_codetab();
+		i = ncodetab++;
+	}
+	codetab[i] = c;
+	__atomic_store_n(&lambda->code, i + 1, __ATOMIC_RELEASE);
+	if (threaded)
+		pthread_mutex_unlock(&codetab_lock);
+	return c;
+}
+
+static void
+release_code(struct expr * e, int unref)
+{
+	struct code    *c;
+
+	if (threaded)
+		pthread_mutex_lock(&codetab_lock);
+	c = codetab[e->code - 1];
+	freecodes[nfreecodes++] = e->code - 1;
+	e->code = 0;
+	if (threaded)
+		pthread_mutex_unlock(&codetab_lock);
+	if (unref) {
+		free_code(c);
+	} else {
+		free(c->consts);
+		free(c->ins);
+		free(c->params);
+		free(c);
+	}
+}
+
+void
+drop_code(struct expr * e)
+{
+	release_code(e, 1);
+}
+
+/* Used by the sweeper: constants are garbage too or still referenced. */
+void
+forget_code(struct expr * e)
+{
+	release_code(e, 0);
+}
@@ -14,14 +14,37 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "lisp.h"
 #include "eval.h"
 #include "mem.h"
 #include "util.h"
+#include "sym.h"
+#include "gc.h"
+#include "num.h"
+#include "parse.h"
+#include "prof.h"
+#include "pool.h"
+#include "vm.h"
+
+#define CSTACK_DEFAULT	(8 * 1024 * 1024)
 
 extern int      dflag;
+extern char   **environ;
+
+_Thread_local jmp_buf eval_top;
+
+static _Thread_local char *cstack_base;
+static _Thread_local size_t cstack_limit;
 
 const char     *ops[] = {
 	"quote",
@@ -38,6 +61,23 @@ const char     *ops[] = {
 	"and",
 	"not",
 	"exec",
+	"gc-stats",
+	"exec-all",
+	"read-file",
+	"split",
+	"getenv",
+	"pmap",
+	"pfor",
+	"+",
+	"-",
+	"*",
+	"/",
+	"mod",
+	"<",
+	">",
+	"<=",
+	">=",
+	"=",
 	NULL
 };
 
@@ -56,158 +96,332 @@ struct expr    *(*op_funcs[]) (struct expr *, struct context *) = {
 	and,
 	not,
 	exec,
+	gcstats,
+	execall,
+	readfile,
+	split,
+	envvar,
+	pmap,
+	pfor,
+	plus,
+	minus,
+	times,
+	divide,
+	modulo,
+	lt,
+	gt,
+	le,
+	ge,
+	numeq,
 	NULL
 };
 
-static int      is_atom_t(struct expr * e);
-static int      is_empty_list(struct expr * e);
+static struct expr *cond_branch(struct expr * e, struct context * ctx);
+static int      is_shadowed(const struct context * old, const struct context * new);
+static pid_t    spawn(struct args * a);
+static void     add_stat(struct expr * re, const char *name, struct expr * v);
+static struct expr *prof_leaf(struct expr * e, struct context * ctx);
 
-struct expr    *
-eval(struct expr * e, struct context * ctx)
+/*
+ * With -p, the builtins the VM runs inline get their arguments
+ * evaluated first and are only counted, as the VM does them, so that
+ * -i gives the same stacks.  NULL for the other builtins.
+ */
+static struct expr *
+prof_leaf(struct expr * e, struct context * ctx)
 {
-	int             i, is_root_level;
-	struct expr    *pa, *pb, *pc, *pe, **ev, *re;
+	struct expr    *(*op) (struct expr *, struct context *);
+	struct expr    *a, *b = NULL, *re;
+	struct list    *l, **tail;
+	size_t          nallocs;
+	int             n, ins, nargs = 2, num = 0;
+
+	op = e->v.list->v->v.atom->op;
+	n = list_len(e);
+	if (op == atom || op == car || op == cdr || op == null || op == not) {
+		ins = op == atom ? OP_ATOM : op == car ? OP_CAR : op == cdr ? OP_CDR : OP_NULL;
+		nargs = 1;
+	} else if (op == eq || op == cons || op == and)
+		ins = op == eq ? OP_EQ : op == cons ? OP_CONS : OP_AND;
+	else if (op == list) {
+		ins = OP_LIST;
+		nargs = 1;
+	} else if (n == 3 && (num = num_op(op)) != -1)
+		ins = OP_NUM;
+	else
+		return NULL;
+	/* what the builtin gives for too few arguments */
+	if (n < nargs + 1)
+		return empty_list();
 
-	if (ctx->is_root_level) {
-		is_root_level = 1;
-		ctx->is_root_level = 0;
-	} else {
-		is_root_level = 0;
+	if (ins == OP_LIST) {
+		re = new_expr(LLIST);
+		tail = &re->v.list;
+		for (l = e->v.list->next; l != NULL; l = l->next) {
+			*tail = new_list();
+			(*tail)->v = eval(l->v, ctx);
+			tail = &(*tail)->next;
+		}
+		prof_count(leaf_name(OP_LIST, 0), n);
+		return re;
 	}
 
-	dbgprintf("\n>>> EVAL <<<\n");
-	if (dflag) {
-		peval(e, "@    ");
-		pcontext(ctx, "<    ");
+	a = eval(e->v.list->next->v, ctx);
+	if (nargs == 2)
+		b = eval(e->v.list->next->next->v, ctx);
+	nallocs = prof_nallocs();
+	switch (ins) {
+	case OP_ATOM:
+		re = atom_of(a);
+		break;
+	case OP_CAR:
+		re = car_of(a);
+		break;
+	case OP_CDR:
+		re = cdr_of(a);
+		break;
+	case OP_NULL:
+		re = null_of(a);
+		break;
+	case OP_EQ:
+		re = eq_of(a, b);
+		break;
+	case OP_CONS:
+		re = cons_of(a, b);
+		break;
+	case OP_AND:
+		re = and_of(a, b);
+		break;
+	default:
+		re = num_of(num, a, b);
+		break;
 	}
-	if (e == NULL) {
-		dbgprintf(">>> NULL\n");
-		re = empty_list();
-		if (is_root_level) {
-			free_expr(e);
-			free(e);
+	free_expr(a);
+	free_expr(b);
+	prof_count(leaf_name(ins, num), prof_nallocs() - nallocs);
+	return re;
+}
+
+/*
+ * Forms in tail position (a cond branch, a lambda body, the expansion
+ * of a call through an atom) are evaluated by looping rather than
+ * recursing.  Frames made here are freed on return, except when the
+ * next call shadows everything the frame binds: then nothing can see
+ * it any more and it goes right away, so tail recursion runs in
+ * constant space.
+ */
+struct expr    *
+eval(struct expr * e, struct context * ctx)
+{
+	struct expr    *pe, *ne, *re, *hold = NULL;
+	struct expr    *(*op) (struct expr *, struct context *);
+	struct context *caller = ctx, *nctx;
+	struct atom    *name = NULL;
+	int             nprof = 0;
+	char            here;
+
+	if (cstack_base != NULL && (size_t) (cstack_base - &here) > cstack_limit)
+		eval_error("out of C stack, recursion too deep");
+
+	for (;;) {
+		dbgprintf("\n>>> EVAL <<<\n");
+		if (dflag) {
+			peval(e, "@    ");
+			pcontext(ctx, "<    ");
 		}
-		return re;
-	}
-	if (e->quoted) {
-		dbgprintf(">>> QUOTE\n");
-		re = quote(e, ctx);
-		if (is_root_level) {
-			free_expr(e);
-			free(e);
+		if (e == NULL) {
+			dbgprintf(">>> NULL\n");
+			re = empty_list();
+			break;
 		}
-		return re;
-	}
-	if (e->t == LATOM) {
-		dbgprintf(">>> RET ATOM\n");
-		if ((pe = search_context(ctx, e->v.atom->v)) != NULL) {
-			re = exprs_dup(pe);
-			if (is_root_level) {
-				free_expr(e);
-				free(e);
-			}
-			return re;
-		} else {
+		if (IS_FIXNUM(e)) {
+			re = e;
+			break;
+		}
+		if (e->quoted) {
+			dbgprintf(">>> QUOTE\n");
+			re = quote(e, ctx);
+			break;
+		}
+		if (TYPE(e) == LATOM) {
+			dbgprintf(">>> RET ATOM\n");
+			pe = search_context(ctx, e->v.atom);
+			re = exprs_dup(pe ? pe : e);
+			break;
+		}
+		if (e->t != LLIST || e->v.list == NULL) {
+			/* numbers evaluate to themselves */
 			re = exprs_dup(e);
-			if (is_root_level) {
-				free_expr(e);
-				free(e);
-			}
-			return re;
+			break;
+		}
+		if (is_number(e->v.list->v) || !e->v.list->v->v.list) {
+			re = empty_list();
+			break;
 		}
-	} else if (e->t == LLIST) {
-		if (e->v.list == NULL)
-			return exprs_dup(e);
-
-		if (!e->v.list->v->v.list)
-			return empty_list();
 
-		if (e->v.list->v->t == LATOM) {
-			for (i = 0; ops[i] != NULL; ++i) {
-				if (!strcmp(ops[i], e->v.list->v->v.atom->v))
+		if (TYPE(e->v.list->v) == LATOM) {
+			op = e->v.list->v->v.atom->op;
+			if (op == cond) {
+				dbgprintf(">>> cond\n");
+				if ((e = cond_branch(e, ctx)) == NULL) {
+					re = empty_list();
 					break;
-			}
-
-			if (ops[i] == NULL) {
-				if (pe = search_context(ctx, e->v.list->v->v.atom->v)) {
-					free_expr(e->v.list->v);
-					e->v.list->v = exprs_dup(pe);
-					return eval(e, ctx);
-				} else {
-					return empty_list();
 				}
+				continue;
 			}
-			dbgprintf(">>> %s\n", ops[i]);
-			re = op_funcs[i] (e, ctx);
-			if (is_root_level) {
-				free_expr(e);
-				free(e);
+			if (op != NULL) {
+				dbgprintf(">>> %s\n", e->v.list->v->v.atom->v);
+				if (pflag && (re = prof_leaf(e, ctx)) != NULL)
+					break;
+				if (pflag)
+					prof_enter(e->v.list->v->v.atom);
+				re = op(e, ctx);
+				if (pflag)
+					prof_leave();
+				break;
 			}
-			return re;
-		} else if (e->v.list->v->t == LLIST) {
-			/* First check if it's a lambda */
-			if (is_function_call_expr(e)) {
-				dbgprintf(">>> IS FUNCTION CALL\n");
-				re = lambda(e, ctx);
-				if (is_root_level) {
-					free_expr(e);
-					free(e);
-				}
-				return re;
-			} else {
-				dbgprintf(">>> IS NOT FUNCTION CALL\n");
-				pe = eval(e->v.list->v, ctx);
-				free_expr(e->v.list->v);
-				e->v.list->v = (struct expr *) pe;
-				re = eval(e, ctx);
-				if (is_root_level) {
-					free_expr(e);
-					free(e);
+			if ((pe = search_context(ctx, e->v.list->v->v.atom)) == NULL) {
+				re = empty_list();
+				break;
+			}
+			name = e->v.list->v->v.atom;
+			ne = replace_head(e, exprs_dup(pe));
+		} else if (is_function_call_expr(e)) {
+			dbgprintf(">>> IS FUNCTION CALL\n");
+			nctx = lambda_frame(e, ctx);
+			if (ctx != caller && is_shadowed(ctx, nctx)) {
+				nctx->next = ctx->next;
+				nctx->upmask = ctx->next->upmask | nctx->mask;
+				free_context(ctx);
+				gc_free(ctx);
+				if (pflag) {
+					prof_leave();
+					--nprof;
 				}
-				return re;
 			}
+			if (pflag) {
+				prof_enter(name ? name : sym_lambda);
+				++nprof;
+			}
+			name = NULL;
+			ctx = nctx;
+			e = e->v.list->v->v.list->next->next->v;
+			continue;
+		} else {
+			dbgprintf(">>> IS NOT FUNCTION CALL\n");
+			ne = replace_head(e, eval(e->v.list->v, ctx));
+			name = NULL;
 		}
+		/* e may belong to hold, it's not needed past this point */
+		free_expr(hold);
+		hold = e = ne;
 	}
-	return NULL;
+
+	while (nprof-- > 0)
+		prof_leave();
+	while (ctx != caller) {
+		nctx = ctx->next;
+		free_context(ctx);
+		gc_free(ctx);
+		ctx = nctx;
+	}
+	free_expr(hold);
+	return re;
+}
+
+void
+eval_error(const char *fmt,...)
+{
+	va_list         ap;
+
+	va_start(ap, fmt);
+	vwarnx(fmt, ap);
+	va_end(ap);
+	longjmp(eval_top, 1);
+}
+
+/* Size of the main thread's stack, pmap workers get the same. */
+size_t
+cstack_size(void)
+{
+	struct rlimit   rl;
+
+	if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		return rl.rlim_cur;
+	return CSTACK_DEFAULT;
+}
+
+/* Called by every thread with the address of one of its first locals. */
+void
+set_stack_base(void *base)
+{
+	cstack_base = base;
+	cstack_limit = cstack_size();
+	cstack_limit -= cstack_limit / 8;
+}
+
+/* Does every binding in frame old have one in frame new too? */
+static int
+is_shadowed(const struct context * old, const struct context * new)
+{
+	int             i;
+
+	if (old->nslots != 0)
+		return 0;
+	if ((old->mask & new->mask) != old->mask)
+		return 0;
+	for (i = 0; i < old->mapsize; ++i) {
+		if (old->map[i].k != NULL && search_context_i(new, old->map[i].k) == -1)
+			return 0;
+	}
+	return 1;
 }
 
 struct expr    *
 atom_t(void)
 {
-	struct expr    *e;
+	static struct expr *t;
 
-	e = new_expr(LATOM);
-	e->v.atom = new_atom("t");
-
-	return e;
+	if (t == NULL) {
+		t = new_expr(LATOM);
+		t->v.atom = sym_t;
+		gc_set_perm(t);
+	}
+	return exprs_dup(t);
 }
 
 struct expr    *
 empty_list(void)
 {
-	return new_expr(LLIST);
+	static struct expr *nil;
+
+	if (nil == NULL) {
+		nil = new_expr(LLIST);
+		gc_set_perm(nil);
+	}
+	return exprs_dup(nil);
 }
 
 struct expr    *
 quote(struct expr * e, struct context * ctx)
 {
 	struct expr    *re;
-	int             len;
 
 	if (e == NULL)
 		return empty_list();
 
 	if (e->quoted) {
-		re = exprs_dup(e);
-		re->quoted = 0;
+		re = new_expr(e->t);
+		if (e->t == LATOM)
+			re->v.atom = atom_dup(e->v.atom);
+		else if (e->t == LLIST)
+			re->v.list = list_dup(e->v.list);
 	} else {
 		if (list_len(e) < 2)
 			re = empty_list();
 		else
 			re = exprs_dup(e->v.list->next->v);
-
 	}
-	free_expr(e);
 	return re;
 }
 
@@ -215,21 +429,13 @@ struct expr    *
 atom(struct expr * e, struct context * ctx)
 {
 	struct expr    *a, *re;
-	int             n;
 
-	if (!e || list_len(e) < 2) {
-		free_expr(e);
+	if (!e || list_len(e) < 2)
 		return empty_list();
-	}
+
 	a = eval(e->v.list->next->v, ctx);
-	if (a->t == LATOM)
-		re = atom_t();
-	else if (a->t == LLIST && list_len(a) == 0)
-		re = atom_t();
-	else
-		re = empty_list();
-	full_free_expr(a);
-	free_expr(e);
+	re = atom_of(a);
+	free_expr(a);
 	return re;
 }
 
@@ -238,33 +444,14 @@ eq(struct expr * e, struct context * ctx)
 {
 	struct expr    *a, *b, *re;
 
-	if (!e)
+	if (!e || list_len(e) < 3)
 		return empty_list();
 
-	if (list_len(e) < 3) {
-		free_expr(e);
-		return empty_list();
-	}
 	a = eval(e->v.list->next->v, ctx);
 	b = eval(e->v.list->next->next->v, ctx);
-	if (a->t != b->t) {
-		re = empty_list();
-	} else if (a->t == LLIST) {
-		if (a->v.list == NULL && b->v.list == NULL)
-			re = atom_t();
-		else
-			re = empty_list();
-	} else if (!a->v.atom->v || !b->v.atom->v) {
-		re = empty_list();
-	} else if (!strcmp(a->v.atom->v, b->v.atom->v)) {
-		re = atom_t();
-	} else {
-		re = empty_list();
-	}
-
-	full_free_expr(a);
-	full_free_expr(b);
-	free_expr(e);
+	re = eq_of(a, b);
+	free_expr(a);
+	free_expr(b);
 	return re;
 }
 
@@ -273,167 +460,136 @@ car(struct expr * e, struct context * ctx)
 {
 	struct expr    *a, *re;
 
-	if (!e)
+	if (!e || list_len(e) < 2)
 		return empty_list();
 
-	if (list_len(e) < 2) {
-		free_expr(e);
-		return empty_list();
-	}
 	a = eval(e->v.list->next->v, ctx);
-	if (a->t != LLIST)
-		re = empty_list();
-	else {
-		if (a->v.list != NULL)
-			re = exprs_dup(a->v.list->v);
-		else
-			re = empty_list();
-	}
-	full_free_expr(a);
-	free_expr(e);
+	re = car_of(a);
+	free_expr(a);
 	return re;
 }
 
 struct expr    *
 cdr(struct expr * e, struct context * ctx)
 {
-	struct list    *nl;
 	struct expr    *a, *re;
 
-	if (!e)
+	if (!e || list_len(e) < 2)
 		return empty_list();
 
-	if (list_len(e) < 2) {
-		free_expr(e);
-		return empty_list();
-	}
 	a = eval(e->v.list->next->v, ctx);
-	if (a->t != LLIST || a->v.list == NULL) {
-		full_free_expr(a);
-		free_expr(e);
-		return empty_list();
-	}
-	nl = list_dup(a->v.list->next);
-	if (!nl) {
-		re = empty_list();
-	} else {
-		re = new_expr(LLIST);
-		re->v.list = nl;
-	}
-	full_free_expr(a);
-	free_expr(e);
+	re = cdr_of(a);
+	free_expr(a);
 	return re;
 }
 
 struct expr    *
 cons(struct expr * e, struct context * ctx)
 {
-	struct expr    *ne, *a, *b, *re;
-	struct list    *l;
+	struct expr    *a, *b, *re;
 
 	if (!e || list_len(e) < 3) {
 		dbgprintf("invalid cons expr\n");
-		free_expr(e);
 		return empty_list();
 	}
 	a = eval(e->v.list->next->v, ctx);
 	b = eval(e->v.list->next->next->v, ctx);
-
-	if (b->t != LLIST) {
-		full_free_expr(a);
-		re = empty_list();
-	} else {
-		re = new_expr(LLIST);
-		list_add(re, a);
-		for (l = b->v.list; l != NULL; l = l->next)
-			list_add(re, exprs_dup(l->v));
-		free_list(l);
-	}
-	full_free_expr(b);
-	free_expr(e);
+	re = cons_of(a, b);
+	free_expr(a);
+	free_expr(b);
 	return re;
 }
 
 struct expr    *
 cond(struct expr * e, struct context * ctx)
 {
-	struct expr    *pp, *pe, *t_atom;
-	struct list    *l;
+	struct expr    *b;
 
-	if (!e || list_len(e) < 2) {
-		free_expr(e);
+	if ((b = cond_branch(e, ctx)) == NULL)
 		return empty_list();
-	}
+	return eval(b, ctx);
+}
+
+/* The form of the first branch whose test is atom t, or NULL. */
+static struct expr *
+cond_branch(struct expr * e, struct context * ctx)
+{
+	struct expr    *pp;
+	struct list    *l;
+
+	if (!e || list_len(e) < 2)
+		return NULL;
+
 	for (l = e->v.list->next; l != NULL; l = l->next) {
-		if (l->v->t != LLIST || list_len(l->v) < 2) {
-			free_expr(e);
-			return empty_list();
-		}
+		if (TYPE(l->v) != LLIST || list_len(l->v) < 2)
+			return NULL;
 	}
 
 	for (l = e->v.list->next; l != NULL; l = l->next) {
 		pp = eval(l->v->v.list->v, ctx);
-		if (pp->t != LATOM || strcmp(pp->v.atom->v, "t") != 0) {
-			full_free_expr(pp);
+		if (!is_atom_t(pp)) {
+			free_expr(pp);
 			continue;
 		}
-		full_free_expr(pp);
-		pe = eval(l->v->v.list->next->v, ctx);
-		free_expr(e);
-		return pe;
+		free_expr(pp);
+		return l->v->v.list->next->v;
 	}
 
-	free_expr(e);
-	return empty_list();
+	return NULL;
 }
 
 struct expr    *
 list(struct expr * e, struct context * ctx)
 {
-	struct expr    *pe, *re;
-	const struct list *l;
-	int             i;
+	struct expr    *re;
+	struct list    *l, **tail;
 
-	if (!e)
+	if (!e || list_len(e) < 2)
 		return empty_list();
 
-	if (list_len(e) < 2) {
-		free_expr(e);
-		return empty_list();
-	}
 	re = new_expr(LLIST);
-	for (i = 1; (l = get_list_el(e, i)) != NULL; ++i) {
-		pe = eval(l->v, ctx);
-		list_add(re, pe);
+	tail = &re->v.list;
+	for (l = e->v.list->next; l != NULL; l = l->next) {
+		*tail = new_list();
+		(*tail)->v = eval(l->v, ctx);
+		tail = &(*tail)->next;
 	}
-	free_expr(e);
 	return re;
 }
 
 struct expr    *
 lambda(struct expr * e, struct context * context)
+{
+	struct expr    *pr;
+	struct context *ctx;
+
+	ctx = lambda_frame(e, context);
+	dbgprintf("eval'ing e expr\n");
+	pr = eval(e->v.list->v->v.list->next->next->v, ctx);
+	free_context(ctx);
+	gc_free(ctx);
+	return pr;
+}
+
+/* New frame binding the parameters of call e to its evaluated arguments. */
+struct context *
+lambda_frame(struct expr * e, struct context * context)
 {
 	int             i;
 	const struct list *lp, *la;
-	struct expr    *pe, *pr;
+	struct expr    *pe;
 	struct context *ctx;
 
 	/* assume e is a valid func call expr */
 
-	ctx = new_context();
-	ctx->is_root_level = 0;
-	ctx->next = (struct context *) context;
+	ctx = new_frame(context);
 	dbgprintf("created new context\n");
 	for (i = 0, lp = e->v.list->v->v.list->next->v->v.list, la = e->v.list->next; lp && la; ++i, lp = lp->next, la = la->next) {
 		dbgprintf("evaluating arguments, iter %d\n", i);
-		pe = add_to_context(ctx, strdup(lp->v->v.atom->v), eval(la->v, context));
-		full_free_expr(pe);
+		pe = add_to_context(ctx, lp->v->v.atom, eval(la->v, context));
+		free_expr(pe);
 	}
-	dbgprintf("eval'ing e expr\n");
-	pr = eval(e->v.list->v->v.list->next->next->v, ctx);
-	free_expr(e);
-	free_context(ctx);
-	return pr;
+	return ctx;
 }
 
 struct expr    *
@@ -443,21 +599,17 @@ label(struct expr * e, struct context * ctx)
 
 	if (!e || list_len(e) < 3) {
 		dbgprintf("first\n");
-		free_expr(e);
 		return empty_list();
 	}
-	if (!e->v.list->v || e->v.list->v->t != LATOM || !e->v.list->v->v.atom || !e->v.list->v->v.atom->v) {
+	if (!e->v.list->next->v || TYPE(e->v.list->next->v) != LATOM || !e->v.list->next->v->v.atom || !e->v.list->next->v->v.atom->v) {
 		dbgprintf("second\n");
-		free_expr(e);
 		return empty_list();
 	}
-	if (!is_valid_lambda_expr(e->v.list->next->next->v)) {
-		free_expr(e);
+	if (!is_valid_lambda_expr(e->v.list->next->next->v))
 		return empty_list();
-	}
-	pe = add_to_context(ctx, strdup(e->v.list->next->v->v.atom->v), exprs_dup(e->v.list->next->next->v));
-	full_free_expr(pe);
-	free_expr(e);
+
+	pe = add_to_context(ctx, e->v.list->next->v->v.atom, exprs_dup(e->v.list->next->next->v));
+	free_expr(pe);
 	return empty_list();
 }
 
@@ -465,36 +617,30 @@ struct expr    *
 defun(struct expr * e, struct context * ctx)
 {
 	struct expr    *pe, *pl;
-	struct list    *l;
 
-	if (!e || list_len(e) < 4) {
-		free_expr(e);
+	if (!e || list_len(e) < 4)
 		return empty_list();
-	}
-	if (!e->v.list->next || !e->v.list->next->v || e->v.list->next->v->t != LATOM || !e->v.list->next->v->v.atom || !e->v.list->next->v->v.atom->v) {
-		free_expr(e);
+
+	if (!e->v.list->next || !e->v.list->next->v || TYPE(e->v.list->next->v) != LATOM || !e->v.list->next->v->v.atom || !e->v.list->next->v->v.atom->v)
 		return empty_list();
-	}
-	if (!e->v.list->next->next || !is_valid_p_expr(e->v.list->next->next->v)) {
-		free_expr(e);
+
+	if (!e->v.list->next->next || !is_valid_p_expr(e->v.list->next->next->v))
 		return empty_list();
-	}
-	if (!e->v.list->next->next->next || !e->v.list->next->next->next->v) {
-		free_expr(e);
+
+	if (!e->v.list->next->next->next || !e->v.list->next->next->next->v)
 		return empty_list();
-	}
+
 	pl = new_expr(LLIST);
 	pl->v.list = new_list();
 	pl->v.list->v = new_expr(LATOM);
-	pl->v.list->v->v.atom = new_atom("lambda");
+	pl->v.list->v->v.atom = sym_lambda;
 	pl->v.list->next = new_list();
 	pl->v.list->next->v = exprs_dup(e->v.list->next->next->v);
 	pl->v.list->next->next = new_list();
 	pl->v.list->next->next->v = exprs_dup(e->v.list->next->next->next->v);
 
-	pe = add_to_context(ctx, strdup(e->v.list->next->v->v.atom->v), pl);
-	full_free_expr(pe);
-	free_expr(e);
+	pe = add_to_context(ctx, e->v.list->next->v->v.atom, pl);
+	free_expr(pe);
 
 	return empty_list();
 }
@@ -504,18 +650,12 @@ null(struct expr * e, struct context * ctx)
 {
 	struct expr    *a, *re;
 
-	if (!e || list_len(e) < 2) {
-		free_expr(e);
+	if (!e || list_len(e) < 2)
 		return empty_list();
-	}
-	a = eval(e->v.list->next->v, ctx);
-
-	if (is_empty_list(a))
-		re = atom_t();
-	else
-		re = empty_list();
 
-	full_free_expr(a);
+	a = eval(e->v.list->next->v, ctx);
+	re = null_of(a);
+	free_expr(a);
 	return re;
 }
 
@@ -524,21 +664,14 @@ and(struct expr * e, struct context * ctx)
 {
 	struct expr    *a, *b, *re;
 
-	if (!e || list_len(e) < 3) {
-		free_expr(e);
+	if (!e || list_len(e) < 3)
 		return empty_list();
-	}
+
 	a = eval(e->v.list->next->v, ctx);
 	b = eval(e->v.list->next->next->v, ctx);
-
-	if (is_atom_t(a) && is_atom_t(b))
-		re = atom_t();
-	else
-		re = empty_list();
-
-	full_free_expr(a);
-	full_free_expr(b);
-	free_expr(e);
+	re = and_of(a, b);
+	free_expr(a);
+	free_expr(b);
 	return re;
 }
 
@@ -547,19 +680,12 @@ not(struct expr * e, struct context * ctx)
 {
 	struct expr    *a, *re;
 
-	if (!e || list_len(e) < 2) {
-		free_expr(e);
+	if (!e || list_len(e) < 2)
 		return empty_list();
-	}
-	a = eval(e->v.list->next->v, ctx);
-
-	if (is_empty_list(a))
-		re = atom_t();
-	else
-		re = empty_list();
 
-	full_free_expr(a);
-	free_expr(e);
+	a = eval(e->v.list->next->v, ctx);
+	re = null_of(a);
+	free_expr(a);
 	return re;
 }
 
@@ -570,60 +696,371 @@ exec(struct expr * e, struct context * ctx)
 	struct args     args;
 	struct list    *l;
 
-	if (!e || list_len(e) < 2) {
-		free_expr(e);
+	if (!e || list_len(e) < 2)
 		return empty_list();
-	}
+
 	memset(&args, 0, sizeof(args));
 	for (l = e->v.list->next; l != NULL; l = l->next) {
 		a = eval(l->v, ctx);
 		build_argv(a, &args);
-		full_free_expr(a);
+		free_expr(a);
 	}
 
 	re = do_exec(&args);
 
-	free_expr(e);
 	free_args(&args);
 
 	return re;
 }
 
-int
-build_argv(struct expr * e, struct args * a)
+/*
+ * Value level parts of the builtins, shared with the VM.  Arguments are
+ * borrowed, the result is a new reference.
+ */
+struct expr    *
+atom_of(const struct expr * a)
+{
+	if (TYPE(a) != LLIST || a->v.list == NULL)
+		return atom_t();
+	return empty_list();
+}
+
+struct expr    *
+eq_of(const struct expr * a, const struct expr * b)
+{
+	if (TYPE(a) != TYPE(b))
+		return empty_list();
+	if (is_number(a))
+		return num_cmp(a, b) == 0 ? atom_t() : empty_list();
+	if (TYPE(a) == LLIST)
+		return a->v.list == NULL && b->v.list == NULL ? atom_t() : empty_list();
+	if (a->v.atom != NULL && atom_eq(a->v.atom, b->v.atom))
+		return atom_t();
+	return empty_list();
+}
+
+struct expr    *
+car_of(const struct expr * a)
+{
+	if (TYPE(a) == LLIST && a->v.list != NULL)
+		return exprs_dup(a->v.list->v);
+	return empty_list();
+}
+
+struct expr    *
+cdr_of(const struct expr * a)
+{
+	struct expr    *re;
+
+	if (TYPE(a) != LLIST || a->v.list == NULL || a->v.list->next == NULL)
+		return empty_list();
+	re = new_expr(LLIST);
+	re->v.list = list_dup(a->v.list->next);
+	return re;
+}
+
+struct expr    *
+cons_of(const struct expr * a, const struct expr * b)
+{
+	struct expr    *re;
+
+	if (TYPE(b) != LLIST)
+		return empty_list();
+	re = new_expr(LLIST);
+	re->v.list = new_list();
+	re->v.list->v = exprs_dup(a);
+	re->v.list->next = list_dup(b->v.list);
+	return re;
+}
+
+struct expr    *
+null_of(const struct expr * a)
+{
+	return is_empty_list(a) ? atom_t() : empty_list();
+}
+
+struct expr    *
+and_of(const struct expr * a, const struct expr * b)
+{
+	return is_atom_t(a) && is_atom_t(b) ? atom_t() : empty_list();
+}
+
+struct expr    *
+gcstats(struct expr * e, struct context * ctx)
+{
+	const struct gcstat *st;
+	struct expr    *re;
+
+	/* takes no arguments */
+	(void) e;
+	(void) ctx;
+
+	st = gc_get_stats();
+	re = new_expr(LLIST);
+	add_stat(re, "heap-bytes", make_int(st->heap_bytes));
+	add_stat(re, "live-bytes", make_int(st->live_bytes));
+	add_stat(re, "live-objects", make_int(st->live_objects));
+	add_stat(re, "allocations", make_int(st->nallocs));
+	add_stat(re, "collections", make_int(st->ncollections));
+	add_stat(re, "last-freed", make_int(st->last_freed));
+	add_stat(re, "pause-total-us", make_int(st->pause_total * 1e6));
+	add_stat(re, "pause-max-us", make_int(st->pause_max * 1e6));
+	add_stat(re, "next-collection", make_int(st->next_collection));
+	add_stat(re, "symbols", make_int(nsyms()));
+	return re;
+}
+
+/*
+ * (exec-all n cmd...) runs every cmd as exec would, at most n at a time,
+ * and returns the list of their results in order.
+ */
+struct expr    *
+execall(struct expr * e, struct context * ctx)
 {
+	struct expr    *a, *re;
+	struct args    *jobs;
 	struct list    *l;
+	pid_t          *pids, pid;
+	siginfo_t       si;
+	struct timespec ts;
+	int            *ok, njobs, max, next, running, reaped, status, i;
 
-	if (!e || !a)
-		return 0;
+	/* (exec-all n) or not a call at all: nothing to run */
+	if (!e || TYPE(e) != LLIST || (njobs = list_len(e) - 2) <= 0)
+		return empty_list();
 
-	if (e->t == LATOM) {
-		dbgprintf("build_argv: an atom\n");
+	a = eval(e->v.list->next->v, ctx);
+	max = IS_FIXNUM(a) && FIXNUM_VAL(a) > 0 ? FIXNUM_VAL(a) : 1;
+	free_expr(a);
 
-		if (!e->v.atom || !e->v.atom->v)
-			return 0;
+	jobs = calloc(njobs, sizeof(*jobs));
+	pids = calloc(njobs, sizeof(*pids));
+	ok = calloc(njobs, sizeof(*ok));
+	for (i = 0, l = e->v.list->next->next; l != NULL; l = l->next, ++i) {
+		a = eval(l->v, ctx);
+		build_argv(a, &jobs[i]);
+		free_expr(a);
+	}
 
-		if (!a->argv) {
-			a->argv = malloc(sizeof(char *) * 2);
-			a->argv[0] = strdup(e->v.atom->v);
-			a->argv[1] = NULL;
-			a->argc = 1;
-		} else {
-			a->argv = realloc(a->argv, sizeof(char *) * (a->argc + 2));
-			a->argv[a->argc++] = strdup(e->v.atom->v);
-			a->argv[a->argc] = NULL;
+	for (next = running = 0; next < njobs || running > 0;) {
+		while (running < max && next < njobs) {
+			if (jobs[next].argc > 0 && (pids[next] = spawn(&jobs[next])) != -1)
+				++running;
+			++next;
 		}
+		if (running == 0)
+			continue;
 
-		dbgprintf("build_argv: added \"%s\"\n", a->argv[a->argc - 1]);
+		/*
+		 * Only our own children are reaped: exec and exec-all in
+		 * other pmap threads wait for theirs.
+		 */
+		for (reaped = i = 0; i < next; ++i) {
+			if (pids[i] <= 0)
+				continue;
+			if ((pid = waitpid(pids[i], &status, WNOHANG)) == 0)
+				continue;
+			if (pid == -1) {
+				if (errno == EINTR)
+					continue;
+				warn("waitpid");
+			} else {
+				ok[i] = status == 0;
+			}
+			pids[i] = 0;
+			--running;
+			++reaped;
+		}
+		if (reaped > 0 || running == 0)
+			continue;
 
-		return a->argc;
-	} else if (e->t == LLIST) {
+		/* sleep until some child exits, leaving it to be reaped */
+		memset(&si, 0, sizeof(si));
+		if (waitid(P_ALL, 0, &si, WEXITED | WNOWAIT) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("waitid");
+			break;
+		}
+		for (i = 0; i < next && pids[i] != si.si_pid; ++i)
+			;
+		if (i == next) {
+			/* another thread's, give it the time to reap it */
+			ts.tv_sec = 0;
+			ts.tv_nsec = 1000000;
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	re = new_expr(LLIST);
+	for (i = 0; i < njobs; ++i) {
+		list_add(re, ok[i] ? atom_t() : empty_list());
+		free_args(&jobs[i]);
+	}
+	free(jobs);
+	free(pids);
+	free(ok);
+	return re;
+}
+
+/* (read-file name) returns the lines of the file as a list of atoms. */
+struct expr    *
+readfile(struct expr * e, struct context * ctx)
+{
+	struct expr    *a, *re;
+	struct list   **tail;
+	FILE           *fp;
+	char           *line = NULL;
+	size_t          size = 0;
+	ssize_t         n;
+
+	if (!e || list_len(e) < 2)
+		return empty_list();
+
+	a = eval(e->v.list->next->v, ctx);
+	if (TYPE(a) != LATOM) {
+		free_expr(a);
+		return empty_list();
+	}
+	if ((fp = fopen(a->v.atom->v, "r")) == NULL) {
+		warn("%s", a->v.atom->v);
+		free_expr(a);
+		return empty_list();
+	}
+	free_expr(a);
+
+	re = new_expr(LLIST);
+	tail = &re->v.list;
+	while ((n = getline(&line, &size, fp)) != -1) {
+		if (n > 0 && line[n - 1] == '\n')
+			--n;
+		*tail = new_list();
+		(*tail)->v = make_data_atom(line, n);
+		tail = &(*tail)->next;
+	}
+	free(line);
+	fclose(fp);
+	return re;
+}
+
+/*
+ * (split a seps) returns the non-empty pieces of atom a between any of
+ * the characters of atom seps, or of white space if there's no seps.
+ */
+struct expr    *
+split(struct expr * e, struct context * ctx)
+{
+	struct expr    *a, *b, *re;
+	struct list   **tail;
+	const char     *seps, *p, *q, *end;
+
+	if (!e || list_len(e) < 2)
+		return empty_list();
+
+	a = eval(e->v.list->next->v, ctx);
+	b = list_len(e) > 2 ? eval(e->v.list->next->next->v, ctx) : NULL;
+	if (TYPE(a) != LATOM || (b != NULL && TYPE(b) != LATOM)) {
+		free_expr(a);
+		free_expr(b);
+		return empty_list();
+	}
+	seps = b != NULL ? b->v.atom->v : " \t\n\r\f\v";
+
+	re = new_expr(LLIST);
+	tail = &re->v.list;
+	end = a->v.atom->v + a->v.atom->len;
+	for (p = a->v.atom->v; p < end; p = q + 1) {
+		for (q = p; q < end && strchr(seps, *q) == NULL; ++q)
+			 /* empty */ ;
+		if (q == p)
+			continue;
+		*tail = new_list();
+		(*tail)->v = make_data_atom(p, q - p);
+		tail = &(*tail)->next;
+	}
+	free_expr(a);
+	free_expr(b);
+	return re;
+}
+
+/* (getenv name) */
+struct expr    *
+envvar(struct expr * e, struct context * ctx)
+{
+	struct expr    *a;
+	const char     *v;
+
+	if (!e || list_len(e) < 2)
+		return empty_list();
+
+	a = eval(e->v.list->next->v, ctx);
+	v = TYPE(a) == LATOM ? getenv(a->v.atom->v) : NULL;
+	free_expr(a);
+	if (v == NULL)
+		return empty_list();
+	return make_data_atom(v, strlen(v));
+}
+
+static void
+add_arg(struct args * a, char *s)
+{
+	if (a->argc + 2 > a->argsize) {
+		a->argsize = a->argsize ? a->argsize * 2 : 8;
+		a->argv = realloc(a->argv, a->argsize * sizeof(*a->argv));
+	}
+	a->argv[a->argc++] = s;
+	a->argv[a->argc] = NULL;
+	dbgprintf("build_argv: added \"%s\"\n", s);
+}
+
+/*
+ * The strings of atoms are borrowed from the symbol table; numbers are
+ * printed into strings of a's own, freed by free_args().
+ */
+int
+build_argv(struct expr * e, struct args * a)
+{
+	struct list    *l;
+	char           *s;
+
+	if (!e || !a)
+		return 0;
+
+	if (is_number(e)) {
+		s = number_str(e);
+		if (a->nowned == a->ownedsize) {
+			a->ownedsize = a->ownedsize ? a->ownedsize * 2 : 4;
+			a->owned = realloc(a->owned, a->ownedsize * sizeof(*a->owned));
+		}
+		a->owned[a->nowned++] = s;
+		add_arg(a, s);
+	} else if (TYPE(e) == LATOM) {
+		if (e->v.atom && e->v.atom->v)
+			add_arg(a, e->v.atom->v);
+	} else if (TYPE(e) == LLIST) {
 		for (l = e->v.list; l != NULL; l = l->next) {
 			dbgprintf("build_argv: descending into list\n");
 			build_argv(l->v, a);
 		}
-		return a->argc;
 	}
+	return a->argc;
+}
+
+static pid_t
+spawn(struct args * a)
+{
+	pid_t           pid;
+	int             error;
+
+	dbgprintf("spawning %s\n", a->argv[0]);
+	/* don't let the child's output overtake ours */
+	fflush(stdout);
+	if ((error = posix_spawnp(&pid, a->argv[0], NULL, NULL, a->argv, environ)) != 0) {
+		errno = error;
+		warn("%s", a->argv[0]);
+		return -1;
+	}
+	return pid;
 }
 
 struct expr    *
@@ -633,52 +1070,73 @@ do_exec(struct args * a)
 	int             status;
 
 	if (!a || a->argc == 0) {
-		dbgprintf("no arguments -- no execvp\n");
+		dbgprintf("no arguments -- nothing to spawn\n");
 		return empty_list();
 	}
-	dbgprintf("forking...\n");
-
-	if ((pid = fork()) < 0) {
-		warn("fork");
+	if ((pid = spawn(a)) == -1)
 		return empty_list();
-	} else if (pid > 0) {
-		dbgprintf("waiting for child termination\n");
-		wait(&status);
-		if (status == 0)
-			return atom_t();
-		else
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			warn("waitpid");
 			return empty_list();
-	} else {
-		dbgprintf("trying to execvp\n");
-
-		execvp(a->argv[0], a->argv);
-
-		/* if reached, error has occured */
-		err(1, "%s", a->argv[0]);
-
-		/* never reached, but just to be sure */
-		return NULL;
+		}
 	}
+	return status == 0 ? atom_t() : empty_list();
 }
 
 int
-search_context_i(const struct context * ctx, const char *key)
+search_context_i(const struct context * ctx, const struct atom * key)
 {
-	int             i;
+	int             i, mask;
+
+	if (ctx->nmap == 0)
+		return -1;
 
-	for (i = 0; i < ctx->nmap; ++i) {
-		if (!strcmp(ctx->map[i].k, key))
+	mask = ctx->mapsize - 1;
+	for (i = key->hash & mask; ctx->map[i].k != NULL; i = (i + 1) & mask) {
+		if (ctx->map[i].k == key)
 			return i;
 	}
 	return -1;
 }
 
+static void
+grow_context(struct context * ctx)
+{
+	struct map     *old;
+	int             old_size, i, j, mask;
+
+	old = ctx->map;
+	old_size = ctx->mapsize;
+	ctx->mapsize = old_size ? old_size * 2 : 8;
+	ctx->map = calloc(ctx->mapsize, sizeof(*ctx->map));
+	mask = ctx->mapsize - 1;
+	for (i = 0; i < old_size; ++i) {
+		if (old[i].k == NULL)
+			continue;
+		for (j = old[i].k->hash & mask; ctx->map[j].k != NULL; j = (j + 1) & mask)
+			 /* empty */ ;
+		ctx->map[j] = old[i];
+	}
+	free(old);
+}
+
 struct expr    *
-search_context(const struct context * ctx, const char *k)
+search_context(const struct context * ctx, const struct atom * k)
 {
+	uint64_t        bit;
 	int             pos;
 
-	for (ctx; ctx != NULL; ctx = ctx->next) {
+	bit = SYM_BIT(k);
+	if (ctx->root != NULL && !(ctx->upmask & bit))
+		ctx = ctx->root;
+	for (; ctx != NULL; ctx = ctx->next) {
+		if (!(ctx->mask & bit))
+			continue;
+		for (pos = ctx->nslots; pos-- > 0;) {
+			if (ctx->slotk[pos] == k)
+				return ctx->slotv[pos];
+		}
 		if ((pos = search_context_i(ctx, k)) != -1)
 			return ctx->map[pos].v;
 	}
@@ -692,7 +1150,7 @@ list_len(const struct expr * e)
 	int             len = 0;
 	const struct list *l;
 
-	if (e->t != LLIST)
+	if (TYPE(e) != LLIST)
 		return 0;
 
 	l = e->v.list;
@@ -710,10 +1168,10 @@ get_list_el(const struct expr * e, int i)
 	int             n;
 	const struct list *l;
 
-	if (!e || e->t != LLIST || i >= list_len(e))
+	if (!e || TYPE(e) != LLIST || i >= list_len(e))
 		return NULL;
 
-	for (l = e->v.list, n = 0; l != NULL, n < i; l = l->next, ++n)
+	for (l = e->v.list, n = 0; l != NULL && n < i; l = l->next, ++n)
 		 /* empty */ ;
 
 	return (struct list *) l;
@@ -724,7 +1182,7 @@ list_add(struct expr * e, const struct expr * ne)
 {
 	struct list    *l;
 
-	if (!e || e->t != LLIST)
+	if (!e || TYPE(e) != LLIST)
 		return NULL;
 
 	if (!e->v.list) {
@@ -765,8 +1223,8 @@ are_lists_equal(const struct list * a, const struct list * b, struct context * c
 int
 are_exprs_equal(struct expr * a, struct expr * b, struct context * ctx, int do_eval)
 {
-	struct list    *l;
 	struct expr    *e1, *e2;
+	int             r;
 
 	const char     *fn = "are_exprs_equal";
 
@@ -786,16 +1244,23 @@ are_exprs_equal(struct expr * a, struct expr * b, struct context * ctx, int do_e
 		e2 = b;
 	}
 
-	if (e1->t != e2->t) {
+	if (TYPE(e1) != TYPE(e2)) {
 		dbgprintf("%s: types not equal\n", fn);
-		return 0;
+		r = 0;
+	} else if (is_number(e1)) {
+		r = num_cmp(e1, e2) == 0;
+	} else if (TYPE(e1) == LATOM) {
+		r = atom_eq(e1->v.atom, e2->v.atom);
+	} else if (TYPE(e1) == LLIST) {
+		r = are_lists_equal(e1->v.list, e2->v.list, ctx);
+	} else {
+		r = 0;
 	}
-	if (e1->t == LATOM) {
-		dbgprintf("strcmping %s %s\n", e1->v.atom->v, e2->v.atom->v);
-		return !strcmp(e1->v.atom->v, e2->v.atom->v);
-	} else if (e1->t == LLIST) {
-		return are_lists_equal(e1->v.list, e2->v.list, ctx);
+	if (do_eval) {
+		free_expr(e1);
+		free_expr(e2);
 	}
+	return r;
 }
 
 int
@@ -803,17 +1268,17 @@ is_valid_p_expr(const struct expr * e)
 {
 	const struct list *l;
 
-	if (!e || e->t != LLIST || e->v.list == NULL)
+	if (!e || TYPE(e) != LLIST || e->v.list == NULL)
 		return 0;
 	for (l = e->v.list; l != NULL; l = l->next) {
-		if (l->v == NULL || l->v->t != LATOM)
+		if (l->v == NULL || TYPE(l->v) != LATOM)
 			return 0;
 	}
 	return 1;
 }
 
 struct expr    *
-add_to_context(struct context * ctx, const char *k, const struct expr * e)
+add_to_context(struct context * ctx, struct atom * k, const struct expr * e)
 {
 	int             i;
 	struct expr    *pr;
@@ -821,17 +1286,30 @@ add_to_context(struct context * ctx, const char *k, const struct expr * e)
 	if (!e)
 		return NULL;
 
+	for (i = ctx->nslots; i-- > 0;) {
+		if (ctx->slotk[i] == k) {
+			pr = ctx->slotv[i];
+			ctx->slotv[i] = (struct expr *) e;
+			return pr;
+		}
+	}
+
 	if ((i = search_context_i(ctx, k)) == -1) {
+		ctx->mask |= SYM_BIT(k);
+		if (ctx->root != NULL)
+			ctx->upmask |= SYM_BIT(k);
+		if ((ctx->nmap + 1) * 4 > ctx->mapsize * 3)
+			grow_context(ctx);
 		++ctx->nmap;
-		ctx->map = realloc(ctx->map, sizeof(*ctx->map) * ctx->nmap);
-		i = ctx->nmap - 1;
+		for (i = k->hash & (ctx->mapsize - 1); ctx->map[i].k != NULL; i = (i + 1) & (ctx->mapsize - 1))
+			 /* empty */ ;
 		pr = NULL;
 	} else {
 		/* free */
 		pr = ctx->map[i].v;
 	}
 
-	ctx->map[i].k = (char *) k;
+	ctx->map[i].k = k;
 	ctx->map[i].v = (struct expr *) e;
 
 	return pr;
@@ -840,12 +1318,10 @@ add_to_context(struct context * ctx, const char *k, const struct expr * e)
 int
 is_valid_lambda_expr(const struct expr * e)
 {
-	struct list    *l;
-
-	if (!e || e->t != LLIST || list_len(e) < 3)
+	if (!e || TYPE(e) != LLIST || list_len(e) < 3)
 		return 0;
 
-	if (!e->v.list->v || e->v.list->v->t != LATOM || !e->v.list->v->v.atom || !e->v.list->v->v.atom->v || strcmp(e->v.list->v->v.atom->v, "lambda") != 0)
+	if (!e->v.list->v || TYPE(e->v.list->v) != LATOM || !e->v.list->v->v.atom || e->v.list->v->v.atom != sym_lambda)
 		return 0;
 	if (!is_valid_p_expr(e->v.list->next->v))
 		return 0;
@@ -858,31 +1334,56 @@ is_valid_lambda_expr(const struct expr * e)
 int
 is_function_call_expr(const struct expr * e)
 {
-	if (!e || e->t != LLIST || e->v.list == NULL)
+	if (!e || TYPE(e) != LLIST || e->v.list == NULL)
 		return 0;
 
-	if (!e->v.list->v || e->v.list->v->t != LLIST || e->v.list->v->v.list == NULL || e->v.list->v->v.list->v == NULL || e->v.list->v->v.list->v->t != LATOM || e->v.list->v->v.list->v->v.atom == NULL || e->v.list->v->v.list->v->v.atom->v == NULL)
+	if (!e->v.list->v || TYPE(e->v.list->v) != LLIST || e->v.list->v->v.list == NULL || e->v.list->v->v.list->v == NULL || TYPE(e->v.list->v->v.list->v) != LATOM || e->v.list->v->v.list->v->v.atom == NULL || e->v.list->v->v.list->v->v.atom->v == NULL)
 		return 0;
 
-	if (strcmp(e->v.list->v->v.list->v->v.atom->v, "lambda") != 0)
+	if (e->v.list->v->v.list->v->v.atom != sym_lambda)
 		return 0;
 
-	if (list_len(e->v.list->v) < 3 || e->v.list->v->v.list->next->v == NULL || e->v.list->v->v.list->next->v->t != LLIST)
+	if (list_len(e->v.list->v) < 3 || e->v.list->v->v.list->next->v == NULL || TYPE(e->v.list->v->v.list->next->v) != LLIST)
 		return 0;
 
 	return 1;
 }
 
-static int
-is_atom_t(struct expr * e)
+int
+is_atom_t(const struct expr * e)
 {
-	if (!e || e->t != LATOM || !e->v.atom || !e->v.atom->v)
+	if (!e || TYPE(e) != LATOM)
 		return 0;
-	return strcmp(e->v.atom->v, "t") == 0;
+	return e->v.atom == sym_t || (e->v.atom != NULL && atom_eq(e->v.atom, sym_t));
 }
 
-static int
-is_empty_list(struct expr * e)
+int
+is_empty_list(const struct expr * e)
+{
+	return e && TYPE(e) == LLIST && !e->v.list;
+}
+
+struct expr    *
+replace_head(const struct expr * e, struct expr * head)
+{
+	struct expr    *ne;
+
+	ne = new_expr(LLIST);
+	ne->v.list = new_list();
+	ne->v.list->v = head;
+	ne->v.list->next = list_dup(e->v.list->next);
+	return ne;
+}
+
+static void
+add_stat(struct expr * re, const char *name, struct expr * v)
 {
-	return e && e->t == LLIST && !e->v.list;
+	struct expr    *pair, *a;
+
+	pair = new_expr(LLIST);
+	a = new_expr(LATOM);
+	a->v.atom = intern(name);
+	list_add(pair, a);
+	list_add(pair, v);
+	list_add(re, pair);
 }
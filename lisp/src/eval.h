@@ -17,13 +17,23 @@
 #ifndef EVAL_H
 #define EVAL_H
 
+#include <setjmp.h>
+
 #include "lisp.h"
 
 struct args {
 	int             argc;
-	char          **argv;
+	int             argsize;
+	char          **argv;		/* NULL terminated */
+	char          **owned;		/* the printed numbers among them */
+	int             nowned;
+	int             ownedsize;
 };
 
+extern const char *ops[];
+extern struct expr *(*op_funcs[]) (struct expr *, struct context *);
+extern _Thread_local jmp_buf eval_top;
+
 struct expr    *eval(struct expr * e, struct context * ctx);
 struct expr    *atom_t(void);
 struct expr    *empty_list(void);
@@ -36,27 +46,48 @@ struct expr    *cons(struct expr * e, struct context * ctx);
 struct expr    *cond(struct expr * e, struct context * ctx);
 struct expr    *list(struct expr * e, struct context * ctx);
 struct expr    *lambda(struct expr * e, struct context * context);
+struct context *lambda_frame(struct expr * e, struct context * context);
 struct expr    *label(struct expr * e, struct context * ctx);
 struct expr    *defun(struct expr * e, struct context * ctx);
 struct expr    *null(struct expr * e, struct context * ctx);
 struct expr    *and(struct expr * e, struct context * ctx);
 struct expr    *not(struct expr * e, struct context * ctx);
 struct expr    *exec(struct expr * e, struct context * ctx);
+struct expr    *gcstats(struct expr * e, struct context * ctx);
+struct expr    *execall(struct expr * e, struct context * ctx);
+struct expr    *readfile(struct expr * e, struct context * ctx);
+struct expr    *split(struct expr * e, struct context * ctx);
+struct expr    *envvar(struct expr * e, struct context * ctx);
+
+struct expr    *atom_of(const struct expr * a);
+struct expr    *eq_of(const struct expr * a, const struct expr * b);
+struct expr    *car_of(const struct expr * a);
+struct expr    *cdr_of(const struct expr * a);
+struct expr    *cons_of(const struct expr * a, const struct expr * b);
+struct expr    *null_of(const struct expr * a);
+struct expr    *and_of(const struct expr * a, const struct expr * b);
+
+void            eval_error(const char *fmt,...);
+void            set_stack_base(void *base);
+size_t          cstack_size(void);
 
 struct expr    *do_exec(struct args * a);
-struct expr    *search_context(const struct context * ctx, const char *k);
+struct expr    *search_context(const struct context * ctx, const struct atom * k);
 struct expr    *list_add(struct expr * e, const struct expr * ne);
-struct expr    *add_to_context(struct context * ctx, const char *k, const struct expr * e);
+struct expr    *add_to_context(struct context * ctx, struct atom * k, const struct expr * e);
 struct list    *get_list_el(const struct expr * e, int i);
+struct expr    *replace_head(const struct expr * e, struct expr * head);
 
 int             build_argv(struct expr * e, struct args * a);
-int             search_context_i(const struct context * ctx, const char *key);
+int             search_context_i(const struct context * ctx, const struct atom * key);
 int             list_len(const struct expr * e);
 int             are_lists_equal(const struct list * a, const struct list * b, struct context * ctx);
 int             are_exprs_equal(struct expr * a, struct expr * b, struct context * ctx, int do_eval);
 int             is_valid_p_expr(const struct expr * e);
 int             is_valid_lambda_expr(const struct expr * e);
 int             is_function_call_expr(const struct expr * e);
+int             is_atom_t(const struct expr * e);
+int             is_empty_list(const struct expr * e);
 
 
 #endif
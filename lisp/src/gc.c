@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Size-classed arenas for expression nodes, list cells and contexts,
+ * plus a mark-sweep collector.
+ *
+ * Reference counting frees almost everything as soon as it becomes
+ * garbage; the collector reclaims whatever refcounting misses.  Since
+ * eval() keeps temporaries on the C stack, collections only happen at
+ * safe points where the context chain is the complete root set, i.e.
+ * between top level expressions.
+ *
+ * Free lists are per thread, so that pmap workers allocate without
+ * locking; the chunk lists are shared and only touched under gc_lock.
+ * A worker gives its free slots back as orphans when it is done, and
+ * allocation counts it made are merged by the thread that waited for it.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "lisp.h"
+#include "gc.h"
+#include "mem.h"
+#include "vm.h"
+
+#define GC_CHUNK_SIZE	(64 * 1024)
+#define GC_GRANULE	8
+#define GC_NCLASSES	16
+#ifndef GC_MIN_HEAP
+#define GC_MIN_HEAP	(256 * 1024)
+#endif
+
+struct gc_hdr {
+	unsigned char   type;
+	unsigned char   mark;
+	unsigned char   perm;
+	unsigned char   cls;
+	unsigned int    pad;
+};
+
+struct gc_chunk {
+	struct gc_chunk *next;
+	size_t          nslots;
+	size_t          nlive;
+	size_t          pad;
+};
+
+struct gc_free {
+	struct gc_free *next;
+};
+
+struct gc_class {
+	size_t          slot_size;
+	struct gc_chunk *chunks;
+	struct gc_free *orphans;	/* free slots left by finished threads */
+};
+
+double          gc_growth = 2.0;
+
+static struct gc_class classes[GC_NCLASSES];
+static struct gcstat stats = {0, 0, 0, 0, 0, 0, 0.0, 0.0, GC_MIN_HEAP};
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local struct gc_free *freelist[GC_NCLASSES];
+static _Thread_local struct gcstat *tstats = &stats;
+
+#define HDR(p)		((struct gc_hdr *) (p) - 1)
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct gc_hdr *
+slot(struct gc_class * c, struct gc_chunk * ch, size_t i)
+{
+	return (struct gc_hdr *) ((char *) (ch + 1) + i * c->slot_size);
+}
+
+/* Called with gc_lock held. */
+static void
+add_chunk(struct gc_class * c, int cls)
+{
+	struct gc_chunk *ch;
+	struct gc_hdr  *h;
+	struct gc_free *f;
+	size_t          i;
+
+	if (c->slot_size == 0)
+		c->slot_size = sizeof(struct gc_hdr) + (cls + 1) * GC_GRANULE;
+	ch = malloc(GC_CHUNK_SIZE);
+	ch->nslots = (GC_CHUNK_SIZE - sizeof(*ch)) / c->slot_size;
+	ch->nlive = 0;
+	ch->next = c->chunks;
+	c->chunks = ch;
+	for (i = ch->nslots; i-- > 0;) {
+		h = slot(c, ch, i);
+		h->type = GC_FREE;
+		h->mark = 0;
+		h->perm = 0;
+		h->cls = cls;
+		f = (struct gc_free *) (h + 1);
+		f->next = freelist[cls];
+		freelist[cls] = f;
+	}
+	stats.heap_bytes += GC_CHUNK_SIZE;
+}
+
+static void
+refill(struct gc_class * c, int cls)
+{
+	pthread_mutex_lock(&gc_lock);
+	if (c->orphans != NULL) {
+		freelist[cls] = c->orphans;
+		c->orphans = NULL;
+	} else {
+		add_chunk(c, cls);
+	}
+	pthread_mutex_unlock(&gc_lock);
+}
+
+void           *
+gc_alloc(size_t size, int type)
+{
+	struct gc_class *c;
+	struct gc_free *f;
+	struct gc_hdr  *h;
+	int             cls;
+
+	cls = (size + GC_GRANULE - 1) / GC_GRANULE - 1;
+	if (cls >= GC_NCLASSES) {
+		fprintf(stderr, "%s: gc_alloc: object of %zu bytes is too large\n", PROGNAME, size);
+		abort();
+	}
+	c = &classes[cls];
+	if (freelist[cls] == NULL)
+		refill(c, cls);
+
+	f = freelist[cls];
+	freelist[cls] = f->next;
+	h = HDR(f);
+	h->type = type;
+	memset(f, 0, c->slot_size - sizeof(*h));
+
+	tstats->live_bytes += c->slot_size;
+	++tstats->live_objects;
+	++tstats->nallocs;
+	return f;
+}
+
+void
+gc_free(void *p)
+{
+	struct gc_class *c;
+	struct gc_free *f;
+	struct gc_hdr  *h;
+
+	if (p == NULL)
+		return;
+	h = HDR(p);
+	c = &classes[h->cls];
+	h->type = GC_FREE;
+	f = p;
+	f->next = freelist[h->cls];
+	freelist[h->cls] = f;
+
+	tstats->live_bytes -= c->slot_size;
+	--tstats->live_objects;
+}
+
+/* Makes the calling thread count its allocations in s. */
+void
+gc_thread_start(struct gcstat * s)
+{
+	memset(s, 0, sizeof(*s));
+	tstats = s;
+}
+
+/* Hands the free slots of a thread that's about to exit over to others. */
+void
+gc_thread_done(void)
+{
+	struct gc_free *f;
+	int             cls;
+
+	pthread_mutex_lock(&gc_lock);
+	for (cls = 0; cls < GC_NCLASSES; ++cls) {
+		if ((f = freelist[cls]) == NULL)
+			continue;
+		while (f->next != NULL)
+			f = f->next;
+		f->next = classes[cls].orphans;
+		classes[cls].orphans = freelist[cls];
+		freelist[cls] = NULL;
+	}
+	pthread_mutex_unlock(&gc_lock);
+}
+
+/* Adds the counts of a joined thread; the sums wrap around correctly. */
+void
+gc_thread_merge(const struct gcstat * s)
+{
+	stats.live_bytes += s->live_bytes;
+	stats.live_objects += s->live_objects;
+	stats.nallocs += s->nallocs;
+}
+
+void
+gc_set_perm(void *p)
+{
+	HDR(p)->perm = 1;
+}
+
+static void     mark_expr(struct expr * e);
+
+static int
+mark(void *p)
+{
+	struct gc_hdr  *h;
+
+	h = HDR(p);
+	if (h->mark)
+		return 0;
+	h->mark = 1;
+	return 1;
+}
+
+static void
+mark_list(struct list * l)
+{
+	for (; l != NULL && mark(l); l = l->next)
+		mark_expr(l->v);
+}
+
+static void
+mark_expr(struct expr * e)
+{
+	struct code    *c;
+	int             i;
+
+	if (e == NULL || IS_FIXNUM(e) || !mark(e))
+		return;
+	if ((c = code_of(e)) != NULL) {
+		for (i = 0; i < c->nconsts; ++i)
+			mark_expr(c->consts[i]);
+	}
+	if (e->t == LLIST)
+		mark_list(e->v.list);
+}
+
+static void
+mark_context(struct context * ctx)
+{
+	int             i;
+
+	for (; ctx != NULL && mark(ctx); ctx = ctx->next) {
+		for (i = 0; i < ctx->nslots; ++i)
+			mark_expr(ctx->slotv[i]);
+		for (i = 0; i < ctx->mapsize; ++i) {
+			if (ctx->map[i].k != NULL)
+				mark_expr(ctx->map[i].v);
+		}
+	}
+}
+
+static void
+sweep_expr(struct expr * e)
+{
+	if (e->code)
+		forget_code(e);
+	if (e->t == LATOM)
+		free_atom(e->v.atom);
+	else if (e->t == LBIGNUM)
+		free(e->v.big);
+}
+
+static size_t
+sweep(void)
+{
+	struct gc_class *c;
+	struct gc_chunk *ch, **pch;
+	struct gc_hdr  *h;
+	struct gc_free *f;
+	size_t          i, nfreed = 0;
+	int             cls;
+
+	for (cls = 0; cls < GC_NCLASSES; ++cls) {
+		c = &classes[cls];
+		c->orphans = NULL;
+		freelist[cls] = NULL;
+		for (pch = &c->chunks; (ch = *pch) != NULL;) {
+			ch->nlive = 0;
+			for (i = 0; i < ch->nslots; ++i) {
+				h = slot(c, ch, i);
+				if (h->type == GC_FREE)
+					continue;
+				if (h->mark || h->perm) {
+					h->mark = 0;
+					++ch->nlive;
+					continue;
+				}
+				if (h->type == GC_CONTEXT)
+					free(((struct context *) (h + 1))->map);
+				else if (h->type == GC_EXPR)
+					sweep_expr((struct expr *) (h + 1));
+				h->type = GC_FREE;
+				stats.live_bytes -= c->slot_size;
+				--stats.live_objects;
+				++nfreed;
+			}
+			if (ch->nlive == 0) {
+				*pch = ch->next;
+				free(ch);
+				stats.heap_bytes -= GC_CHUNK_SIZE;
+				continue;
+			}
+			for (i = ch->nslots; i-- > 0;) {
+				h = slot(c, ch, i);
+				if (h->type != GC_FREE)
+					continue;
+				f = (struct gc_free *) (h + 1);
+				f->next = freelist[cls];
+				freelist[cls] = f;
+			}
+			pch = &ch->next;
+		}
+	}
+	return nfreed;
+}
+
+void
+gc_collect(struct context * root)
+{
+	double          t, pause;
+	size_t          next;
+
+	t = now();
+	mark_context(root);
+	stats.last_freed = sweep();
+	pause = now() - t;
+
+	++stats.ncollections;
+	stats.pause_total += pause;
+	if (pause > stats.pause_max)
+		stats.pause_max = pause;
+	next = stats.live_bytes * gc_growth;
+	stats.next_collection = next > GC_MIN_HEAP ? next : GC_MIN_HEAP;
+}
+
+void
+gc_maybe_collect(struct context * root)
+{
+	if (stats.live_bytes >= stats.next_collection)
+		gc_collect(root);
+}
+
+const struct gcstat *
+gc_get_stats(void)
+{
+	return &stats;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef GC_H
+#define GC_H
+
+#include "lisp.h"
+
+enum gc_types {
+	GC_FREE,
+	GC_EXPR,
+	GC_LIST,
+	GC_CONTEXT
+};
+
+struct gcstat {
+	size_t          heap_bytes;	/* bytes held in arena chunks */
+	size_t          live_bytes;
+	size_t          live_objects;
+	size_t          nallocs;
+	size_t          ncollections;
+	size_t          last_freed;	/* objects reclaimed by the last sweep */
+	double          pause_total;	/* seconds */
+	double          pause_max;
+	size_t          next_collection;	/* live_bytes that trigger a collection */
+};
+
+extern double   gc_growth;
+
+void           *gc_alloc(size_t size, int type);
+void            gc_free(void *p);
+void            gc_set_perm(void *p);
+void            gc_thread_start(struct gcstat * s);
+void            gc_thread_done(void);
+void            gc_thread_merge(const struct gcstat * s);
+void            gc_collect(struct context * root);
+void            gc_maybe_collect(struct context * root);
+const struct gcstat *gc_get_stats(void);
+
+#endif
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Heap images, written with -dump and read with -load.  An image holds
+ * the bindings of a root context laid out so that it can be mapped and
+ * turned back into expressions without reading or evaluating any
+ * source.  It contains no pointers: expressions refer to each other, to
+ * symbols and to strings by index, and every expression comes after the
+ * ones it contains, so a single forward pass rebuilds them.  Images are
+ * in host byte order; one written elsewhere fails the version check.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lisp.h"
+#include "image.h"
+#include "eval.h"
+#include "mem.h"
+#include "num.h"
+#include "sym.h"
+
+#define IMAGE_MAGIC	"LISPIMG"
+#define IMAGE_VERSION	1
+
+struct image_hdr {
+	char            magic[8];
+	uint32_t        version;
+	uint32_t        nnodes;
+	uint32_t        nelems;
+	uint32_t        nsyms;
+	uint32_t        nbinds;
+	uint32_t        strsize;
+};
+
+struct image_node {
+	int16_t         t;
+	int16_t         quoted;
+	int32_t         line;
+	uint64_t        a;		/* symbol, first element, value or string */
+	uint64_t        b;		/* list or string length */
+};
+
+struct image_str {
+	uint32_t        off;
+	uint32_t        len;
+};
+
+struct image_bind {
+	uint32_t        sym;
+	uint32_t        node;
+};
+
+/* Sections follow the header in this order. */
+struct image {
+	const char     *path;
+	size_t          size;
+	const struct image_hdr *hdr;
+	const struct image_node *nodes;
+	const uint32_t *elems;
+	const struct image_str *syms;
+	const struct image_bind *binds;
+	const char     *str;
+	struct atom   **atoms;
+};
+
+struct builder {
+	struct image_hdr hdr;
+	struct image_node *nodes;
+	uint32_t       *elems;
+	struct image_str *syms;
+	struct image_bind *binds;
+	char           *str;
+	size_t          nodesize, elemsize, symsize, bindsize, strcap;
+	int            *symidx;		/* by atom id, -1 if not written yet */
+	int             nsymidx;
+};
+
+static void    *
+grow(void *p, size_t * size, size_t n, size_t elsize)
+{
+	if (n <= *size)
+		return p;
+	while (n > *size)
+		*size = *size ? *size * 2 : 64;
+	if ((p = realloc(p, *size * elsize)) == NULL)
+		err(1, "realloc");
+	return p;
+}
+
+static uint32_t
+add_str(struct builder * b, const char *s, size_t len)
+{
+	uint32_t        off;
+
+	off = b->hdr.strsize;
+	b->str = grow(b->str, &b->strcap, off + len, 1);
+	memcpy(b->str + off, s, len);
+	b->hdr.strsize += len;
+	return off;
+}
+
+static uint32_t
+add_sym(struct builder * b, const struct atom * a)
+{
+	int             n;
+
+	/* names made at run time are symbols again once loaded */
+	a = intern_atom((struct atom *) a);
+	if (a->id >= b->nsymidx) {
+		n = b->nsymidx;
+		b->nsymidx = nsyms();
+		b->symidx = realloc(b->symidx, b->nsymidx * sizeof(*b->symidx));
+		while (n < b->nsymidx)
+			b->symidx[n++] = -1;
+	}
+	if (b->symidx[a->id] == -1) {
+		b->syms = grow(b->syms, &b->symsize, b->hdr.nsyms + 1, sizeof(*b->syms));
+		b->syms[b->hdr.nsyms].off = add_str(b, a->v, a->len);
+		b->syms[b->hdr.nsyms].len = a->len;
+		b->symidx[a->id] = b->hdr.nsyms++;
+	}
+	return b->symidx[a->id];
+}
+
+static uint32_t
+add_expr(struct builder * b, const struct expr * e)
+{
+	struct image_node n;
+	struct list    *l;
+	uint32_t       *kids;
+	char           *s;
+	int             i;
+
+	memset(&n, 0, sizeof(n));
+	n.t = TYPE(e);
+	if (!IS_FIXNUM(e)) {
+		n.quoted = e->quoted;
+		n.line = e->line;
+	}
+	switch (n.t) {
+	case LATOM:
+		n.a = add_sym(b, e->v.atom);
+		break;
+	case LLIST:
+		/* the elements go first, their indices then sit together */
+		kids = malloc((list_len(e) + 1) * sizeof(*kids));
+		for (i = 0, l = e->v.list; l != NULL; l = l->next)
+			kids[i++] = add_expr(b, l->v);
+		b->elems = grow(b->elems, &b->elemsize, b->hdr.nelems + i, sizeof(*b->elems));
+		memcpy(b->elems + b->hdr.nelems, kids, i * sizeof(*kids));
+		n.a = b->hdr.nelems;
+		n.b = i;
+		b->hdr.nelems += i;
+		free(kids);
+		break;
+	case LFIXNUM:
+		n.a = (uint64_t) (int64_t) FIXNUM_VAL(e);
+		break;
+	case LFLOAT:
+		memcpy(&n.a, &e->v.d, sizeof(n.a));
+		break;
+	case LBIGNUM:
+		s = number_str(e);
+		n.b = strlen(s);
+		n.a = add_str(b, s, n.b);
+		free(s);
+		break;
+	}
+	b->nodes = grow(b->nodes, &b->nodesize, b->hdr.nnodes + 1, sizeof(*b->nodes));
+	b->nodes[b->hdr.nnodes] = n;
+	return b->hdr.nnodes++;
+}
+
+void
+image_dump(const struct context * ctx, const char *path)
+{
+	struct builder  b;
+	FILE           *fp;
+	int             i;
+
+	memset(&b, 0, sizeof(b));
+	memcpy(b.hdr.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	b.hdr.version = IMAGE_VERSION;
+	for (i = 0; i < ctx->mapsize; ++i) {
+		if (ctx->map[i].k == NULL || ctx->map[i].v == NULL)
+			continue;
+		b.binds = grow(b.binds, &b.bindsize, b.hdr.nbinds + 1, sizeof(*b.binds));
+		b.binds[b.hdr.nbinds].sym = add_sym(&b, ctx->map[i].k);
+		b.binds[b.hdr.nbinds].node = add_expr(&b, ctx->map[i].v);
+		++b.hdr.nbinds;
+	}
+
+	if ((fp = fopen(path, "wb")) == NULL)
+		err(1, "%s", path);
+	fwrite(&b.hdr, sizeof(b.hdr), 1, fp);
+	fwrite(b.nodes, sizeof(*b.nodes), b.hdr.nnodes, fp);
+	fwrite(b.elems, sizeof(*b.elems), b.hdr.nelems, fp);
+	fwrite(b.syms, sizeof(*b.syms), b.hdr.nsyms, fp);
+	fwrite(b.binds, sizeof(*b.binds), b.hdr.nbinds, fp);
+	fwrite(b.str, 1, b.hdr.strsize, fp);
+	if (ferror(fp) | fclose(fp))
+		err(1, "%s", path);
+
+	free(b.nodes);
+	free(b.elems);
+	free(b.syms);
+	free(b.binds);
+	free(b.str);
+	free(b.symidx);
+}
+
+static void
+bad_image(const struct image * img)
+{
+	errx(1, "%s: not a valid image", img->path);
+}
+
+struct image   *
+image_open(const char *path)
+{
+	struct image   *img;
+	struct stat     st;
+	const struct image_hdr *h;
+	const char     *p;
+	size_t          size;
+	uint32_t        i;
+	int             fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		err(1, "%s", path);
+	img = calloc(1, sizeof(*img));
+	img->path = path;
+	img->size = st.st_size;
+	if (img->size < sizeof(*h))
+		bad_image(img);
+	if ((p = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		err(1, "%s", path);
+	close(fd);
+
+	img->hdr = h = (const struct image_hdr *) p;
+	if (memcmp(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) || h->version != IMAGE_VERSION)
+		bad_image(img);
+	size = sizeof(*h) + (size_t) h->nnodes * sizeof(*img->nodes) +
+	    (size_t) h->nelems * sizeof(*img->elems) +
+	    (size_t) h->nsyms * sizeof(*img->syms) +
+	    (size_t) h->nbinds * sizeof(*img->binds) + h->strsize;
+	if (size != img->size)
+		bad_image(img);
+
+	p += sizeof(*h);
+	img->nodes = (const struct image_node *) p;
+	p += (size_t) h->nnodes * sizeof(*img->nodes);
+	img->elems = (const uint32_t *) p;
+	p += (size_t) h->nelems * sizeof(*img->elems);
+	img->syms = (const struct image_str *) p;
+	p += (size_t) h->nsyms * sizeof(*img->syms);
+	img->binds = (const struct image_bind *) p;
+	p += (size_t) h->nbinds * sizeof(*img->binds);
+	img->str = p;
+
+	/* symbols are interned once, every load shares them */
+	img->atoms = malloc((h->nsyms + 1) * sizeof(*img->atoms));
+	for (i = 0; i < h->nsyms; ++i) {
+		if (img->syms[i].off > h->strsize || img->syms[i].len > h->strsize - img->syms[i].off)
+			bad_image(img);
+		img->atoms[i] = intern_n(img->str + img->syms[i].off, img->syms[i].len);
+	}
+	return img;
+}
+
+/* Takes node i out of built[], each may be used only once. */
+static struct expr *
+take(const struct image * img, struct expr ** built, uint64_t i, uint32_t limit)
+{
+	struct expr    *e;
+
+	if (i >= limit || built[i] == NULL)
+		bad_image(img);
+	e = built[i];
+	built[i] = NULL;
+	return e;
+}
+
+static struct expr *
+load_node(const struct image * img, struct expr ** built, uint32_t i)
+{
+	const struct image_node *n;
+	struct expr    *e;
+	struct list   **tail;
+	double          d;
+	uint64_t        k;
+
+	n = &img->nodes[i];
+	switch (n->t) {
+	case LATOM:
+		if (n->a >= img->hdr->nsyms)
+			bad_image(img);
+		e = new_expr(LATOM);
+		e->v.atom = img->atoms[n->a];
+		break;
+	case LLIST:
+		if (n->a > img->hdr->nelems || n->b > img->hdr->nelems - n->a)
+			bad_image(img);
+		e = new_expr(LLIST);
+		tail = &e->v.list;
+		for (k = 0; k < n->b; ++k) {
+			*tail = new_list();
+			(*tail)->v = take(img, built, img->elems[n->a + k], i);
+			tail = &(*tail)->next;
+		}
+		break;
+	case LFIXNUM:
+		e = make_int((int64_t) n->a);
+		break;
+	case LFLOAT:
+		memcpy(&d, &n->a, sizeof(d));
+		e = make_float(d);
+		break;
+	case LBIGNUM:
+		if (n->a > img->hdr->strsize || n->b > img->hdr->strsize - n->a ||
+		    (e = read_number(img->str + n->a, n->b)) == NULL)
+			bad_image(img);
+		break;
+	default:
+		bad_image(img);
+		return NULL;
+	}
+	if (!IS_FIXNUM(e)) {
+		e->quoted = n->quoted;
+		e->line = n->line;
+	}
+	return e;
+}
+
+void
+image_load(const struct image * img, struct context * ctx)
+{
+	const struct image_hdr *h;
+	struct expr   **built;
+	uint32_t        i;
+
+	h = img->hdr;
+	built = malloc((h->nnodes + 1) * sizeof(*built));
+	for (i = 0; i < h->nnodes; ++i)
+		built[i] = load_node(img, built, i);
+	for (i = 0; i < h->nbinds; ++i) {
+		if (img->binds[i].sym >= h->nsyms)
+			bad_image(img);
+		free_expr(add_to_context(ctx, img->atoms[img->binds[i].sym],
+		    take(img, built, img->binds[i].node, h->nnodes)));
+	}
+	/* a well formed image uses every node */
+	for (i = 0; i < h->nnodes; ++i)
+		free_expr(built[i]);
+	free(built);
+}
@@ -14,38 +14,59 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <err.h>
+
 #include "lisp.h"
 #include "parse.h"
 #include "eval.h"
 #include "mem.h"
 #include "util.h"
+#include "gc.h"
+#include "vm.h"
+#include "prof.h"
+#include "image.h"
+#include "pool.h"
 
 int             dflag;
+int             iflag;
+int             pflag;
+
+static struct image *image;
+static const char *dumpfile;
 
 void
 usage(void)
 {
-	printf("usage: %s [-h | -e <lisp_expr> | <filename>]\n", PROGNAME);
+	printf("usage: %s [-h | -i | -g <heap_growth> | -s <max_depth> | -j <threads> | -p <profile_file> | -load <image> | -dump <image> | -e <lisp_expr> | <filename> | -]\n", PROGNAME);
 }
 
 void
-proc_buffer(const char *buffer)
+proc_reader(struct reader * r)
 {
 	struct context *ctx;
 	struct expr    *e, *er;
-	const char     *p;
-	char           *buf;
+	int             failed;
 
 	ctx = new_context();
-	p = skip_space(buffer);
-	while (*p != '\0') {
+	if (image != NULL)
+		image_load(image, ctx);
+	while ((e = read_expr(r)) != NULL) {
 		dbgprintf("------------------------------------------------\n");
-		buf = expr_dup(p);
-		dbgprintf("%s\n\n", buf);
+		dbgprintf("### LINE %d\n", IS_FIXNUM(e) ? 0 : e->line);
+		if (dflag)
+			peval(e, "### EXPR: ");
 
-		e = parse_expr(buf);
-		ctx->is_root_level = 1;
-		er = eval(e, ctx);
+		if (setjmp(eval_top) == 0) {
+			er = iflag ? eval(e, ctx) : vm_eval(e, ctx);
+			failed = 0;
+		} else {
+			vm_reset();
+			if (pflag)
+				prof_reset();
+			er = empty_list();
+			failed = 1;
+		}
+		free_expr(e);
 
 		dbgprintf("\n");
 		if (dflag)
@@ -54,20 +75,48 @@ proc_buffer(const char *buffer)
 		printf("\n");
 		dbgprintf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n\n\n");
 
-		Free(buf);
 		free_expr(er);
-
-		p = next_expr(p);
+		/* the collector takes care of what an error dropped */
+		if (failed)
+			gc_collect(ctx);
+		else
+			gc_maybe_collect(ctx);
+	}
+	if (dumpfile != NULL) {
+		image_dump(ctx, dumpfile);
+		dumpfile = NULL;
 	}
 	free_context_r(ctx);
+	gc_free(ctx);
+}
+
+void
+proc_buffer(const char *buffer)
+{
+	struct reader   r;
+
+	reader_init(&r, buffer, strlen(buffer));
+	proc_reader(&r);
+	reader_close(&r);
+}
+
+void
+proc_file(const char *filename)
+{
+	struct reader   r;
+
+	if (reader_open(&r, filename) == -1)
+		err(1, "%s", filename);
+	proc_reader(&r);
+	reader_close(&r);
 }
 
 int
 main(int argc, char **argv)
 {
 	int             i;
-	char           *buf, *p;
 
+	set_stack_base(&i);
 	if (argc < 2) {
 		usage();
 		exit(0);
@@ -82,18 +131,43 @@ main(int argc, char **argv)
 	for (i = 1; i < argc; ++i) {
 		if (!strcmp(argv[i], "-d")) {
 			dflag = 1;
+		} else if (!strcmp(argv[i], "-i")) {
+			iflag = 1;
+		} else if (!strcmp(argv[i], "-g")) {
+			if (++i >= argc)
+				exit(0);
+			if ((gc_growth = atof(argv[i])) < 1.0)
+				gc_growth = 1.0;
+		} else if (!strcmp(argv[i], "-s")) {
+			if (++i >= argc)
+				exit(0);
+			if ((max_depth = atoi(argv[i])) < 1)
+				max_depth = 1;
+		} else if (!strcmp(argv[i], "-j")) {
+			if (++i >= argc)
+				exit(0);
+			if ((pool_size = atoi(argv[i])) < 1)
+				pool_size = 1;
+		} else if (!strcmp(argv[i], "-p")) {
+			if (++i >= argc)
+				exit(0);
+			if (!pflag)
+				prof_start(argv[i]);
+			pflag = 1;
+		} else if (!strcmp(argv[i], "-load")) {
+			if (++i >= argc)
+				exit(0);
+			image = image_open(argv[i]);
+		} else if (!strcmp(argv[i], "-dump")) {
+			if (++i >= argc)
+				exit(0);
+			dumpfile = argv[i];
 		} else if (!strcmp(argv[i], "-e")) {
 			if (++i >= argc)
 				exit(0);
-			buf = strdup(argv[i]);
-			proc_buffer(buf);
-			Free(buf);
+			proc_buffer(argv[i]);
 		} else {
-			if ((buf = load_lisp_source_file(argv[i])) == NULL)
-				exit(0);
-			dbgprintf("--- processing buffer ---\n\"%s\"\n", buf);
-			proc_buffer(buf);
-			Free(buf);
+			proc_file(argv[i]);
 		}
 	}
 
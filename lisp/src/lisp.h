@@ -22,20 +22,39 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <stdint.h>
 
 #define PROGNAME "lisp"
 
+struct context;
+struct bignum;
+
+/*
+ * Expressions and list cells are immutable once built and are shared
+ * by reference counting: exprs_dup()/list_dup() take a reference,
+ * free_expr()/free_list() drop one.
+ */
 struct expr {
-	int             t;
-	int             quoted;
+	short           t;
+	short           quoted;
+	int             refs;
+	int             line;		/* source line, 0 if built at run time */
+	int             code;		/* compiled lambda, see compile.c */
 	union {
 		struct atom {
 			char           *v;
+			size_t          len;
+			unsigned int    hash;
+			int             id;
+			struct expr    *(*op) (struct expr *, struct context *);
 		}              *atom;
 		struct list {
 			struct expr    *v;
 			struct list    *next;
+			int             refs;
 		}              *list;
+		double          d;
+		struct bignum  *big;
 	}               v;
 #define vatom v.atom
 #define vlist v.list
@@ -44,18 +63,43 @@ struct expr {
 enum expr_types {
 	LINVALID = -1,
 	LATOM,
-	LLIST
+	LLIST,
+	LFIXNUM,
+	LFLOAT,
+	LBIGNUM
 };
 
+/*
+ * Fixnums are not allocated: the integer lives in the pointer itself,
+ * shifted left with the low bit set.  Anything that may be a number
+ * has to go through TYPE() or IS_FIXNUM() before being dereferenced.
+ */
+#define IS_FIXNUM(e)	((uintptr_t) (e) & 1)
+#define FIXNUM(n)	((struct expr *) (((uintptr_t) (intptr_t) (n) << 1) | 1))
+#define FIXNUM_VAL(e)	((intptr_t) (e) >> 1)
+#define FIXNUM_MAX	(INTPTR_MAX >> 1)
+#define FIXNUM_MIN	(INTPTR_MIN >> 1)
+#define TYPE(e)		(IS_FIXNUM(e) ? LFIXNUM : (e)->t)
+
+/* Set in context mask for every atom bound there, to skip frames fast. */
+#define SYM_BIT(a)	((uint64_t) 1 << ((a)->id & 63))
+
 struct context {
+	uint64_t        mask;
+	uint64_t        upmask;		/* masks of this and all frames but root */
+	struct context *root;		/* outermost context, NULL for itself */
 	int             nmap;
+	int             mapsize;	/* power of 2, open addressing */
 	struct map {
-		char           *k;
+		struct atom    *k;
 		struct expr    *v;
 	}              *map;
 	struct context *next;
 
-	int             is_root_level;
+	/* VM frames keep their parameters outside of the hash table */
+	int             nslots;
+	struct atom   **slotk;
+	struct expr   **slotv;
 };
 
 #endif
@@ -16,125 +16,138 @@
 
 #include "lisp.h"
 #include "mem.h"
+#include "sym.h"
+#include "gc.h"
+#include "vm.h"
+#include "pool.h"
+
+/* Objects are shared between threads while pmap workers run. */
+#define INCREF(p)	(threaded ? __atomic_add_fetch(&(p)->refs, 1, __ATOMIC_RELAXED) : ++(p)->refs)
+#define DECREF(p)	(threaded ? __atomic_sub_fetch(&(p)->refs, 1, __ATOMIC_ACQ_REL) : --(p)->refs)
 
 struct expr    *
 new_expr(int t)
 {
 	struct expr    *e;
 
-	e = calloc(1, sizeof(*e));
+	e = gc_alloc(sizeof(*e), GC_EXPR);
 	e->t = t;
+	e->refs = 1;
 	return e;
 }
 
 struct list    *
 new_list(void)
 {
-	return calloc(1, sizeof(struct list));
+	struct list    *l;
+
+	l = gc_alloc(sizeof(*l), GC_LIST);
+	l->refs = 1;
+	return l;
 }
 
 struct atom    *
 new_atom(const char *s)
 {
-	struct atom    *a;
-	a = calloc(1, sizeof(struct atom));
-	if (s)
-		a->v = strdup(s);
-	return a;
+	if (s == NULL)
+		return NULL;
+	return intern(s);
 }
 
 struct context *
 new_context(void)
 {
-	return calloc(1, sizeof(struct context));
+	return gc_alloc(sizeof(struct context), GC_CONTEXT);
+}
+
+struct context *
+new_frame(struct context * parent)
+{
+	struct context *ctx;
+
+	ctx = new_context();
+	ctx->next = parent;
+	ctx->root = parent->root ? parent->root : parent;
+	ctx->upmask = parent->upmask;
+	return ctx;
 }
 
 struct list    *
 list_dup(const struct list * l)
 {
-	struct list    *nl;
-
 	if (l == NULL)
 		return NULL;
 
-	nl = new_list();
-	nl->v = exprs_dup(l->v);
-	nl->next = list_dup(l->next);
-	return nl;
+	INCREF((struct list *) l);
+	return (struct list *) l;
 }
 
 struct atom    *
 atom_dup(const struct atom * a)
 {
-	struct atom    *na;
-
-	if (a == NULL)
-		return NULL;
-	else
-		return new_atom(a->v);
+	/* symbols are shared, an uninterned atom belongs to one expr */
+	if (a != NULL && !IS_INTERNED(a))
+		return uninterned(a->v, a->len);
+	return (struct atom *) a;
 }
 
 struct expr    *
 exprs_dup(const struct expr * e)
 {
-	struct expr    *ne;
+	if (e == NULL || IS_FIXNUM(e))
+		return (struct expr *) e;
 
-	if (e == NULL)
-		return NULL;
-
-	ne = new_expr(e->t);
-	ne->quoted = e->quoted;
-
-	if (e->t == LATOM) {
-		ne->v.atom = atom_dup(e->v.atom);
-	} else if (e->t == LLIST) {
-		ne->v.list = list_dup(e->v.list);
-	}
-	return ne;
+	INCREF((struct expr *) e);
+	return (struct expr *) e;
 }
 
 void           *
 free_atom(struct atom * a)
 {
-	if (!a)
-		return NULL;
-	if (a->v)
-		Free(a->v);
-	Free(a);
+	/* interned atoms live as long as the symbol table */
+	if (a != NULL && !IS_INTERNED(a)) {
+		free(a->v);
+		free(a);
+	}
 	return NULL;
 }
 
 void           *
 free_list(struct list * l)
 {
-	if (!l)
-		return NULL;
-	if (l->next)
-		l->next = free_list(l->next);
-	l->v = free_expr(l->v);
-	Free(l);
+	struct list    *next;
+
+	/* iterative, so that dropping a long list doesn't eat the stack */
+	while (l != NULL && DECREF(l) == 0) {
+		next = l->next;
+		free_expr(l->v);
+		gc_free(l);
+		l = next;
+	}
 	return NULL;
 }
 
 void           *
 free_expr(struct expr * e)
 {
-	if (!e)
+	if (!e || IS_FIXNUM(e) || DECREF(e) > 0)
 		return NULL;
-	if (e->t == LATOM)
-		e->v.atom = free_atom(e->v.atom);
-	else if (e->t == LLIST)
-		e->v.list = free_list(e->v.list);
-	/* Free(e); */
+	if (e->code)
+		drop_code(e);
+	if (e->t == LLIST)
+		free_list(e->v.list);
+	else if (e->t == LATOM)
+		free_atom(e->v.atom);
+	else if (e->t == LBIGNUM)
+		free(e->v.big);
+	gc_free(e);
 	return NULL;
 }
 
 void           *
 full_free_expr(struct expr * e)
 {
-	free_expr(e);
-	Free(e);
-	return NULL;
+	return free_expr(e);
 }
 
 void           *
@@ -145,11 +158,14 @@ free_context(struct context * ctx)
 	if (!ctx)
 		return NULL;
 
-	for (i = 0; i < ctx->nmap; ++i) {
-		Free(ctx->map[i].k);
-		free_expr(ctx->map[i].v);
+	for (i = 0; i < ctx->mapsize; ++i) {
+		if (ctx->map[i].k != NULL)
+			free_expr(ctx->map[i].v);
 	}
 	ctx->nmap = 0;
+	ctx->mapsize = 0;
+	ctx->mask = 0;
+	ctx->upmask = 0;
 	Free(ctx->map);
 	return NULL;
 }
@@ -172,9 +188,13 @@ free_args(struct args * a)
 {
 	int             i;
 
-	if (!a || a->argc == 0)
-		return;
-
-	for (i = 0; i < a->argc; ++i)
-		Free(a->argv[i]);
+	/* the other strings belong to the symbol table */
+	for (i = 0; i < a->nowned; ++i)
+		free(a->owned[i]);
+	Free(a->owned);
+	Free(a->argv);
+	a->argc = 0;
+	a->argsize = 0;
+	a->nowned = 0;
+	a->ownedsize = 0;
 }
@@ -25,6 +25,7 @@ struct expr    *new_expr(int t);
 struct list    *new_list(void);
 struct atom    *new_atom(const char *s);
 struct context *new_context(void);
+struct context *new_frame(struct context * parent);
 struct list    *list_dup(const struct list * l);
 struct atom    *atom_dup(const struct atom * a);
 struct expr    *exprs_dup(const struct expr * e);
@@ -0,0 +1,741 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Numbers: fixnums (see lisp.h), doubles and bignums.  Integer results
+ * that don't fit a fixnum are promoted to bignums and bignum results
+ * that do are demoted again, so a value has a single representation.
+ * Any double operand makes the result a double.
+ */
+
+#include <err.h>
+#include <math.h>
+
+#include "lisp.h"
+#include "num.h"
+#include "eval.h"
+#include "mem.h"
+
+int
+is_number(const struct expr * e)
+{
+	int             t;
+
+	if (e == NULL)
+		return 0;
+	t = TYPE(e);
+	return t == LFIXNUM || t == LFLOAT || t == LBIGNUM;
+}
+
+static struct bignum *
+big_new(int n)
+{
+	struct bignum  *b;
+
+	if ((b = calloc(1, sizeof(*b) + n * sizeof(b->d[0]))) == NULL)
+		err(1, "calloc");
+	b->sign = 1;
+	b->n = n;
+	return b;
+}
+
+static void
+big_trim(struct bignum * b)
+{
+	while (b->n > 0 && b->d[b->n - 1] == 0)
+		--b->n;
+}
+
+/* Takes over b. */
+static struct expr *
+big_expr(struct bignum * b)
+{
+	struct expr    *e;
+	uint64_t        m;
+
+	big_trim(b);
+	if (b->n <= 2) {
+		m = b->n > 0 ? b->d[0] : 0;
+		if (b->n == 2)
+			m |= (uint64_t) b->d[1] << 32;
+		if (m <= (uint64_t) FIXNUM_MAX + (b->sign < 0)) {
+			e = FIXNUM(b->sign > 0 ? (intptr_t) m : -(intptr_t) m);
+			free(b);
+			return e;
+		}
+	}
+	e = new_expr(LBIGNUM);
+	e->v.big = b;
+	return e;
+}
+
+static struct bignum *
+big_of_int(intmax_t v)
+{
+	struct bignum  *b;
+	uint64_t        m;
+
+	b = big_new(2);
+	if (v < 0) {
+		b->sign = -1;
+		m = (uint64_t) -(v + 1) + 1;
+	} else {
+		m = v;
+	}
+	b->d[0] = (uint32_t) m;
+	b->d[1] = (uint32_t) (m >> 32);
+	big_trim(b);
+	return b;
+}
+
+/* A new copy of integer e as a bignum. */
+static struct bignum *
+big_of(const struct expr * e)
+{
+	struct bignum  *b;
+
+	if (IS_FIXNUM(e))
+		return big_of_int(FIXNUM_VAL(e));
+	b = big_new(e->v.big->n);
+	b->sign = e->v.big->sign;
+	memcpy(b->d, e->v.big->d, b->n * sizeof(b->d[0]));
+	return b;
+}
+
+static int
+mag_cmp(const struct bignum * a, const struct bignum * b)
+{
+	int             i;
+
+	if (a->n != b->n)
+		return a->n < b->n ? -1 : 1;
+	for (i = a->n; i-- > 0;) {
+		if (a->d[i] != b->d[i])
+			return a->d[i] < b->d[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+static struct bignum *
+mag_add(const struct bignum * a, const struct bignum * b)
+{
+	const struct bignum *t;
+	struct bignum  *r;
+	uint64_t        c = 0;
+	int             i;
+
+	if (a->n < b->n) {
+		t = a;
+		a = b;
+		b = t;
+	}
+	r = big_new(a->n + 1);
+	for (i = 0; i < a->n; ++i) {
+		c += (uint64_t) a->d[i] + (i < b->n ? b->d[i] : 0);
+		r->d[i] = (uint32_t) c;
+		c >>= 32;
+	}
+	r->d[i] = (uint32_t) c;
+	return r;
+}
+
+/* |a| - |b| where |a| >= |b| */
+static struct bignum *
+mag_sub(const struct bignum * a, const struct bignum * b)
+{
+	struct bignum  *r;
+	int64_t         t;
+	int             i, borrow = 0;
+
+	r = big_new(a->n);
+	for (i = 0; i < a->n; ++i) {
+		t = (int64_t) a->d[i] - (i < b->n ? b->d[i] : 0) - borrow;
+		borrow = t < 0;
+		r->d[i] = (uint32_t) t;
+	}
+	return r;
+}
+
+static struct bignum *
+mag_mul(const struct bignum * a, const struct bignum * b)
+{
+	struct bignum  *r;
+	uint64_t        c;
+	int             i, j;
+
+	r = big_new(a->n + b->n);
+	for (i = 0; i < a->n; ++i) {
+		c = 0;
+		for (j = 0; j < b->n; ++j) {
+			c += (uint64_t) a->d[i] * b->d[j] + r->d[i + j];
+			r->d[i + j] = (uint32_t) c;
+			c >>= 32;
+		}
+		r->d[i + b->n] = (uint32_t) c;
+	}
+	return r;
+}
+
+/* Quotient and remainder of the magnitudes, b is not 0. */
+static void
+mag_divmod(const struct bignum * a, const struct bignum * b, struct bignum ** qp, struct bignum ** rp)
+{
+	struct bignum  *q, *r;
+	uint64_t        rem;
+	uint32_t        bit, t;
+	int64_t         s;
+	int             i, j, w, ge, borrow;
+
+	q = big_new(a->n);
+	if (b->n == 1) {
+		rem = 0;
+		for (i = a->n; i-- > 0;) {
+			rem = rem << 32 | a->d[i];
+			q->d[i] = (uint32_t) (rem / b->d[0]);
+			rem %= b->d[0];
+		}
+		r = big_new(1);
+		r->d[0] = (uint32_t) rem;
+		*qp = q;
+		*rp = r;
+		return;
+	}
+
+	/* shift and subtract, one bit at a time */
+	w = b->n + 1;
+	r = big_new(w);
+	for (i = a->n * 32; i-- > 0;) {
+		bit = (a->d[i / 32] >> (i % 32)) & 1;
+		for (j = 0; j < w; ++j) {
+			t = r->d[j] >> 31;
+			r->d[j] = r->d[j] << 1 | bit;
+			bit = t;
+		}
+		ge = 1;
+		for (j = w; j-- > 0;) {
+			t = j < b->n ? b->d[j] : 0;
+			if (r->d[j] != t) {
+				ge = r->d[j] > t;
+				break;
+			}
+		}
+		if (!ge)
+			continue;
+		borrow = 0;
+		for (j = 0; j < w; ++j) {
+			s = (int64_t) r->d[j] - (j < b->n ? b->d[j] : 0) - borrow;
+			borrow = s < 0;
+			r->d[j] = (uint32_t) s;
+		}
+		q->d[i / 32] |= (uint32_t) 1 << (i % 32);
+	}
+	*qp = q;
+	*rp = r;
+}
+
+/* a + b, with b's sign taken to be bsign */
+static struct bignum *
+big_add(const struct bignum * a, const struct bignum * b, int bsign)
+{
+	struct bignum  *r;
+
+	if (a->sign == bsign) {
+		r = mag_add(a, b);
+		r->sign = a->sign;
+	} else if (mag_cmp(a, b) >= 0) {
+		r = mag_sub(a, b);
+		r->sign = a->sign;
+	} else {
+		r = mag_sub(b, a);
+		r->sign = bsign;
+	}
+	big_trim(r);
+	return r;
+}
+
+static struct expr *
+big_arith(int op, const struct expr * x, const struct expr * y)
+{
+	struct bignum  *a, *b, *q, *r, *t;
+
+	a = big_of(x);
+	b = big_of(y);
+	switch (op) {
+	case NUM_ADD:
+		r = big_add(a, b, b->sign);
+		break;
+	case NUM_SUB:
+		r = big_add(a, b, -b->sign);
+		break;
+	case NUM_MUL:
+		r = mag_mul(a, b);
+		r->sign = a->sign * b->sign;
+		break;
+	default:
+		if (b->n == 0) {
+			free(a);
+			free(b);
+			eval_error("division by zero");
+		}
+		mag_divmod(a, b, &q, &r);
+		q->sign = a->sign * b->sign;
+		r->sign = a->sign;
+		big_trim(r);
+		if (op == NUM_DIV) {
+			free(r);
+			r = q;
+		} else {
+			free(q);
+			if (r->n != 0 && r->sign != b->sign) {
+				t = big_add(r, b, b->sign);
+				free(r);
+				r = t;
+			}
+		}
+		break;
+	}
+	free(a);
+	free(b);
+	return big_expr(r);
+}
+
+static int
+big_cmp(const struct expr * x, const struct expr * y)
+{
+	struct bignum  *a, *b;
+	int             c;
+
+	a = big_of(x);
+	b = big_of(y);
+	if (a->sign != b->sign)
+		c = a->sign;
+	else
+		c = mag_cmp(a, b) * a->sign;
+	free(a);
+	free(b);
+	return c;
+}
+
+static double
+to_double(const struct expr * e)
+{
+	double          d = 0;
+	int             i;
+
+	switch (TYPE(e)) {
+	case LFIXNUM:
+		return FIXNUM_VAL(e);
+	case LFLOAT:
+		return e->v.d;
+	default:
+		for (i = e->v.big->n; i-- > 0;)
+			d = d * 4294967296.0 + e->v.big->d[i];
+		return d * e->v.big->sign;
+	}
+}
+
+struct expr    *
+make_int(intmax_t v)
+{
+	if (v >= FIXNUM_MIN && v <= FIXNUM_MAX)
+		return FIXNUM(v);
+	return big_expr(big_of_int(v));
+}
+
+struct expr    *
+make_float(double d)
+{
+	struct expr    *e;
+
+	e = new_expr(LFLOAT);
+	e->v.d = d;
+	return e;
+}
+
+/*
+ * The number spelled by the len bytes at s, or NULL if it's not one:
+ * an optionally signed run of digits is an integer, anything strtod()
+ * takes whole that starts like a number and isn't hex is a double.
+ */
+struct expr    *
+read_number(const char *s, size_t len)
+{
+	const char     *p, *q, *end = s + len;
+	char            buf[64], *ep;
+	struct bignum  *b;
+	intmax_t        v = 0;
+	double          d;
+	uint64_t        c;
+	int             neg = 0, i;
+
+	p = s;
+	if (p < end && (*p == '+' || *p == '-'))
+		neg = *p++ == '-';
+	for (q = p; q < end && isdigit((unsigned char) *q); ++q)
+		 /* empty */ ;
+	if (q == end) {
+		if (q == p)
+			return NULL;
+		if (q - p <= 18) {
+			for (; p < end; ++p)
+				v = v * 10 + (*p - '0');
+			return make_int(neg ? -v : v);
+		}
+		b = big_new((q - p) / 9 + 1);
+		b->n = 0;
+		for (; p < end; ++p) {
+			c = *p - '0';
+			for (i = 0; i < b->n; ++i) {
+				c += (uint64_t) b->d[i] * 10;
+				b->d[i] = (uint32_t) c;
+				c >>= 32;
+			}
+			if (c != 0)
+				b->d[b->n++] = (uint32_t) c;
+		}
+		b->sign = neg ? -1 : 1;
+		return big_expr(b);
+	}
+
+	if (q == p && !(q + 1 < end && *q == '.' && isdigit((unsigned char) q[1])))
+		return NULL;
+	if (len >= sizeof(buf) || memchr(s, 'x', len) || memchr(s, 'X', len))
+		return NULL;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	d = strtod(buf, &ep);
+	if (*ep != '\0')
+		return NULL;
+	return make_float(d);
+}
+
+static char    *
+big_str(const struct bignum * b)
+{
+	uint32_t       *d, *chunks;
+	uint64_t        rem;
+	char           *s, *p;
+	int             n, nchunks = 0, i;
+
+	n = b->n;
+	d = malloc(n * sizeof(*d));
+	memcpy(d, b->d, n * sizeof(*d));
+	chunks = malloc((n * 10 / 9 + 2) * sizeof(*chunks));
+	/* at least one chunk, even for no digits at all */
+	do {
+		rem = 0;
+		for (i = n; i-- > 0;) {
+			rem = rem << 32 | d[i];
+			d[i] = (uint32_t) (rem / 1000000000);
+			rem %= 1000000000;
+		}
+		chunks[nchunks++] = (uint32_t) rem;
+		while (n > 0 && d[n - 1] == 0)
+			--n;
+	} while (n > 0);
+	s = p = malloc(nchunks * 9 + 2);
+	if (b->sign < 0)
+		*p++ = '-';
+	p += sprintf(p, "%u", chunks[--nchunks]);
+	while (nchunks > 0)
+		p += sprintf(p, "%09u", chunks[--nchunks]);
+	free(d);
+	free(chunks);
+	return s;
+}
+
+/* Printed form of number e, to be freed by the caller. */
+char           *
+number_str(const struct expr * e)
+{
+	char            buf[64];
+	size_t          n;
+
+	switch (TYPE(e)) {
+	case LFIXNUM:
+		snprintf(buf, sizeof(buf), "%jd", (intmax_t) FIXNUM_VAL(e));
+		break;
+	case LFLOAT:
+		/* the shortest of these that reads back the same */
+		snprintf(buf, sizeof(buf), "%.15g", e->v.d);
+		if (strtod(buf, NULL) != e->v.d)
+			snprintf(buf, sizeof(buf), "%.17g", e->v.d);
+		n = strlen(buf);
+		if (isfinite(e->v.d) && strpbrk(buf, ".e") == NULL && n + 2 < sizeof(buf))
+			memcpy(buf + n, ".0", 3);
+		break;
+	case LBIGNUM:
+		return big_str(e->v.big);
+	default:
+		return NULL;
+	}
+	return strdup(buf);
+}
+
+/* -1, 0 or 1 as a is less, equal or greater than b, 2 if unordered. */
+int
+num_cmp(const struct expr * a, const struct expr * b)
+{
+	intptr_t        x, y;
+	double          dx, dy;
+
+	if (!is_number(a) || !is_number(b))
+		return 2;
+	if (IS_FIXNUM(a) && IS_FIXNUM(b)) {
+		x = FIXNUM_VAL(a);
+		y = FIXNUM_VAL(b);
+		return (x > y) - (x < y);
+	}
+	if (TYPE(a) == LFLOAT || TYPE(b) == LFLOAT) {
+		dx = to_double(a);
+		dy = to_double(b);
+		if (dx < dy)
+			return -1;
+		if (dx > dy)
+			return 1;
+		return dx == dy ? 0 : 2;
+	}
+	return big_cmp(a, b);
+}
+
+/*
+ * Value level arithmetic and comparisons, shared by the builtins and
+ * the VM.  Division truncates, mod takes the sign of the divisor.
+ */
+struct expr    *
+num_of(int op, const struct expr * a, const struct expr * b)
+{
+	intptr_t        x, y, r;
+	double          dx, dy, dr;
+	int             c;
+
+	if (!is_number(a) || !is_number(b))
+		return empty_list();
+
+	if (op >= NUM_LT) {
+		c = num_cmp(a, b);
+		switch (op) {
+		case NUM_LT:
+			c = c == -1;
+			break;
+		case NUM_GT:
+			c = c == 1;
+			break;
+		case NUM_LE:
+			c = c == -1 || c == 0;
+			break;
+		case NUM_GE:
+			c = c == 1 || c == 0;
+			break;
+		default:
+			c = c == 0;
+			break;
+		}
+		return c ? atom_t() : empty_list();
+	}
+
+	if (IS_FIXNUM(a) && IS_FIXNUM(b)) {
+		x = FIXNUM_VAL(a);
+		y = FIXNUM_VAL(b);
+		switch (op) {
+		case NUM_ADD:
+			r = x + y;
+			break;
+		case NUM_SUB:
+			r = x - y;
+			break;
+		case NUM_MUL:
+			if (__builtin_mul_overflow(x, y, &r))
+				return big_arith(op, a, b);
+			break;
+		case NUM_DIV:
+			if (y == 0)
+				eval_error("division by zero");
+			r = x / y;
+			break;
+		default:
+			if (y == 0)
+				eval_error("division by zero");
+			r = x % y;
+			if (r != 0 && (r < 0) != (y < 0))
+				r += y;
+			break;
+		}
+		return make_int(r);
+	}
+
+	if (TYPE(a) != LFLOAT && TYPE(b) != LFLOAT)
+		return big_arith(op, a, b);
+
+	dx = to_double(a);
+	dy = to_double(b);
+	switch (op) {
+	case NUM_ADD:
+		dr = dx + dy;
+		break;
+	case NUM_SUB:
+		dr = dx - dy;
+		break;
+	case NUM_MUL:
+		dr = dx * dy;
+		break;
+	case NUM_DIV:
+		dr = dx / dy;
+		break;
+	default:
+		dr = fmod(dx, dy);
+		if (dr != 0 && (dr < 0) != (dy < 0))
+			dr += dy;
+		break;
+	}
+	return make_float(dr);
+}
+
+static struct expr *
+fold(int op, struct expr * e, struct context * ctx)
+{
+	struct expr    *acc, *a, *r;
+	struct list    *l;
+
+	if (!e || list_len(e) < 2)
+		return empty_list();
+
+	l = e->v.list->next;
+	acc = eval(l->v, ctx);
+	if (!is_number(acc)) {
+		free_expr(acc);
+		return empty_list();
+	}
+	/* (- x) and (/ x) */
+	if (l->next == NULL && (op == NUM_SUB || op == NUM_DIV)) {
+		r = num_of(op, FIXNUM(op == NUM_SUB ? 0 : 1), acc);
+		free_expr(acc);
+		return r;
+	}
+	for (l = l->next; l != NULL; l = l->next) {
+		a = eval(l->v, ctx);
+		r = num_of(op, acc, a);
+		free_expr(acc);
+		free_expr(a);
+		acc = r;
+	}
+	return acc;
+}
+
+static struct expr *
+compare(int op, struct expr * e, struct context * ctx)
+{
+	struct expr    *a, *b, *r;
+	struct list    *l;
+	int             ok = 1;
+
+	if (!e || list_len(e) < 3)
+		return empty_list();
+
+	l = e->v.list->next;
+	a = eval(l->v, ctx);
+	for (l = l->next; l != NULL; l = l->next) {
+		b = eval(l->v, ctx);
+		r = num_of(op, a, b);
+		ok = ok && is_atom_t(r);
+		free_expr(r);
+		free_expr(a);
+		a = b;
+	}
+	free_expr(a);
+	return ok ? atom_t() : empty_list();
+}
+
+/* NUM_* for arithmetic and comparison builtins, -1 for others */
+int
+num_op(struct expr * (*op) (struct expr *, struct context *))
+{
+	static struct expr *(*const funcs[]) (struct expr *, struct context *) = {
+		plus, minus, times, divide, modulo, lt, gt, le, ge, numeq
+	};
+	static const int nums[] = {
+		NUM_ADD, NUM_SUB, NUM_MUL, NUM_DIV, NUM_MOD,
+		NUM_LT, NUM_GT, NUM_LE, NUM_GE, NUM_EQ
+	};
+	int             i;
+
+	for (i = 0; i < (int) (sizeof(nums) / sizeof(nums[0])); ++i) {
+		if (funcs[i] == op)
+			return nums[i];
+	}
+	return -1;
+}
+
+struct expr    *
+plus(struct expr * e, struct context * ctx)
+{
+	return fold(NUM_ADD, e, ctx);
+}
+
+struct expr    *
+minus(struct expr * e, struct context * ctx)
+{
+	return fold(NUM_SUB, e, ctx);
+}
+
+struct expr    *
+times(struct expr * e, struct context * ctx)
+{
+	return fold(NUM_MUL, e, ctx);
+}
+
+struct expr    *
+divide(struct expr * e, struct context * ctx)
+{
+	return fold(NUM_DIV, e, ctx);
+}
+
+struct expr    *
+modulo(struct expr * e, struct context * ctx)
+{
+	return fold(NUM_MOD, e, ctx);
+}
+
+struct expr    *
+lt(struct expr * e, struct context * ctx)
+{
+	return compare(NUM_LT, e, ctx);
+}
+
+struct expr    *
+gt(struct expr * e, struct context * ctx)
+{
+	return compare(NUM_GT, e, ctx);
+}
+
+struct expr    *
+le(struct expr * e, struct context * ctx)
+{
+	return compare(NUM_LE, e, ctx);
+}
+
+struct expr    *
+ge(struct expr * e, struct context * ctx)
+{
+	return compare(NUM_GE, e, ctx);
+}
+
+struct expr    *
+numeq(struct expr * e, struct context * ctx)
+{
+	return compare(NUM_EQ, e, ctx);
+}
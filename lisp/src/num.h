@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef NUM_H
+#define NUM_H
+
+#include "lisp.h"
+
+/* Magnitude in base 2^32, least significant limb first. */
+struct bignum {
+	int             sign;		/* 1 or -1 */
+	int             n;		/* the top limb is never 0 */
+	uint32_t        d[];
+};
+
+enum num_ops {
+	NUM_ADD,
+	NUM_SUB,
+	NUM_MUL,
+	NUM_DIV,
+	NUM_MOD,
+	NUM_LT,
+	NUM_GT,
+	NUM_LE,
+	NUM_GE,
+	NUM_EQ
+};
+
+int             is_number(const struct expr * e);
+struct expr    *make_int(intmax_t v);
+struct expr    *make_float(double d);
+struct expr    *read_number(const char *s, size_t len);
+char           *number_str(const struct expr * e);
+int             num_cmp(const struct expr * a, const struct expr * b);
+struct expr    *num_of(int op, const struct expr * a, const struct expr * b);
+int             num_op(struct expr * (*op) (struct expr *, struct context *));
+
+struct expr    *plus(struct expr * e, struct context * ctx);
+struct expr    *minus(struct expr * e, struct context * ctx);
+struct expr    *times(struct expr * e, struct context * ctx);
+struct expr    *divide(struct expr * e, struct context * ctx);
+struct expr    *modulo(struct expr * e, struct context * ctx);
+struct expr    *lt(struct expr * e, struct context * ctx);
+struct expr    *gt(struct expr * e, struct context * ctx);
+struct expr    *le(struct expr * e, struct context * ctx);
+struct expr    *ge(struct expr * e, struct context * ctx);
+struct expr    *numeq(struct expr * e, struct context * ctx);
+
+#endif
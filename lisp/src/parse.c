@@ -14,264 +14,301 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
 #include "lisp.h"
 #include "parse.h"
 #include "mem.h"
+#include "sym.h"
+#include "num.h"
 
-static int      is_empty_list(const char *e);
+#define READ_BUF_SIZE	(64 * 1024)
 
-char           *
-find_space(const char *s)
-{
-	while (!isspace(*s) && *s != '\0')
-		++s;
-	return (char *) s;
-}
+static struct expr *read_datum(struct reader * r);
 
-char           *
-skip_space(const char *s)
+void
+reader_init(struct reader * r, const char *s, size_t len)
 {
-	while (isspace(*s))
-		++s;
-	return (char *) s;
+	memset(r, 0, sizeof(*r));
+	r->p = s;
+	r->end = s + len;
+	r->line = 1;
+	r->fd = -1;
 }
 
-char           *
-find_matching_parenthesis(const char *s)
+int
+reader_open(struct reader * r, const char *filename)
 {
-	int             lev = 0;
-
-	dbgprintf("find_matching_parenthesis: %s\n", s);
-
-	if (*s == '(')
-		++s;
-	while (*s != '\0') {
-		if (*s == '(')
-			++lev;
-		else if (*s == ')') {
-			if (lev == 0)
-				return (char *) s + 1;
-			else {
-				--lev;
-			}
+	struct stat     st;
+	int             fd;
+
+	if (!strcmp(filename, "-"))
+		fd = dup(0);
+	else
+		fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	reader_init(r, NULL, 0);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		r->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (r->map != MAP_FAILED) {
+			r->maplen = st.st_size;
+			r->p = r->map;
+			r->end = r->p + r->maplen;
+			close(fd);
+			return 0;
 		}
-		++s;
+		r->map = NULL;
 	}
-	return (char *) s;
+	r->fd = fd;
+	r->buf = malloc(READ_BUF_SIZE);
+	r->p = r->end = r->buf;
+	return 0;
 }
 
-char           *
-find_expr_end(const char *e)
+void
+reader_close(struct reader * r)
 {
-	dbgprintf("find_expr_end: %s\n", e);
-
-	if (*e == '\'')
-		++e;
-	e = skip_space(e);
-	if (*e == '(') {
-		e = find_matching_parenthesis(e);
-		return (char *) (*e == ')' ? e + 1 : e);
-	} else {
-		while (!isspace(*e) && *e != '(' && *e != ')' && *e != '\0')
-			++e;
-		return (char *) e;
-	}
+	if (r->map != NULL)
+		munmap(r->map, r->maplen);
+	if (r->fd != -1)
+		close(r->fd);
+	free(r->buf);
+	free(r->tok);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
 }
 
-char           *
-next_expr(const char *e)
+static int
+refill(struct reader * r)
 {
-	dbgprintf("next_expr: %s\n", e);
-	return (char *) (skip_space(find_expr_end(e)));
+	ssize_t         n;
+
+	if (r->fd == -1)
+		return 0;
+	do {
+		n = read(r->fd, r->buf, READ_BUF_SIZE);
+	} while (n == -1 && errno == EINTR);
+	if (n <= 0) {
+		if (n == -1)
+			warn("read");
+		close(r->fd);
+		r->fd = -1;
+		return 0;
+	}
+	r->p = r->buf;
+	r->end = r->buf + n;
+	return 1;
 }
 
-int
-is_atom(const char *e)
+static int
+peekc(struct reader * r)
 {
-	return !isspace(*e);
+	if (r->p == r->end && !refill(r))
+		return EOF;
+	return (unsigned char) *r->p;
 }
 
-int
-is_list(const char *e)
+static int
+getch(struct reader * r)
 {
-	return *e == '(';
+	int             c;
+
+	if ((c = peekc(r)) == EOF)
+		return EOF;
+	++r->p;
+	if (c == '\n')
+		++r->line;
+	return c;
 }
 
+/* Skip white space and comments, return the next character. */
 static int
-is_empty_list(const char *e)
+skip_space(struct reader * r)
 {
-	if (*e == '(')
-		++e;
-	while (*e != '\0' && *e != ')') {
-		if (!isspace(*e))
-			return 0;
-		++e;
+	int             c;
+
+	for (;;) {
+		c = peekc(r);
+		if (c == ';' || c == '#') {
+			while ((c = getch(r)) != EOF && c != '\n')
+				 /* empty */ ;
+		} else if (c != EOF && isspace(c)) {
+			getch(r);
+		} else {
+			return c;
+		}
 	}
-	return 1;
 }
 
-char           *
-expr_dup(const char *e)
+static int
+is_delim(int c)
 {
-	char           *buf;
-	char           *end;
-	size_t          size;
-
-	end = find_expr_end(e);
-	size = end - e + 1;
-	buf = malloc(size);
-	if (size > 1)
-		strncpy(buf, e, size - 1);
-	buf[size - 1] = '\0';
-	return buf;
+	return c == EOF || isspace(c) || c == '(' || c == ')' || c == ';' || c == '#';
 }
 
-
-struct list    *
-parse_list(const char *e)
+/* The atom or number spelled by the n bytes at s. */
+struct expr    *
+make_atom(const char *s, size_t n, int line)
 {
-	dbgprintf("parse_list: %s\n", e);
-
-	char           *p;
-	char           *buf;
-	struct list    *first = NULL, *list;
-	int             first_iter;
-
-	if (is_empty_list(e))
-		return NULL;
-
-	first = list = new_list();
-	p = (char *) e + 1;
-	first_iter = 1;
-	while (*p != ')' && *p != '\0') {
-		if (!first_iter) {
-			list->next = new_list();
-			list = list->next;
-		}
-		buf = expr_dup(p);
-		list->v = parse_expr(buf);
-		Free(buf);
-		p = next_expr(p);
-		if (first_iter)
-			first_iter = 0;
-	}
-
-	return first;
+	struct expr    *e;
+
+	if ((e = read_number(s, n)) != NULL)
+		return e;
+	e = new_expr(LATOM);
+	e->line = line;
+	e->v.atom = intern_n(s, n);
+	return e;
 }
 
-
-struct atom    *
-parse_atom(const char *e)
+/*
+ * The same for data made at run time, like the lines of a file: unless
+ * it's a number, the atom is uninterned, so that it doesn't stay in the
+ * symbol table after the program is done with it.
+ */
+struct expr    *
+make_data_atom(const char *s, size_t n)
 {
-	dbgprintf("parse_atom: %s\n", e);
+	struct expr    *e;
 
-	struct atom    *atom;
-
-	if (isspace(*e) || *e == '(' || *e == ')' || *e == '\0')
-		return NULL;
-	atom = new_atom(e);
-
-	return atom;
+	if ((e = read_number(s, n)) != NULL)
+		return e;
+	e = new_expr(LATOM);
+	e->v.atom = uninterned(s, n);
+	return e;
 }
 
-struct expr    *
-parse_expr(const char *e)
+static struct expr *
+read_atom(struct reader * r)
 {
-	dbgprintf("parse_expr: %s\n", e);
-
-	struct expr    *expr;
-
-	e = skip_space(e);
-
-	expr = new_expr(LINVALID);
-
-	if (*e == '\'') {
-		expr->quoted = 1;
-		++e;
+	const char     *s, *p;
+	size_t          n = 0;
+
+	/* fast path: the whole atom is inside the window */
+	for (s = r->p; s < r->end && !is_delim((unsigned char) *s); ++s)
+		 /* empty */ ;
+	if (s < r->end || r->fd == -1) {
+		p = r->p;
+		r->p = s;
+		return make_atom(p, s - p, r->line);
 	}
-	if (*e == '(') {
-		expr->t = LLIST;
-		expr->v.list = parse_list(e);
-	} else {
-		expr->t = LATOM;
-		expr->v.atom = parse_atom(e);
+	while (!is_delim(peekc(r))) {
+		if (n + 1 >= r->toksize) {
+			r->toksize = r->toksize ? r->toksize * 2 : 64;
+			r->tok = realloc(r->tok, r->toksize);
+		}
+		r->tok[n++] = getch(r);
 	}
-
-	return expr;
+	return make_atom(r->tok, n, r->line);
 }
 
-char           *
-next_code_chunk(const char *s)
+/* NULL if the input ends before the list does. */
+static struct expr *
+read_list(struct reader * r)
 {
-	if (!s)
-		return NULL;
-
-	++s;
-	while (*s != '\n' && *s != '\0')
-		++s;
-
-	if (*s == '\n')
-		++s;
-	return (char *) s;
+	struct expr    *e, *v;
+	struct list   **tail;
+	int             c;
+
+	e = new_expr(LLIST);
+	e->line = r->line;
+	getch(r);
+	tail = &e->v.list;
+	for (;;) {
+		if ((c = skip_space(r)) == ')') {
+			getch(r);
+			break;
+		}
+		if (c == EOF) {
+			warnx("line %d: unterminated list", e->line);
+			return free_expr(e);
+		}
+		/* an unterminated list inside, the loop ends at EOF next */
+		if ((v = read_datum(r)) == NULL)
+			continue;
+		*tail = new_list();
+		(*tail)->v = v;
+		tail = &(*tail)->next;
+	}
+	return e;
 }
 
-char           *
-find_comment(const char *s)
+static struct expr *
+read_quoted(struct reader * r)
 {
-	if (!s)
-		return NULL;
-
-	while (*s != ';' && *s != '#' && *s != '\0')
-		++s;
-
-	if (*s == ';' || *s == '#')
-		return (char *) s;
-	else
-		return NULL;
+	struct expr    *e, *q;
+	int             line, c;
+
+	line = r->line;
+	getch(r);
+	c = skip_space(r);
+	if ((e = read_datum(r)) == NULL) {
+		/* an unterminated list, already reported */
+		if (c == '(')
+			return NULL;
+		warnx("line %d: nothing to quote", line);
+		e = new_expr(LLIST);
+	} else if (is_number(e)) {
+		/* numbers evaluate to themselves anyway */
+		return e;
+	} else if (e->quoted) {
+		q = new_expr(LLIST);
+		q->v.list = new_list();
+		q->v.list->v = new_expr(LATOM);
+		q->v.list->v->v.atom = intern("quote");
+		q->v.list->next = new_list();
+		q->v.list->next->v = e;
+		e = q;
+	}
+	e->quoted = 1;
+	e->line = line;
+	return e;
 }
 
-char           *
-remove_comments(char *buffer)
+/* Returns NULL at the end of input or at a ')', which is left unread. */
+static struct expr *
+read_datum(struct reader * r)
 {
-	char           *buf = NULL;
-	size_t          bufsize = 0;
-	size_t          len = 0;
-	char           *p, *s, *e;
+	int             c;
 
-	if (!buffer)
+	c = skip_space(r);
+	if (c == EOF || c == ')')
 		return NULL;
+	else if (c == '\'')
+		return read_quoted(r);
+	else if (c == '(')
+		return read_list(r);
+	else
+		return read_atom(r);
+}
 
-	for (s = buffer; s != NULL && *s != '\0'; s = next_code_chunk(e)) {
-		if (e = find_comment(s))
-			*e = '\0';
-		if ((len = strlen(s)) == 0)
-			continue;
-		buf = realloc(buf, bufsize + len + (bufsize ? 1 : 2));
-		memcpy(buf + (bufsize ? bufsize - 1 : 0), s, len);
-		bufsize += len + (bufsize ? 1 : 2);
-		buf[bufsize - 2] = ' ';
-		buf[bufsize - 1] = '\0';
-	}
+struct expr    *
+read_expr(struct reader * r)
+{
+	struct expr    *e;
 
-	if (!bufsize) {
-		buf = malloc(sizeof(char));
-		*buf = '\0';
-	} else {
-		buf[bufsize - 2] = '\0';
+	while ((e = read_datum(r)) == NULL) {
+		if (skip_space(r) == EOF)
+			return NULL;
+		warnx("line %d: unexpected ')'", r->line);
+		getch(r);
 	}
-
-	return buf;
+	return e;
 }
 
-char           *
-load_lisp_source_file(const char *filename)
+struct expr    *
+parse_expr(const char *s)
 {
-	char           *buf1, *buf2;
-
-	if ((buf1 = load_file(filename)) == NULL)
-		return NULL;
+	struct reader   r;
 
-	buf2 = remove_comments(buf1);
-	free(buf1);
-	return buf2;
+	reader_init(&r, s, strlen(s));
+	return read_expr(&r);
 }
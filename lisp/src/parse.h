@@ -14,26 +14,36 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
 #ifndef PARSE_H
 #define PARSE_H
 
 #include "lisp.h"
 #include "util.h"
 
-char           *find_space(const char *s);
-char           *skip_space(const char *s);
-char           *find_matching_parenthesis(const char *s);
-char           *find_expr_end(const char *e);
-char           *next_expr(const char *e);
-char           *expr_dup(const char *e);
-int             is_atom(const char *e);
-int             is_list(const char *e);
-struct list    *parse_list(const char *e);
-struct atom    *parse_atom(const char *e);
-struct expr    *parse_expr(const char *e);
-char           *next_code_chunk(const char *s);
-char           *find_comment(const char *s);
-char           *remove_comments(char *buffer);
-char           *load_lisp_source_file(const char *filename);
+/*
+ * Single pass reader.  Source text is consumed through a window
+ * [p, end) which covers the whole input when reading from memory or an
+ * mmap'd file, and is refilled from fd when reading from a pipe.
+ */
+struct reader {
+	const char     *p;
+	const char     *end;
+	int             line;
+	int             fd;		/* -1 unless reading incrementally */
+	char           *buf;		/* read buffer for fd */
+	void           *map;		/* mmap'd file, if any */
+	size_t          maplen;
+	char           *tok;		/* atom spanning a refill */
+	size_t          toksize;
+};
+
+void            reader_init(struct reader * r, const char *s, size_t len);
+int             reader_open(struct reader * r, const char *filename);
+void            reader_close(struct reader * r);
+struct expr    *read_expr(struct reader * r);
+struct expr    *parse_expr(const char *s);
+struct expr    *make_atom(const char *s, size_t n, int line);
+struct expr    *make_data_atom(const char *s, size_t n);
 
 #endif
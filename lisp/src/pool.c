@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * (pmap f l) calls f on every element of list l on a pool of threads
+ * and returns the results in order; (pfor f l) does the same for the
+ * side effects.  The elements are split evenly between the workers and
+ * a worker that runs out of its own steals half of what another has
+ * left.  Workers only read the caller's contexts and evaluate each
+ * call in a frame of their own, so the bindings they share don't change
+ * under them.  While they run `threaded' is set, which makes reference
+ * counts atomic and puts the symbol and code tables under locks.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "lisp.h"
+#include "pool.h"
+#include "eval.h"
+#include "mem.h"
+#include "gc.h"
+#include "sym.h"
+#include "vm.h"
+#include "prof.h"
+
+struct job;
+
+struct worker {
+	pthread_t       tid;
+	pthread_mutex_t lock;
+	int             lo, hi;		/* elements left to this worker */
+	struct gcstat   gc;
+	struct job     *job;
+};
+
+struct job {
+	struct expr    *f;
+	struct expr   **args;
+	struct expr   **results;	/* NULL for pfor */
+	struct context *ctx;
+	struct worker  *w;
+	int             nworkers;
+	int             failed;
+};
+
+int             threaded;
+int             pool_size;		/* 0 for one thread per CPU */
+
+/* Evaluates (f 'x) in a new frame under ctx. */
+static struct expr *
+call(struct expr * f, struct expr * x, struct context * ctx, int vm)
+{
+	struct expr    *form, *q, *r;
+	struct context *fctx;
+
+	q = new_expr(LLIST);
+	q->v.list = new_list();
+	q->v.list->v = new_expr(LATOM);
+	q->v.list->v->v.atom = sym_quote;
+	q->v.list->next = new_list();
+	q->v.list->next->v = exprs_dup(x);
+	form = new_expr(LLIST);
+	form->v.list = new_list();
+	form->v.list->v = exprs_dup(f);
+	form->v.list->next = new_list();
+	form->v.list->next->v = q;
+
+	fctx = new_frame(ctx);
+	r = vm ? vm_eval(form, fctx) : eval(form, fctx);
+	free_context(fctx);
+	gc_free(fctx);
+	free_expr(form);
+	return r;
+}
+
+/* Index of the next element for w to do, -1 when there are none left. */
+static int
+next_arg(struct job * j, struct worker * w)
+{
+	struct worker  *v;
+	int             i = -1, hi = 0, k;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->lo < w->hi)
+		i = w->lo++;
+	pthread_mutex_unlock(&w->lock);
+	if (i != -1)
+		return i;
+
+	for (k = 1; k < j->nworkers && i == -1; ++k) {
+		v = &j->w[(w - j->w + k) % j->nworkers];
+		pthread_mutex_lock(&v->lock);
+		if (v->lo < v->hi) {
+			hi = v->hi;
+			v->hi = i = v->lo + (v->hi - v->lo) / 2;
+		}
+		pthread_mutex_unlock(&v->lock);
+	}
+	if (i != -1) {
+		pthread_mutex_lock(&w->lock);
+		w->lo = i + 1;
+		w->hi = hi;
+		pthread_mutex_unlock(&w->lock);
+	}
+	return i;
+}
+
+static void    *
+work(void *arg)
+{
+	struct worker  *w = arg;
+	struct job     *j = w->job;
+	struct expr    *r;
+	int             i;
+
+	set_stack_base(&w);
+	gc_thread_start(&w->gc);
+	if (setjmp(eval_top) == 0) {
+		while (!__atomic_load_n(&j->failed, __ATOMIC_RELAXED) && (i = next_arg(j, w)) != -1) {
+			r = call(j->f, j->args[i], j->ctx, !iflag);
+			if (j->results != NULL)
+				j->results[i] = r;
+			else
+				free_expr(r);
+		}
+	} else {
+		/* the message is out, what the call dropped is garbage */
+		__atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+	}
+	vm_thread_done();
+	gc_thread_done();
+	return NULL;
+}
+
+static int
+nworkers(int n)
+{
+	long            ncpu;
+
+	/* nested calls and the profiler stay on the calling thread */
+	if (threaded || pflag || n < 2)
+		return 1;
+	if (pool_size > 0)
+		ncpu = pool_size;
+	else if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+	return ncpu < n ? ncpu : n;
+}
+
+static void
+run(struct job * j, int n)
+{
+	pthread_attr_t  attr;
+	struct expr    *e;
+	int             k;
+
+	/* make the shared constants before anyone races to */
+	e = atom_t();
+	free_expr(e);
+	e = empty_list();
+	free_expr(e);
+
+	j->w = calloc(j->nworkers, sizeof(*j->w));
+	for (k = 0; k < j->nworkers; ++k) {
+		pthread_mutex_init(&j->w[k].lock, NULL);
+		j->w[k].lo = (long) n * k / j->nworkers;
+		j->w[k].hi = (long) n * (k + 1) / j->nworkers;
+		j->w[k].job = j;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, cstack_size());
+	threaded = 1;
+	for (k = 0; k < j->nworkers; ++k) {
+		if (pthread_create(&j->w[k].tid, &attr, work, &j->w[k]) != 0)
+			err(1, "pthread_create");
+	}
+	for (k = 0; k < j->nworkers; ++k)
+		pthread_join(j->w[k].tid, NULL);
+	threaded = 0;
+	pthread_attr_destroy(&attr);
+
+	for (k = 0; k < j->nworkers; ++k) {
+		gc_thread_merge(&j->w[k].gc);
+		pthread_mutex_destroy(&j->w[k].lock);
+	}
+	free(j->w);
+}
+
+static struct expr *
+map(struct expr * e, struct context * ctx, int collect)
+{
+	struct expr    *f, *g, *l, *re;
+	struct list    *p, **tail;
+	struct job      j;
+	int             n, i;
+
+	if (!e || list_len(e) < 3)
+		return empty_list();
+
+	f = eval(e->v.list->next->v, ctx);
+	l = eval(e->v.list->next->next->v, ctx);
+	if (TYPE(f) == LATOM && f->v.atom != NULL && !IS_INTERNED(f->v.atom)) {
+		/* a function name made at run time, like by split */
+		g = new_expr(LATOM);
+		g->v.atom = intern_atom(f->v.atom);
+		free_expr(f);
+		f = g;
+	}
+	if (TYPE(l) != LLIST) {
+		free_expr(f);
+		free_expr(l);
+		return empty_list();
+	}
+
+	if (collect) {
+		re = new_expr(LLIST);
+		tail = &re->v.list;
+	} else {
+		re = atom_t();
+		tail = NULL;
+	}
+	n = list_len(l);
+	if ((j.nworkers = nworkers(n)) == 1) {
+		for (p = l->v.list; p != NULL; p = p->next) {
+			if (collect) {
+				*tail = new_list();
+				(*tail)->v = call(f, p->v, ctx, !iflag);
+				tail = &(*tail)->next;
+			} else {
+				free_expr(call(f, p->v, ctx, !iflag));
+			}
+		}
+		free_expr(f);
+		free_expr(l);
+		return re;
+	}
+
+	j.f = f;
+	j.ctx = ctx;
+	j.failed = 0;
+	j.args = malloc(n * sizeof(*j.args));
+	j.results = collect ? calloc(n, sizeof(*j.results)) : NULL;
+	for (i = 0, p = l->v.list; p != NULL; p = p->next)
+		j.args[i++] = p->v;
+	run(&j, n);
+
+	for (i = 0; collect && i < n; ++i) {
+		*tail = new_list();
+		(*tail)->v = j.results[i];
+		tail = &(*tail)->next;
+	}
+	free(j.args);
+	free(j.results);
+	free_expr(f);
+	free_expr(l);
+	if (j.failed) {
+		free_expr(re);
+		longjmp(eval_top, 1);
+	}
+	return re;
+}
+
+struct expr    *
+pmap(struct expr * e, struct context * ctx)
+{
+	return map(e, ctx, 1);
+}
+
+struct expr    *
+pfor(struct expr * e, struct context * ctx)
+{
+	return map(e, ctx, 0);
+}
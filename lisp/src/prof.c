@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Call profiler, enabled with -p.  Lisp functions and builtins that
+ * evaluate their arguments are timed with prof_enter()/prof_leave()
+ * around the call; builtins the VM runs inline are only counted.  At
+ * exit a table of calls, inclusive and exclusive time and allocations
+ * per name goes to stderr, and the call tree goes to the file given to
+ * prof_start() in the folded format flame graph tools read: one line
+ * per stack, frames separated by ';', then exclusive microseconds.
+ * Direct recursion is folded into a single frame.
+ */
+
+#include <err.h>
+#include <time.h>
+
+#include "lisp.h"
+#include "prof.h"
+#include "gc.h"
+
+struct fn {
+	struct atom    *name;
+	size_t          calls;
+	uint64_t        incl;		/* ns, outermost activations only */
+	uint64_t        excl;
+	size_t          nallocs;	/* exclusive */
+	int             active;
+};
+
+struct node {
+	struct fn      *fn;
+	uint64_t        excl;
+	struct node    *parent;
+	struct node    *child;
+	struct node    *sibling;
+};
+
+struct activation {
+	struct node    *node;
+	uint64_t        start;
+	uint64_t        children;	/* ns spent in callees */
+	size_t          nallocs;	/* at start */
+	size_t          child_nallocs;
+};
+
+static const char *outfile;
+static struct fn **fns;		/* by name; nodes point at the fns, so they stay put */
+static int      nfns;
+static int      fnsize;
+static struct node root;
+static struct activation *stack;
+static int      depth;
+static int      stacksize;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t
+prof_nallocs(void)
+{
+	return gc_get_stats()->nallocs;
+}
+
+static int
+hash_slot(const struct atom * name, int mask)
+{
+	int             i;
+
+	for (i = name->hash & mask; fns[i] != NULL && fns[i]->name != name; i = (i + 1) & mask)
+		 /* empty */ ;
+	return i;
+}
+
+static struct fn *
+lookup(struct atom * name)
+{
+	struct fn     **old;
+	int             i, mask, oldsize;
+
+	if ((nfns + 1) * 2 > fnsize) {
+		old = fns;
+		oldsize = fnsize;
+		fnsize = fnsize ? fnsize * 2 : 64;
+		if ((fns = calloc(fnsize, sizeof(*fns))) == NULL)
+			err(1, "calloc");
+		mask = fnsize - 1;
+		for (i = 0; i < oldsize; ++i) {
+			if (old[i] != NULL)
+				fns[hash_slot(old[i]->name, mask)] = old[i];
+		}
+		free(old);
+	}
+	i = hash_slot(name, fnsize - 1);
+	if (fns[i] == NULL) {
+		if ((fns[i] = calloc(1, sizeof(*fns[i]))) == NULL)
+			err(1, "calloc");
+		fns[i]->name = name;
+		++nfns;
+	}
+	return fns[i];
+}
+
+static struct node *
+child(struct node * parent, struct fn * fn)
+{
+	struct node    *n;
+
+	for (n = parent->child; n != NULL; n = n->sibling) {
+		if (n->fn == fn)
+			return n;
+	}
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		err(1, "calloc");
+	n->fn = fn;
+	n->parent = parent;
+	n->sibling = parent->child;
+	parent->child = n;
+	return n;
+}
+
+void
+prof_enter(struct atom * name)
+{
+	struct activation *a;
+	struct node    *parent;
+	struct fn      *fn;
+
+	if (depth == stacksize) {
+		stacksize = stacksize ? stacksize * 2 : 256;
+		if ((stack = realloc(stack, stacksize * sizeof(*stack))) == NULL)
+			err(1, "realloc");
+	}
+	fn = lookup(name);
+	++fn->calls;
+	++fn->active;
+	parent = depth > 0 ? stack[depth - 1].node : &root;
+	a = &stack[depth++];
+	a->node = parent->fn == fn ? parent : child(parent, fn);
+	a->children = 0;
+	a->child_nallocs = 0;
+	a->nallocs = prof_nallocs();
+	a->start = now();
+}
+
+void
+prof_leave(void)
+{
+	struct activation *a;
+	struct fn      *fn;
+	uint64_t        incl, excl;
+	size_t          nallocs;
+
+	a = &stack[--depth];
+	incl = now() - a->start;
+	nallocs = prof_nallocs() - a->nallocs;
+	excl = incl - a->children;
+	fn = a->node->fn;
+	fn->excl += excl;
+	fn->nallocs += nallocs - a->child_nallocs;
+	if (--fn->active == 0)
+		fn->incl += incl;
+	a->node->excl += excl;
+	if (depth > 0) {
+		stack[depth - 1].children += incl;
+		stack[depth - 1].child_nallocs += nallocs;
+	}
+}
+
+/* A builtin that doesn't evaluate anything itself. */
+void
+prof_count(struct atom * name, size_t nallocs)
+{
+	struct fn      *fn;
+
+	fn = lookup(name);
+	++fn->calls;
+	fn->nallocs += nallocs;
+	if (depth > 0)
+		stack[depth - 1].child_nallocs += nallocs;
+}
+
+/* After an error: whatever was running has returned. */
+void
+prof_reset(void)
+{
+	while (depth > 0)
+		prof_leave();
+}
+
+static int
+by_excl(const void *a, const void *b)
+{
+	const struct fn *x = a, *y = b;
+
+	if (x->excl != y->excl)
+		return x->excl < y->excl ? 1 : -1;
+	if (x->calls != y->calls)
+		return x->calls < y->calls ? 1 : -1;
+	return 0;
+}
+
+static void
+write_table(FILE * fp)
+{
+	struct fn      *all;
+	int             i, n = 0;
+
+	if ((all = malloc((nfns + 1) * sizeof(*all))) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < fnsize; ++i) {
+		if (fns[i] != NULL)
+			all[n++] = *fns[i];
+	}
+	qsort(all, n, sizeof(*all), by_excl);
+	fprintf(fp, "%12s %12s %12s %12s  %s\n", "calls", "incl-ms", "excl-ms", "allocs", "name");
+	for (i = 0; i < n; ++i) {
+		fprintf(fp, "%12zu %12.3f %12.3f %12zu  %s\n", all[i].calls,
+		    all[i].incl / 1e6, all[i].excl / 1e6, all[i].nallocs, all[i].name->v);
+	}
+	free(all);
+}
+
+static void
+write_folded(FILE * fp)
+{
+	struct node    *n;
+	size_t         *marks = NULL, len = 0, size = 0;
+	char           *path = NULL;
+	int             d = 0, nmarks = 0, l;
+
+	for (n = root.child; n != NULL;) {
+		if (d == nmarks) {
+			nmarks = nmarks ? nmarks * 2 : 64;
+			marks = realloc(marks, nmarks * sizeof(*marks));
+		}
+		marks[d] = len;
+		l = strlen(n->fn->name->v);
+		if (len + l + 2 > size) {
+			size = (len + l + 2) * 2;
+			path = realloc(path, size);
+		}
+		if (d > 0)
+			path[len++] = ';';
+		memcpy(path + len, n->fn->name->v, l);
+		len += l;
+		if (n->excl >= 500)
+			fprintf(fp, "%.*s %llu\n", (int) len, path, (unsigned long long) (n->excl + 500) / 1000);
+
+		if (n->child != NULL) {
+			n = n->child;
+			++d;
+			continue;
+		}
+		while (n != NULL && n->sibling == NULL) {
+			n = n->parent == &root ? NULL : n->parent;
+			--d;
+		}
+		if (n != NULL) {
+			len = marks[d];
+			n = n->sibling;
+		}
+	}
+	free(marks);
+	free(path);
+}
+
+static void
+prof_report(void)
+{
+	FILE           *fp;
+
+	prof_reset();
+	write_table(stderr);
+	if ((fp = fopen(outfile, "w")) == NULL) {
+		warn("%s", outfile);
+		return;
+	}
+	write_folded(fp);
+	fclose(fp);
+}
+
+void
+prof_start(const char *filename)
+{
+	outfile = filename;
+	atexit(prof_report);
+}
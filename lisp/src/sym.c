@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <pthread.h>
+
+#include "lisp.h"
+#include "sym.h"
+#include "eval.h"
+#include "pool.h"
+
+struct atom    *sym_t;
+struct atom    *sym_lambda;
+struct atom    *sym_quote;
+
+static struct atom **symtab;
+static size_t   symtab_size;
+static size_t   symtab_n;
+static pthread_mutex_t symtab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void     sym_init(void);
+
+static unsigned int
+str_hash(const char *s, size_t len)
+{
+	unsigned int    h = 2166136261u;
+
+	while (len-- > 0) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void
+symtab_grow(void)
+{
+	struct atom   **old;
+	size_t          old_size, i, j;
+
+	old = symtab;
+	old_size = symtab_size;
+	symtab_size = old_size ? old_size * 2 : 256;
+	symtab = calloc(symtab_size, sizeof(*symtab));
+	for (i = 0; i < old_size; ++i) {
+		if (old[i] == NULL)
+			continue;
+		for (j = old[i]->hash & (symtab_size - 1); symtab[j] != NULL; j = (j + 1) & (symtab_size - 1))
+			 /* empty */ ;
+		symtab[j] = old[i];
+	}
+	free(old);
+}
+
+static struct atom *
+lookup(const char *s, size_t len)
+{
+	struct atom    *a;
+	unsigned int    h;
+	size_t          i;
+
+	h = str_hash(s, len);
+	for (i = h & (symtab_size - 1); (a = symtab[i]) != NULL; i = (i + 1) & (symtab_size - 1)) {
+		if (a->hash == h && a->len == len && !memcmp(a->v, s, len))
+			return a;
+	}
+
+	a = calloc(1, sizeof(*a));
+	a->v = malloc(len + 1);
+	memcpy(a->v, s, len);
+	a->v[len] = '\0';
+	a->len = len;
+	a->hash = h;
+	a->id = symtab_n++;
+	symtab[i] = a;
+
+	if (symtab_n * 2 > symtab_size)
+		symtab_grow();
+
+	return a;
+}
+
+struct atom    *
+intern_n(const char *s, size_t len)
+{
+	struct atom    *a;
+
+	if (symtab == NULL)
+		sym_init();
+	if (!threaded)
+		return lookup(s, len);
+	pthread_mutex_lock(&symtab_lock);
+	a = lookup(s, len);
+	pthread_mutex_unlock(&symtab_lock);
+	return a;
+}
+
+struct atom    *
+intern(const char *s)
+{
+	return intern_n(s, strlen(s));
+}
+
+int
+nsyms(void)
+{
+	return symtab_n;
+}
+
+/*
+ * An atom of its own, outside the symbol table, for data made at run
+ * time: it's freed with the expression that holds it.
+ */
+struct atom    *
+uninterned(const char *s, size_t len)
+{
+	struct atom    *a;
+
+	a = calloc(1, sizeof(*a));
+	a->v = malloc(len + 1);
+	memcpy(a->v, s, len);
+	a->v[len] = '\0';
+	a->len = len;
+	a->hash = str_hash(s, len);
+	a->id = -1;
+	return a;
+}
+
+/* The symbol spelled like a, for where atoms are names. */
+struct atom    *
+intern_atom(struct atom * a)
+{
+	return IS_INTERNED(a) ? a : intern_n(a->v, a->len);
+}
+
+/* Symbols are the same atom, uninterned ones are compared by name. */
+int
+atom_eq(const struct atom * a, const struct atom * b)
+{
+	if (a == b)
+		return 1;
+	if (a == NULL || b == NULL || (IS_INTERNED(a) && IS_INTERNED(b)))
+		return 0;
+	return a->hash == b->hash && a->len == b->len && !memcmp(a->v, b->v, a->len);
+}
+
+static void
+sym_init(void)
+{
+	int             i;
+
+	symtab_grow();
+	for (i = 0; ops[i] != NULL; ++i)
+		intern(ops[i])->op = op_funcs[i];
+	sym_t = intern("t");
+	sym_lambda = intern("lambda");
+	sym_quote = intern("quote");
+}
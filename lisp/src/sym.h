@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef SYM_H
+#define SYM_H
+
+#include "lisp.h"
+
+extern struct atom *sym_t;
+extern struct atom *sym_lambda;
+extern struct atom *sym_quote;
+
+struct atom    *intern(const char *s);
+struct atom    *intern_n(const char *s, size_t len);
+int             nsyms(void);
+struct atom    *uninterned(const char *s, size_t len);
+struct atom    *intern_atom(struct atom * a);
+int             atom_eq(const struct atom * a, const struct atom * b);
+
+#define IS_INTERNED(a)	((a)->id >= 0)
+
+#endif
@@ -16,6 +16,7 @@
 
 #include "lisp.h"
 #include "util.h"
+#include "num.h"
 
 extern int      dflag;
 
@@ -59,8 +60,15 @@ pcontext(const struct context * ctx, const char *indent)
 	printf("%sContext {\n", indent);
 
 	buf = str_append(indent, "    ");
-	for (i = 0; i < ctx->nmap; ++i) {
-		printf("%skey = %s\n%sval = \n", buf, ctx->map[i].k, buf);
+	for (i = 0; i < ctx->nslots; ++i) {
+		printf("%sslot = %s\n%sval = \n", buf, ctx->slotk[i]->v, buf);
+		peval(ctx->slotv[i], buf);
+		printf("%s----\n", buf);
+	}
+	for (i = 0; i < ctx->mapsize; ++i) {
+		if (ctx->map[i].k == NULL)
+			continue;
+		printf("%skey = %s\n%sval = \n", buf, ctx->map[i].k->v, buf);
 		peval(ctx->map[i].v, buf);
 		printf("%s----\n", buf);
 	}
@@ -81,11 +89,17 @@ peval(const struct expr * e, const char *indent)
 		printf("%sNULL\n", indent);
 		return;
 	}
+	if (is_number(e)) {
+		buf = number_str(e);
+		printf("%sNUMBER %s\n", indent, buf);
+		free(buf);
+		return;
+	}
 	q = qv[abs(e->quoted % 2)];
 
-	if (e->t == LATOM) {
+	if (TYPE(e) == LATOM) {
 		printf("%sATOM%s %s\n", indent, q, (e->v.atom ? e->v.atom->v : "[null]"));
-	} else if (e->t == LLIST) {
+	} else if (TYPE(e) == LLIST) {
 		if (e->v.list == NULL) {
 			printf("%sEMPTY_LIST%s\n", indent, q);
 		} else {
@@ -111,6 +125,16 @@ print_atom(struct expr * e, int depth)
 	printf("%s%s%s", depth ? " " : "", e->quoted ? "'" : "", e->v.atom->v);
 }
 
+void
+print_number(struct expr * e, int depth)
+{
+	char           *s;
+
+	s = number_str(e);
+	printf("%s%s", depth ? " " : "", s);
+	free(s);
+}
+
 void
 print_list(struct expr * e, int depth)
 {
@@ -136,10 +160,12 @@ print_expr(struct expr * e, int depth)
 		printf("(null)");
 		return;
 	}
-	if (e->t == LATOM)
+	if (TYPE(e) == LATOM)
 		print_atom(e, depth);
-	else if (e->t == LLIST)
+	else if (TYPE(e) == LLIST)
 		print_list(e, depth);
+	else if (is_number(e))
+		print_number(e, depth);
 	else
 		printf("(expression of unknown type)");
 }
@@ -24,6 +24,7 @@ void            pcontext(const struct context * ctx, const char *indent);
 void            peval(const struct expr * e, const char *indent);
 void            print_atom(struct expr * e, int depth);
 void            print_list(struct expr * e, int depth);
+void            print_number(struct expr * e, int depth);
 void            print_expr(struct expr * e, int depth);
 char           *str_append(const char *a, const char *b);
 char           *load_file_fp(FILE * fp);
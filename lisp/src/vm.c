@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <err.h>
+
+#include "lisp.h"
+#include "vm.h"
+#include "eval.h"
+#include "mem.h"
+#include "gc.h"
+#include "num.h"
+#include "prof.h"
+#include "sym.h"
+
+/*
+ * Lisp calls don't recurse on the C stack: every call pushes a
+ * struct frame, arguments stay on the value stack where the callee's
+ * context slots point to them.  Both stacks are on the heap and grow
+ * as needed, up to max_depth frames.
+ */
+
+#define VM_MIN_STACK	1024
+
+struct frame {
+	struct code    *c;
+	const int      *ip;
+	struct context *ctx;
+	int             base;		/* the callee, then its arguments, or
+					 * -1 for the frame vm_run() started,
+					 * whose code vm_eval() compiled */
+};
+
+int             max_depth = 1000000;
+
+/* every pmap worker runs its own VM */
+static _Thread_local struct expr **stack;
+static _Thread_local int stacksize;
+static _Thread_local int top;
+static _Thread_local struct frame *frames;
+static _Thread_local int nframes;
+static _Thread_local int framesize;
+
+/* Make room for n more values above sp, return the new sp. */
+static struct expr **
+reserve(struct expr ** sp, int n)
+{
+	int             off, i;
+
+	off = sp - stack;
+	if (off + n <= stacksize)
+		return sp;
+	while (off + n > stacksize)
+		stacksize = stacksize ? stacksize * 2 : VM_MIN_STACK;
+	if ((stack = realloc(stack, stacksize * sizeof(*stack))) == NULL)
+		err(1, "realloc");
+	for (i = 0; i < nframes; ++i) {
+		if (frames[i].base >= 0)
+			frames[i].ctx->slotv = stack + frames[i].base + 1;
+	}
+	return stack + off;
+}
+
+static struct frame *
+push_frame(struct code * c, struct context * ctx, int base)
+{
+	struct frame   *fr;
+
+	if (nframes >= max_depth)
+		eval_error("call depth limit of %d exceeded", max_depth);
+	if (nframes == framesize) {
+		framesize = framesize ? framesize * 2 : 64;
+		if ((frames = realloc(frames, framesize * sizeof(*frames))) == NULL)
+			err(1, "realloc");
+	}
+	fr = &frames[nframes++];
+	fr->c = c;
+	fr->ip = c->ins;
+	fr->ctx = ctx;
+	fr->base = base;
+	return fr;
+}
+
+/*
+ * A tail call may reuse the frame only if nobody could see the
+ * difference: under dynamic scoping the callee would otherwise see the
+ * caller's bindings, so all of them must be shadowed by its parameters.
+ */
+static int
+can_replace(const struct frame * fr, const struct code * fc)
+{
+	const struct code *c = fr->c;
+	int             i, j;
+
+	if (fr->base < 0 || fr->ctx->nmap != 0)
+		return 0;
+	if (c == fc)
+		return 1;
+	if ((c->mask & fc->mask) != c->mask)
+		return 0;
+	for (i = 0; i < c->nparams; ++i) {
+		for (j = 0; j < fc->nparams && fc->params[j] != c->params[i]; ++j)
+			;
+		if (j == fc->nparams)
+			return 0;
+	}
+	return 1;
+}
+
+void
+vm_reset(void)
+{
+	int             i;
+
+	/*
+	 * whatever was on the stacks is left to the collector, but the
+	 * code of the vm_eval()s cut short, nested ones too, is freed
+	 */
+	for (i = 0; i < nframes; ++i) {
+		if (frames[i].base < 0)
+			free_code(frames[i].c);
+	}
+	top = 0;
+	nframes = 0;
+}
+
+/* Frees the stacks of a thread that's about to exit. */
+void
+vm_thread_done(void)
+{
+	vm_reset();
+	Free(stack);
+	Free(frames);
+	stacksize = 0;
+	framesize = 0;
+}
+
+/* Builtins the VM runs inline, as the profiler knows them. */
+struct atom    *
+leaf_name(int ins, int op)
+{
+	static const char *const names[] = {
+		[OP_ATOM] = "atom",
+		[OP_EQ] = "eq",
+		[OP_CAR] = "car",
+		[OP_CDR] = "cdr",
+		[OP_CONS] = "cons",
+		[OP_NULL] = "null",
+		[OP_AND] = "and",
+		[OP_LIST] = "list"
+	};
+	static const char *const nums[] = {
+		[NUM_ADD] = "+",
+		[NUM_SUB] = "-",
+		[NUM_MUL] = "*",
+		[NUM_DIV] = "/",
+		[NUM_MOD] = "mod",
+		[NUM_LT] = "<",
+		[NUM_GT] = ">",
+		[NUM_LE] = "<=",
+		[NUM_GE] = ">=",
+		[NUM_EQ] = "="
+	};
+
+	return intern(ins == OP_NUM ? nums[op] : names[ins]);
+}
+
+/* after calling out, in case the stacks have moved */
+#define RESUME() do {							\
+	sp = stack + top;						\
+	fr = &frames[nframes - 1];					\
+	slots = ctx->slotv;						\
+} while (0)
+
+struct expr    *
+vm_run(struct code * c, struct context * ctx)
+{
+	const int      *ip;
+	struct expr    *a, *b, *r, *f, *ne;
+	struct expr   **sp, **slots;
+	struct frame   *fr;
+	struct context *nctx;
+	struct code    *fc;
+	struct list   **tail;
+	size_t          nallocs = 0;
+	int             n, i, base;
+
+	sp = reserve(stack + top, c->maxstack);
+	fr = push_frame(c, ctx, -1);
+	slots = ctx->slotv;
+	ip = c->ins;
+	for (;;) {
+		switch (*ip++) {
+		case OP_CONST:
+			*sp++ = exprs_dup(c->consts[*ip++]);
+			break;
+		case OP_LOCAL:
+			*sp++ = exprs_dup(slots[*ip++]);
+			break;
+		case OP_GLOBAL:
+			a = c->consts[*ip++];
+			r = search_context(ctx, a->v.atom);
+			*sp++ = exprs_dup(r ? r : a);
+			break;
+		case OP_ATOM:
+		case OP_CAR:
+		case OP_CDR:
+		case OP_NULL:
+			if (pflag)
+				nallocs = prof_nallocs();
+			a = sp[-1];
+			switch (ip[-1]) {
+			case OP_ATOM:
+				r = atom_of(a);
+				break;
+			case OP_CAR:
+				r = car_of(a);
+				break;
+			case OP_CDR:
+				r = cdr_of(a);
+				break;
+			default:
+				r = null_of(a);
+				break;
+			}
+			free_expr(a);
+			sp[-1] = r;
+			if (pflag)
+				prof_count(leaf_name(ip[-1], 0), prof_nallocs() - nallocs);
+			break;
+		case OP_EQ:
+		case OP_CONS:
+		case OP_AND:
+			if (pflag)
+				nallocs = prof_nallocs();
+			a = sp[-2];
+			b = sp[-1];
+			if (ip[-1] == OP_EQ)
+				r = eq_of(a, b);
+			else if (ip[-1] == OP_CONS)
+				r = cons_of(a, b);
+			else
+				r = and_of(a, b);
+			free_expr(a);
+			free_expr(b);
+			*--sp = NULL;
+			sp[-1] = r;
+			if (pflag)
+				prof_count(leaf_name(ip[-1], 0), prof_nallocs() - nallocs);
+			break;
+		case OP_LIST:
+			if (pflag)
+				prof_count(leaf_name(OP_LIST, 0), *ip + 1);
+			n = *ip++;
+			r = new_expr(LLIST);
+			tail = &r->v.list;
+			for (i = n; i > 0; --i) {
+				*tail = new_list();
+				(*tail)->v = sp[-i];
+				tail = &(*tail)->next;
+			}
+			sp -= n;
+			*sp++ = r;
+			break;
+		case OP_NUM:
+			if (pflag)
+				nallocs = prof_nallocs();
+			a = sp[-2];
+			b = sp[-1];
+			r = num_of(*ip++, a, b);
+			free_expr(a);
+			free_expr(b);
+			*--sp = NULL;
+			sp[-1] = r;
+			if (pflag)
+				prof_count(leaf_name(OP_NUM, ip[-1]), prof_nallocs() - nallocs);
+			break;
+		case OP_JMP:
+			n = *ip++;
+			ip += n;
+			break;
+		case OP_JMPNT:
+			n = *ip++;
+			a = *--sp;
+			if (!is_atom_t(a))
+				ip += n;
+			free_expr(a);
+			break;
+		case OP_FUNC:
+			a = c->consts[ip[0]];
+			n = ip[2];
+			r = search_context(ctx, a->v.atom);
+			if (r != NULL && !IS_FIXNUM(r) && ((fc = code_of(r)) ? fc->nparams : lambda_nparams(r)) == n) {
+				if (pflag)
+					lambda_code(r)->name = a->v.atom;
+				*sp++ = exprs_dup(r);
+				ip += 4;
+				break;
+			}
+			if (r == NULL) {
+				*sp++ = empty_list();
+			} else {
+				ne = replace_head(c->consts[ip[1]], exprs_dup(r));
+				top = sp - stack;
+				r = eval(ne, ctx);
+				RESUME();
+				*sp++ = r;
+				free_expr(ne);
+			}
+			ip += 4 + ip[3];
+			break;
+		case OP_CALL:
+		case OP_TAILCALL:
+			n = *ip++;
+			f = sp[-n - 1];
+			fc = lambda_code(f);
+			if (ip[-2] == OP_TAILCALL && can_replace(fr, fc)) {
+				base = fr->base;
+				for (i = base; i < sp - stack - n - 1; ++i)
+					free_expr(stack[i]);
+				memmove(stack + base, sp - n - 1, (n + 1) * sizeof(*sp));
+				sp = stack + base + n + 1;
+				nctx = fr->ctx;
+				nctx->mask = fc->mask;
+				nctx->upmask = nctx->next->upmask | fc->mask;
+				nctx->slotk = fc->params;
+				fr->c = fc;
+				if (pflag) {
+					prof_leave();
+					prof_enter(fc->name ? fc->name : sym_lambda);
+				}
+			} else {
+				fr->ip = ip;
+				base = sp - stack - n - 1;
+				nctx = new_frame(ctx);
+				nctx->mask = fc->mask;
+				nctx->upmask |= fc->mask;
+				nctx->slotk = fc->params;
+				fr = push_frame(fc, nctx, base);
+				if (pflag)
+					prof_enter(fc->name ? fc->name : sym_lambda);
+			}
+			nctx->nslots = n;
+			sp = reserve(sp, fc->maxstack);
+			nctx->slotv = stack + base + 1;
+			c = fc;
+			ctx = nctx;
+			slots = nctx->slotv;
+			ip = c->ins;
+			break;
+		case OP_CALLOP:
+			a = c->consts[*ip++];
+			top = sp - stack;
+			if (pflag)
+				prof_enter(a->v.list->v->v.atom);
+			r = a->v.list->v->v.atom->op(a, ctx);
+			if (pflag)
+				prof_leave();
+			RESUME();
+			*sp++ = r;
+			break;
+		case OP_EVAL:
+			top = sp - stack;
+			r = eval(c->consts[*ip++], ctx);
+			RESUME();
+			*sp++ = r;
+			break;
+		case OP_RET:
+			r = *--sp;
+			if (fr->base < 0) {
+				--nframes;
+				top = sp - stack;
+				return r;
+			}
+			if (pflag)
+				prof_leave();
+			free_context(ctx);
+			gc_free(ctx);
+			while (sp > stack + fr->base)
+				free_expr(*--sp);
+			*sp++ = r;
+			fr = &frames[--nframes - 1];
+			c = fr->c;
+			ip = fr->ip;
+			ctx = fr->ctx;
+			slots = ctx->slotv;
+			break;
+		default:
+			errx(1, "bad opcode %d", ip[-1]);
+		}
+	}
+}
+
+struct expr    *
+vm_eval(struct expr * e, struct context * ctx)
+{
+	struct code    *c;
+	struct expr    *r;
+
+	/* a builtin like pmap may call this again from under vm_run() */
+	c = compile(e, NULL, 0);
+	r = vm_run(c, ctx);
+	free_code(c);
+	return r;
+}
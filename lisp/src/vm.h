@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2009 Sviatoslav Chagaev <sviatoslav.chagaev@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef VM_H
+#define VM_H
+
+#include "lisp.h"
+
+/*
+ * Instructions are ints: an opcode followed by its operands.  Jump
+ * offsets are relative to the instruction following the jump.
+ */
+enum opcodes {
+	OP_CONST,		/* k: push consts[k] */
+	OP_LOCAL,		/* i: push parameter i */
+	OP_GLOBAL,		/* k: push value of atom consts[k], or the atom */
+	OP_ATOM,
+	OP_EQ,
+	OP_CAR,
+	OP_CDR,
+	OP_CONS,
+	OP_NULL,
+	OP_AND,
+	OP_LIST,		/* n: pop n values, push them as a list */
+	OP_NUM,			/* op: pop 2 numbers, push num_of(op, ...) */
+	OP_JMP,			/* off */
+	OP_JMPNT,		/* off: pop, jump unless it's atom t */
+	OP_FUNC,		/* k f n off: push the lambda bound to atom consts[k],
+				 * or evaluate form consts[f] and jump */
+	OP_CALL,		/* n: call lambda below n arguments */
+	OP_TAILCALL,		/* n: same, replacing the current frame if
+				 * that can't be observed */
+	OP_CALLOP,		/* k: call the builtin of form consts[k] */
+	OP_EVAL,		/* k: tree-walking eval of consts[k] */
+	OP_RET
+};
+
+struct code {
+	int            *ins;
+	int             nins;
+	int             insize;
+	struct expr   **consts;
+	int             nconsts;
+	int             constsize;
+	struct atom   **params;
+	int             nparams;
+	uint64_t        mask;		/* SYM_BIT of every parameter */
+	int             maxstack;
+	struct atom    *name;		/* for the profiler, see OP_FUNC */
+};
+
+extern int      iflag;
+extern int      max_depth;
+
+struct code    *compile(const struct expr * e, struct atom ** params, int nparams);
+struct code    *lambda_code(struct expr * lambda);
+struct code    *code_of(const struct expr * e);
+int             lambda_nparams(const struct expr * lambda);
+void            free_code(struct code * c);
+void            drop_code(struct expr * e);
+void            forget_code(struct expr * e);
+
+struct expr    *vm_eval(struct expr * e, struct context * ctx);
+struct expr    *vm_run(struct code * c, struct context * ctx);
+void            vm_reset(void);
+void            vm_thread_done(void);
+struct atom    *leaf_name(int ins, int op);
+
+#endif
@@ -99,7 +99,7 @@
          (cond ((eq z y) x)
                ('t z)))
         ('t (cons (subst. x y (car z))
-                  (subst. x y (cdr z)))))))
+                  (subst. x y (cdr z))))))
 (subst. 'm 'b '(a b (a b c) d))
 
 (defun pair. (x y)
@@ -117,8 +117,68 @@
 (exec '(ls))
 (exec '(ls) '(/etc))
 (exec 'ls '/xxxx)
+(exec-all 2 '(true) '(false) '(true))
+(car (read-file 'test.lisp))
+; what read-file and split make at run time isn't added to the symbols
+(defun stat. (name l)
+  (cond ((null l) ())
+        ((eq (car (car l)) name) (car (cdr (car l))))
+        ('t (stat. name (cdr l)))))
+(defun same-symbols. (n x) (= n (stat. 'symbols (gc-stats))))
+(same-symbols. (stat. 'symbols (gc-stats)) (pmap '(lambda (l) (split l 'e)) (read-file 'test.lisp)))
+(same-symbols. (stat. 'symbols (gc-stats)) (pmap '(lambda (l) (split l 'e)) (read-file 'test.lisp)))
+(eq (car (split 'x,y ',)) 'x)
+(split 'a,b,,c ',)
+(split '1:2:x ':)
+(split 'a|b,c ',)
+(split 'a,b|c '|)
 
 
 'UTF8
 (cdr '(Привет мир !))
 
+
+
+'GC-STATS
+(car (car (gc-stats)))
+
+
+
+'TAIL-CALLS
+(defun twice. (x acc)
+  (cond ((null x) acc)
+        ('t (twice. (cdr x) (cons (car x) (cons (car x) acc))))))
+(defun last. (x)
+  (cond ((null (cdr x)) (car x))
+        ('t (last. (cdr x)))))
+(last. (twice. (twice. (twice. (twice. (twice. (twice. (twice. (twice. (twice. (twice. (twice. (twice. (twice. (twice. '(a b) '()) '()) '()) '()) '()) '()) '()) '()) '()) '()) '()) '()) '()) '()))
+
+
+
+'NUMBERS
+(+ 1 2 3)
+(- 10 4 1)
+(* 4611686018427387903 4)
+(/ 7 2)
+(mod -7 2)
+(/ 1 4.0)
+(< 1 2 3)
+(= 2 2.0)
+(defun fact. (n)
+  (cond ((= n 0) 1)
+        ('t (* n (fact. (- n 1))))))
+(fact. 25)
+
+
+
+'PMAP
+(pmap 'fact. '(5 10 20 30))
+(pmap '(lambda (x) (cons x '(b))) '(a c d))
+(pfor 'fact. '(1 2 3))
+; a function named by data made at run time
+(pmap (car (split 'fact.,y ',)) '(3))
+; deeper than the C stack allows, whether it runs on one thread or more
+(defun depth. (n)
+  (cond ((= n 0) 0)
+        ('t (+ 1 (depth. (- n 1))))))
+(pmap 'depth. '(200000))
@@ -4,14 +4,28 @@
 #include <iterator>
 #include <cstdlib>
 #include <cstdarg>
+#include <cstdio>
 #include <stdexcept>
 #include <cmath>
 #include <ctime>
-
+#include <cstring>
+#include <cerrno>
+#include <climits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// -DNO_SDL builds only the headless mode, for machines without SDL
+#ifndef NO_SDL
 #include <SDL/SDL.h>
 #include <SDL/SDL_gfxPrimitives.h>
+#endif
 
 #include <unistd.h>
+#include <pthread.h>
 #include <err.h>
 
 using namespace std;
@@ -22,19 +36,34 @@ using namespace std;
 #define PI 3.14
 #define E 0.0001
 
+#define RESTITUTION 0.6
+#define FRICTION 0.2
+#define SOLVER_ITERATIONS 4
+#define SLOP 0.05 // penetration left alone, in pixels
+#define CORRECTION 0.8 // share of the rest pushed apart per step
+
+#define STEP 10.0 // ms of simulated time per step
+#define MAX_STEPS 10 // per frame; past that the simulation slows down
+#define SEED 1 // for headless runs, so they can be compared
+#define PAIRS_PER_BODY 8 // to size the per-step buffers with
+
 #define SCREEN_W 640
 #define SCREEN_H 480
 #define SCREEN_B 24
-#define SCREEN_F SDL_SWSURFACE|SDL_DOUBLEBUF
+#define SCREEN_F SDL_SWSURFACE
 
+#ifndef NO_SDL
 SDL_Surface *screen;
+#endif
 
 struct Point;
 typedef vector<Point> PointVector;
 
 void rotate(Point &p, double angle);
 void rotoMoveVertices(PointVector &src, PointVector &dst, Point &v, Point &c, double angle);
+#ifndef NO_SDL
 int draw_line(SDL_Surface *, Point &a, Point &b, Uint32 color = 0);
+#endif
 double distance(Point &a, Point &b, Point &c);
 double point_distance(Point &a, Point &b);
 
@@ -101,10 +130,19 @@ operator* (const double d, Point &p) {
     return operator*(p, d);
 }
 */
+inline double
+dot(const Point &a, const Point &b) {
+    return a.x * b.x + a.y * b.y;
+}
+inline double
+cross(const Point &a, const Point &b) {
+    return a.x * b.y - a.y * b.x;
+}
 struct Polygon {
     PointVector ov; // original vertices
     PointVector cv; // current vertices (after rotomove)
     PointVector nextv;
+    PointVector on; // outward unit normals of edges ov[i], ov[i+1]
     double angle;
     double nextangle;
     Point c;
@@ -128,23 +166,8 @@ struct Polygon {
         rotoMoveVertices(ov, nextv, v, c, angle);
         return *this;
     }
-    Polygon &move(double dt) {
-        double d, w;
-        Point v;
-
-        v = V * dt;
-        w = W * dt;
-
-        nextangle = angle + w;
-        d = nextangle < 0 ? 360.0 : -360.0;
-        while (fabs(nextangle) > 360.0)
-            nextangle += d;
-        nextpos = pos + v;
-        rotoMoveVertices(ov, nextv, nextpos, C, angle);
-        return *this;
-    }
     Polygon &commit(void) {
-        cv = nextv;
+        cv.swap(nextv);
         angle = nextangle;
         pos = nextpos;
         return *this;
@@ -156,28 +179,6 @@ struct Polygon {
         commit();
         return *this;
     }
-    Polygon &draw(SDL_Surface *surf, Uint32 border_color = 0) {
-        int i, next;
-        Uint32 color, red[3];
-
-        /*
-        for (i = 0; i < NELEMS(red); ++i)
-            red[i] = SDL_MapRGB(surf->format, 0xff, (0xff / NELEMS(red)) * i, (0xff / NELEMS(red)) * i);
-        */
-        
-        for (i = 0; i < cv.size(); ++i) {
-            next = (i + 1) % cv.size();
-            /*
-            if (i < NELEMS(red))
-                color = red[i];
-            else
-                color = border_color;
-            */
-            color = border_color;
-            draw_line(surf, cv[i], cv[next], color);
-        }
-        return *this;
-    }
     double area(void) {
         PointVector::size_type i, j, n;
 
@@ -224,11 +225,30 @@ struct Polygon {
         }
         return l;
     } 
+    Polygon &edgeNormals(void) {
+        PointVector::size_type i, n = ov.size();
+        Point e;
+        double l;
+
+        on.resize(n);
+        for (i = 0; i < n; ++i) {
+            e = ov[(i + 1) % n] - ov[i];
+            l = e.length();
+            // which side is out depends on the winding
+            if (area() > 0)
+                on[i] = Point(e.y / l, -e.x / l);
+            else
+                on[i] = Point(-e.y / l, e.x / l);
+        }
+        return *this;
+    }
     Polygon &updateConstants(void) {
         C = centerOfMass();
         R = outerRadius();
         M = R * R;
         I = 0.5 * M * R * R;
+        edgeNormals();
+        return *this;
     }
 };
 ostream &
@@ -245,10 +265,12 @@ operator<< (ostream &os, const Polygon &poly) {
     return os;
 }
 
+#ifndef NO_SDL
 int
 draw_line(SDL_Surface *surf, Point &a, Point &b, Uint32 color) {
     return lineColor(surf, (Sint16) a.x, (Sint16) a.y, (Sint16) b.x, (Sint16) b.y, color);
 }
+#endif
 
 string
 strprintf(const char *fmt, ...) {
@@ -284,13 +306,17 @@ rotate(Point &p, double angle, Point &c) {
 
 void
 rotoMoveVertices(PointVector &src, PointVector &dst, Point &v, Point &c, double angle) {
-    PointVector::iterator it;
-
-    dst.assign(src.begin(), src.end());
+    PointVector::size_type i;
+    double sin_a, cos_a;
+    Point p;
 
-    for (it = dst.begin(); it != dst.end(); ++it) {
-        rotate(*it, angle, c);
-        *it += v;
+    sin_a = sin(angle);
+    cos_a = cos(angle);
+    dst.resize(src.size());
+    for (i = 0; i < src.size(); ++i) {
+        p = src[i] - c;
+        dst[i].x = p.x * cos_a - p.y * sin_a + c.x + v.x;
+        dst[i].y = p.y * cos_a + p.x * sin_a + c.y + v.y;
     }
 }
 
@@ -443,6 +469,7 @@ orient(Point &a, Point &b, Point &c) {
     return (a.x - c.x) * (b.y - c.y) - (a.y - c.y) * (b.x - c.x);
 }
 
+#ifndef NO_SDL
 void
 init_sdl(void) {
     if (SDL_Init(SDL_INIT_VIDEO) == -1)
@@ -452,12 +479,7 @@ init_sdl(void) {
         err(1, "SDL_SetVideoMode: %s", SDL_GetError());
 }
 
-Uint32 ticks;
-
-struct timediff {
-    Uint32 ticks;
-    Uint32 diff;
-} timediff;
+#endif
 
 typedef vector<Polygon> PolygonVector;
 
@@ -509,10 +531,10 @@ gen_polys(PolygonVector &polys, int n, int nvertices_min, int nvertices_max) {
             do {
                 ++niter;
                 p = gen_point(-80, 80, -80, 80);
-                if (j < 1)
-                    is_convex = true;
+                if (j < 2)
+                    is_convex = j == 0 || !(p == poly.ov[0]);
                 else {
-                    for (k = 1; k <= j; ++k) {
+                    for (k = 1; k < j; ++k) {
                         is_convex = orient(poly.ov[k-1], poly.ov[k], p) < 0.0;
                         if (!is_convex)
                             break;
@@ -521,7 +543,7 @@ gen_polys(PolygonVector &polys, int n, int nvertices_min, int nvertices_max) {
                     if (!is_convex)
                         continue;
 
-                    for (k = 2; k <= j; ++k) {
+                    for (k = 2; k < j; ++k) {
                         is_convex = orient(poly.ov[0], poly.ov[k], p) < 0.0;
                         if (!is_convex)
                             break;
@@ -530,7 +552,7 @@ gen_polys(PolygonVector &polys, int n, int nvertices_min, int nvertices_max) {
                     if (!is_convex)
                         continue;
 
-                    is_convex = orient(poly.ov[j], poly.ov[0], p) > 0.0;
+                    is_convex = orient(poly.ov[j-1], poly.ov[0], p) > 0.0;
                 }
             } while (!is_convex && niter < max_niter);
 
@@ -551,124 +573,1190 @@ gen_polys(PolygonVector &polys, int n, int nvertices_min, int nvertices_max) {
     }
 }
 
+/*
+ * The bodies being simulated, kept as a structure of arrays: a flat
+ * array per coordinate for the vertices of all bodies one after another,
+ * and one per property for the bodies.  Each body's vertices start at a
+ * multiple of LANES, with the unused slots at the end of a range turned
+ * along with the rest, so the rotate-translate below goes over whole
+ * vector registers and needs no scalar tail.  Vertices and normals are
+ * kept relative to the centre of mass, which is what pos is.
+ */
+#define LANES 4
+
+struct World {
+    // per body
+    vector<int> first;  // index of the first vertex
+    vector<int> nv;     // number of vertices
+    vector<double> px, py, angle;
+    vector<double> vx, vy, w;
+    vector<double> M, I, R;
+    vector<double> im, ii;           // 1/M and 1/I
+    vector<double> ppx, ppy, pangle; // as of the step before, to draw between
+    // per vertex
+    vector<double> lx, ly;   // unturned, around the centre of mass
+    vector<double> lnx, lny; // outward edge normals, unturned
+    vector<double> x, y;     // turned and moved to pos
+    vector<double> nx, ny;   // turned
+
+    int size(void) const {
+        return nv.size();
+    }
+    void clear(void) {
+        first.clear(); nv.clear();
+        px.clear(); py.clear(); angle.clear();
+        vx.clear(); vy.clear(); w.clear();
+        M.clear(); I.clear(); R.clear();
+        im.clear(); ii.clear();
+        ppx.clear(); ppy.clear(); pangle.clear();
+        lx.clear(); ly.clear(); lnx.clear(); lny.clear();
+        x.clear(); y.clear(); nx.clear(); ny.clear();
+    }
+    void add(Polygon &poly) {
+        PointVector::size_type i, n = poly.ov.size();
+        int k = lx.size(), end = k + (n + LANES - 1) / LANES * LANES;
+        Point c(poly.pos + poly.C);
+
+        first.push_back(k);
+        nv.push_back(n);
+        px.push_back(c.x);
+        py.push_back(c.y);
+        angle.push_back(poly.angle);
+        vx.push_back(poly.V.x);
+        vy.push_back(poly.V.y);
+        w.push_back(poly.W);
+        M.push_back(poly.M);
+        I.push_back(poly.I);
+        R.push_back(poly.R);
+        im.push_back(1.0 / poly.M);
+        ii.push_back(1.0 / poly.I);
+        ppx.push_back(c.x);
+        ppy.push_back(c.y);
+        pangle.push_back(poly.angle);
+        lx.resize(end);
+        ly.resize(end);
+        lnx.resize(end);
+        lny.resize(end);
+        for (i = 0; i < n; ++i, ++k) {
+            lx[k] = poly.ov[i].x - poly.C.x;
+            ly[k] = poly.ov[i].y - poly.C.y;
+            lnx[k] = poly.on[i].x;
+            lny[k] = poly.on[i].y;
+        }
+        x.resize(end);
+        y.resize(end);
+        nx.resize(end);
+        ny.resize(end);
+        turn(size() - 1);
+    }
+    Point vertex(int b, int i) const {
+        return Point(x[first[b] + i], y[first[b] + i]);
+    }
+    Point normal(int b, int i) const {
+        return Point(nx[first[b] + i], ny[first[b] + i]);
+    }
+    Point center(int b) const {
+        return Point(px[b], py[b]);
+    }
+    Point velocity(int b) const {
+        return Point(vx[b], vy[b]);
+    }
+    // Velocity of the point at r from the centre of b.
+    Point velocity(int b, const Point &r) const {
+        return Point(vx[b] - w[b] * r.y, vy[b] + w[b] * r.x);
+    }
+    void push(int b, const Point &P, const Point &r, double sign) {
+        vx[b] += sign * P.x * im[b];
+        vy[b] += sign * P.y * im[b];
+        w[b] += sign * cross(r, P) * ii[b];
+    }
+    // Moves b without turning.
+    void shift(int b, const Point &d) {
+        int i, end = first[b] + nv[b];
+
+        px[b] += d.x;
+        py[b] += d.y;
+        for (i = first[b]; i < end; ++i) {
+            x[i] += d.x;
+            y[i] += d.y;
+        }
+    }
+    void turn(int b) {
+        turnVertices(b, cos(angle[b]), sin(angle[b]));
+    }
+    void turnVertices(int b, double c, double s);
+    void integrate(double dt, int begin, int end);
+    // The current poses become the previous ones, and integrate() then
+    // writes the new ones from them.
+    void swapPoses(void) {
+        px.swap(ppx);
+        py.swap(ppy);
+        angle.swap(pangle);
+    }
+    unsigned checksum(void) const;
+};
+
+/*
+ * x = lx*c - ly*s + px, y = ly*c + lx*s + py for every slot of b, and
+ * the same without the move for the normals.  Build with -mavx (or
+ * -march=native) for four at a time, SSE2 does two.
+ */
+void
+World::turnVertices(int b, double c, double s) {
+    int i = first[b], end = i + (nv[b] + LANES - 1) / LANES * LANES;
+    const double *lx = &this->lx[0], *ly = &this->ly[0];
+    const double *lnx = &this->lnx[0], *lny = &this->lny[0];
+    double *x = &this->x[0], *y = &this->y[0];
+    double *nx = &this->nx[0], *ny = &this->ny[0];
+    double tx = px[b], ty = py[b];
+
+#if defined(__AVX__)
+    __m256d c4 = _mm256_set1_pd(c), s4 = _mm256_set1_pd(s);
+    __m256d tx4 = _mm256_set1_pd(tx), ty4 = _mm256_set1_pd(ty);
+    __m256d ax, ay;
+
+    for (; i + 4 <= end; i += 4) {
+        ax = _mm256_loadu_pd(lx + i);
+        ay = _mm256_loadu_pd(ly + i);
+        _mm256_storeu_pd(x + i, _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(ax, c4), _mm256_mul_pd(ay, s4)), tx4));
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ay, c4), _mm256_mul_pd(ax, s4)), ty4));
+        ax = _mm256_loadu_pd(lnx + i);
+        ay = _mm256_loadu_pd(lny + i);
+        _mm256_storeu_pd(nx + i, _mm256_sub_pd(_mm256_mul_pd(ax, c4), _mm256_mul_pd(ay, s4)));
+        _mm256_storeu_pd(ny + i, _mm256_add_pd(_mm256_mul_pd(ay, c4), _mm256_mul_pd(ax, s4)));
+    }
+#elif defined(__SSE2__)
+    __m128d c2 = _mm_set1_pd(c), s2 = _mm_set1_pd(s);
+    __m128d tx2 = _mm_set1_pd(tx), ty2 = _mm_set1_pd(ty);
+    __m128d ax, ay;
+
+    for (; i + 2 <= end; i += 2) {
+        ax = _mm_loadu_pd(lx + i);
+        ay = _mm_loadu_pd(ly + i);
+        _mm_storeu_pd(x + i, _mm_add_pd(_mm_sub_pd(_mm_mul_pd(ax, c2), _mm_mul_pd(ay, s2)), tx2));
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_add_pd(_mm_mul_pd(ay, c2), _mm_mul_pd(ax, s2)), ty2));
+        ax = _mm_loadu_pd(lnx + i);
+        ay = _mm_loadu_pd(lny + i);
+        _mm_storeu_pd(nx + i, _mm_sub_pd(_mm_mul_pd(ax, c2), _mm_mul_pd(ay, s2)));
+        _mm_storeu_pd(ny + i, _mm_add_pd(_mm_mul_pd(ay, c2), _mm_mul_pd(ax, s2)));
+    }
+#endif
+    for (; i < end; ++i) {
+        x[i] = lx[i] * c - ly[i] * s + tx;
+        y[i] = ly[i] * c + lx[i] * s + ty;
+        nx[i] = lnx[i] * c - lny[i] * s;
+        ny[i] = lny[i] * c + lnx[i] * s;
+    }
+}
+
+void
+World::integrate(double dt, int begin, int end) {
+    int b;
+
+    // plain loops over the body arrays, left to the compiler to vectorize
+    for (b = begin; b < end; ++b) {
+        px[b] = ppx[b] + vx[b] * dt;
+        py[b] = ppy[b] + vy[b] * dt;
+    }
+    for (b = begin; b < end; ++b) {
+        angle[b] = pangle[b] + w[b] * dt;
+        angle[b] -= 2 * M_PI * floor(angle[b] / (2 * M_PI));
+    }
+    for (b = begin; b < end; ++b)
+        turn(b);
+}
+
+// FNV-1a over the poses, to tell whether two runs went the same way.
+unsigned
+World::checksum(void) const {
+    const vector<double> *v[] = { &px, &py, &angle, &vx, &vy, &w };
+    const unsigned char *p;
+    unsigned h = 2166136261u;
+    size_t i, k;
+
+    for (k = 0; k < NELEMS(v); ++k) {
+        p = (const unsigned char *) &(*v[k])[0];
+        for (i = 0; i < v[k]->size() * sizeof(double); ++i)
+            h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+#ifndef NO_SDL
+/*
+ * Draws only what changed.  The screen is split in tiles; every frame
+ * the bodies are placed where they are to be drawn, and the tiles under
+ * the old and the new bounding box of each body that moved by a pixel
+ * are dirty.  Those get cleared, the bodies touching any of them drawn
+ * again, and only they are sent to the display.  The edges to draw all
+ * go through a single scanline pass that writes the spans of each row
+ * straight into the locked surface.
+ */
+#define TILE 32
+#define TILES_W ((SCREEN_W + TILE - 1) / TILE)
+#define TILES_H ((SCREEN_H + TILE - 1) / TILE)
+
+struct Box {
+    int x0, y0, x1, y1; // inclusive, on screen; empty if x0 > x1
+};
+
+struct Edge {
+    int x, y, y1;   // top end and the last row
+    int xmin, xmax;
+    double dxdy;
+    int next;       // in the list of edges starting on the same row
+};
+
+struct Renderer {
+    vector<int> ix, iy, pix, piy; // per vertex, this frame and the last
+    vector<Box> box, pbox;        // per body
+    bool dirty[TILES_H][TILES_W];
+    bool full;                    // nothing is on the screen yet
+    vector<SDL_Rect> rects;
+    vector<Edge> edges;
+    vector<int> row;              // per row, first edge starting there
+    vector<int> active;
+
+    Renderer() : full(true) {}
+    void place(const World &world, double alpha);
+    void mark(const Box &b);
+    bool touches(const Box &b) const;
+    void addEdges(const World &world, int b);
+    void span(SDL_Surface *surf, int y, int x0, int x1, Uint32 color);
+    void rasterize(SDL_Surface *surf, Uint32 color);
+    void draw(SDL_Surface *surf, const World &world, double alpha, Uint32 color);
+};
+
+/*
+ * Puts the vertices alpha of the way from the poses before the
+ * last step to the current ones, so that motion looks smooth whatever
+ * the frame rate is compared to the step, and rounds them to pixels.
+ */
+void
+Renderer::place(const World &world, double alpha) {
+    int b, k, end;
+    double a, c, s, tx, ty;
+    Box bx;
+
+    ix.resize(world.x.size());
+    iy.resize(world.y.size());
+    box.resize(world.size());
+    for (b = 0; b < world.size(); ++b) {
+        a = world.angle[b] - world.pangle[b];
+        if (a > M_PI)
+            a -= 2 * M_PI;
+        else if (a < -M_PI)
+            a += 2 * M_PI;
+        a = world.pangle[b] + a * alpha;
+        c = cos(a);
+        s = sin(a);
+        tx = world.ppx[b] + (world.px[b] - world.ppx[b]) * alpha;
+        ty = world.ppy[b] + (world.py[b] - world.ppy[b]) * alpha;
+
+        bx.x0 = bx.y0 = INT_MAX;
+        bx.x1 = bx.y1 = INT_MIN;
+        for (k = world.first[b], end = k + world.nv[b]; k < end; ++k) {
+            ix[k] = (int) floor(world.lx[k] * c - world.ly[k] * s + tx + 0.5);
+            iy[k] = (int) floor(world.ly[k] * c + world.lx[k] * s + ty + 0.5);
+            bx.x0 = min(bx.x0, ix[k]);
+            bx.x1 = max(bx.x1, ix[k]);
+            bx.y0 = min(bx.y0, iy[k]);
+            bx.y1 = max(bx.y1, iy[k]);
+        }
+        bx.x0 = max(bx.x0, 0);
+        bx.y0 = max(bx.y0, 0);
+        bx.x1 = min(bx.x1, SCREEN_W - 1);
+        bx.y1 = min(bx.y1, SCREEN_H - 1);
+        if (bx.y0 > bx.y1)
+            bx.x0 = bx.x1 + 1;
+        box[b] = bx;
+    }
+}
+
+void
+Renderer::mark(const Box &b) {
+    int x, y;
+
+    if (b.x0 > b.x1)
+        return;
+    for (y = b.y0 / TILE; y <= b.y1 / TILE; ++y) {
+        for (x = b.x0 / TILE; x <= b.x1 / TILE; ++x)
+            dirty[y][x] = true;
+    }
+}
+
 bool
-collide_polys(Polygon &a, Polygon &b, double td) {
+Renderer::touches(const Box &b) const {
+    int x, y;
+
+    if (b.x0 > b.x1)
+        return false;
+    for (y = b.y0 / TILE; y <= b.y1 / TILE; ++y) {
+        for (x = b.x0 / TILE; x <= b.x1 / TILE; ++x) {
+            if (dirty[y][x])
+                return true;
+        }
+    }
     return false;
 }
 
-/* FIXME */
-bool
-collide_poly_with_walls(Polygon &poly, double td) {
-    struct Line {
-        Point a;
-        Point b;
-        Line() {}
-        Line(Point &a, Point &b) : a(a), b(b) {}
-    };
-    Point wv[] = { // wall vertices
-        Point(0.0, 0.0),
-        Point(SCREEN_W, 0.0),
-        Point(SCREEN_W, SCREEN_H),
-        Point(0.0, SCREEN_H)
-    };
-    int i;
-    PointVector::size_type j;
-    bool did_collide = false;
+void
+Renderer::addEdges(const World &world, int b) {
+    int i, j, n = world.nv[b], k = world.first[b];
+    Edge e;
+
+    for (i = 0, j = n - 1; i < n; j = i++) {
+        if (iy[k + i] < iy[k + j] || (iy[k + i] == iy[k + j] && ix[k + i] < ix[k + j])) {
+            e.x = ix[k + i];
+            e.y = iy[k + i];
+            e.y1 = iy[k + j];
+        } else {
+            e.x = ix[k + j];
+            e.y = iy[k + j];
+            e.y1 = iy[k + i];
+        }
+        if (e.y1 < 0 || e.y >= SCREEN_H)
+            continue;
+        e.xmin = min(ix[k + i], ix[k + j]);
+        e.xmax = max(ix[k + i], ix[k + j]);
+        e.dxdy = e.y1 > e.y ? (double) (ix[k + i] - ix[k + j]) / (iy[k + i] - iy[k + j]) : 0.0;
+        // edges above the screen start on its first row
+        e.next = row[max(e.y, 0)];
+        row[max(e.y, 0)] = edges.size();
+        edges.push_back(e);
+    }
+}
 
-    for (i = 0; i < NELEMS(wv); ++i) {
-        for (j = 0; j < poly.nextv.size(); ++j) { 
-            Point X;
-            Line wall(wv[i], wv[(i+1)%NELEMS(wv)]);
-        
-            if (!line_intersect(wall.a, wall.b, poly.nextv[j], poly.cv[j], X))
+void
+Renderer::span(SDL_Surface *surf, int y, int x0, int x1, Uint32 color) {
+    int bpp = surf->format->BytesPerPixel;
+    Uint8 *p;
+
+    x0 = max(x0, 0);
+    x1 = min(x1, surf->w - 1);
+    p = (Uint8 *) surf->pixels + y * surf->pitch + x0 * bpp;
+    for (; x0 <= x1; ++x0, p += bpp) {
+        switch (bpp) {
+        case 1:
+            *p = color;
+            break;
+        case 2:
+            *(Uint16 *) p = color;
+            break;
+        case 3:
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+            p[0] = color >> 16;
+            p[1] = color >> 8;
+            p[2] = color;
+#else
+            p[0] = color;
+            p[1] = color >> 8;
+            p[2] = color >> 16;
+#endif
+            break;
+        case 4:
+            *(Uint32 *) p = color;
+            break;
+        }
+    }
+}
+
+/*
+ * Goes down the rows once, taking in the edges that start on each and
+ * dropping the ones that ended.  On a row an edge covers the pixels its
+ * line crosses between half a row above and half a row below, so
+ * shallow edges come out as horizontal runs without gaps.
+ */
+void
+Renderer::rasterize(SDL_Surface *surf, Uint32 color) {
+    vector<int>::size_type i;
+    double x, h;
+    int y, e, x0, x1;
+
+    active.clear();
+    for (y = 0; y < SCREEN_H; ++y) {
+        for (e = row[y]; e >= 0; e = edges[e].next)
+            active.push_back(e);
+        for (i = 0; i < active.size(); /* empty */) {
+            Edge &ed = edges[active[i]];
+
+            if (ed.y1 == ed.y) {
+                x0 = ed.xmin;
+                x1 = ed.xmax;
+            } else {
+                x = ed.x + (y - ed.y) * ed.dxdy;
+                h = 0.5 * fabs(ed.dxdy);
+                x0 = max(ed.xmin, (int) floor(x - h + 0.5));
+                x1 = min(ed.xmax, (int) floor(x + h + 0.5));
+            }
+            span(surf, y, x0, x1, color);
+            if (ed.y1 <= y) {
+                active[i] = active.back();
+                active.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+}
+
+void
+Renderer::draw(SDL_Surface *surf, const World &world, double alpha, Uint32 color) {
+    int b, k, end, x, y, x0;
+    bool moved;
+    SDL_Rect r;
+
+    ix.swap(pix);
+    iy.swap(piy);
+    box.swap(pbox);
+    place(world, alpha);
+
+    memset(dirty, full, sizeof(dirty));
+    if (!full) {
+        for (b = 0; b < world.size(); ++b) {
+            moved = false;
+            for (k = world.first[b], end = k + world.nv[b]; k < end && !moved; ++k)
+                moved = ix[k] != pix[k] || iy[k] != piy[k];
+            if (moved) {
+                mark(pbox[b]);
+                mark(box[b]);
+            }
+        }
+    }
+    full = false;
+
+    // clear the dirty tiles, a run of them on a row at a time
+    rects.clear();
+    for (y = 0; y < TILES_H; ++y) {
+        for (x = 0; x < TILES_W; /* empty */) {
+            if (!dirty[y][x]) {
+                ++x;
                 continue;
+            }
+            for (x0 = x; x < TILES_W && dirty[y][x]; ++x)
+                ;
+            r.x = x0 * TILE;
+            r.y = y * TILE;
+            r.w = min(x * TILE, SCREEN_W) - r.x;
+            r.h = min((y + 1) * TILE, SCREEN_H) - r.y;
+            SDL_FillRect(surf, &r, 0);
+            rects.push_back(r);
+        }
+    }
+    if (rects.empty())
+        return;
+
+    // bodies that didn't move are drawn again too if they were cleared
+    edges.clear();
+    row.assign(SCREEN_H, -1);
+    for (b = 0; b < world.size(); ++b) {
+        if (touches(box[b]))
+            addEdges(world, b);
+    }
+    if (SDL_MUSTLOCK(surf) && SDL_LockSurface(surf) < 0)
+        return;
+    rasterize(surf, color);
+    if (SDL_MUSTLOCK(surf))
+        SDL_UnlockSurface(surf);
+    SDL_UpdateRects(surf, rects.size(), &rects[0]);
+}
+#endif
 
-            did_collide = true;
-
-            /*
-            Point coll_normal(line_normal(wall.a, wall.b));
-            Point shoulder(X.x - poly.nextv[j].x, X.y - poly.nextv[j].y);
-            double impulse = 
-            */
-            ///
-            /*
-            Fs = point_distance(poly.nextv[j], poly.cv[j]) * td * poly.M;
-            arm_len = distance(poly.nextv[j], poly.cv[j], poly.nextpos);
-            W = orient(poly.nextv[j], poly.cv[j], poly.nextpos) < 0.0 ? -arm_len * (Fs / poly.I) : arm_len * (Fs / poly.I);
-            poly.W += W;
-            */
-        } 
+/*
+ * Narrow phase.  Convex polygons overlap unless one of their edge
+ * normals is a separating axis (SAT).  If they do, the edge with the
+ * least penetration is the reference face; the edge of the other body
+ * facing it the most is clipped to the sides of the reference face, and
+ * what is left of it behind the face gives up to two contact points.
+ */
+struct Manifold {
+    int a;
+    int b; // -1 for a wall
+    Point n; // unit, from a to b
+    Point p[2];
+    double depth[2];
+    int np;
+};
+
+// Deepest face of a as seen from b: the greatest separation of b's
+// vertices from any edge of a, positive if that edge separates them.
+double
+max_separation(const World &world, int a, int b, int &face) {
+    int i, j, fa = world.first[a], fb = world.first[b];
+    double best = -HUGE_VAL, s, d;
+
+    face = 0;
+    for (i = 0; i < world.nv[a]; ++i) {
+        s = HUGE_VAL;
+        for (j = 0; j < world.nv[b]; ++j) {
+            d = world.nx[fa + i] * (world.x[fb + j] - world.x[fa + i]) +
+                world.ny[fa + i] * (world.y[fb + j] - world.y[fa + i]);
+            if (d < s)
+                s = d;
+        }
+        if (s > best) {
+            best = s;
+            face = i;
+            if (best > 0.0)
+                break;
+        }
     }
+    return best;
+}
+
+// Keeps the part of segment v where dot(n, x) <= o, false if none.
+bool
+clip(Point v[2], const Point &n, double o) {
+    double d0 = dot(n, v[0]) - o, d1 = dot(n, v[1]) - o;
 
-    return did_collide;
+    if (d0 > 0.0 && d1 > 0.0)
+        return false;
+    if (d0 > 0.0)
+        v[0] = v[0] + (v[1] - v[0]) * (d0 / (d0 - d1));
+    else if (d1 > 0.0)
+        v[1] = v[1] + (v[0] - v[1]) * (d1 / (d1 - d0));
+    return true;
 }
 
+bool
+collide_polys(const World &world, int a, int b, Manifold &m) {
+    int ref, inc, fa, fb, face, i, k;
+    Point refn, t, r1, r2, v[2];
+    double sa, sb, d, least;
+
+    if ((sa = max_separation(world, a, b, fa)) > 0.0 || (sb = max_separation(world, b, a, fb)) > 0.0)
+        return false;
+
+    // prefer a's face unless b's is clearly better, so contacts don't flip
+    if (sb > sa * 0.95 + 0.01 * world.R[b]) {
+        ref = b;
+        inc = a;
+        face = fb;
+    } else {
+        ref = a;
+        inc = b;
+        face = fa;
+    }
+    refn = world.normal(ref, face);
+    r1 = world.vertex(ref, face);
+    r2 = world.vertex(ref, (face + 1) % world.nv[ref]);
+
+    least = HUGE_VAL;
+    k = 0;
+    for (i = 0; i < world.nv[inc]; ++i) {
+        if ((d = dot(world.normal(inc, i), refn)) < least) {
+            least = d;
+            k = i;
+        }
+    }
+    v[0] = world.vertex(inc, k);
+    v[1] = world.vertex(inc, (k + 1) % world.nv[inc]);
+
+    t = (r2 - r1) / (r2 - r1).length();
+    if (!clip(v, t * -1.0, -dot(t, r1)) || !clip(v, t, dot(t, r2)))
+        return false;
+
+    m.a = a;
+    m.b = b;
+    m.n = ref == a ? refn : refn * -1.0;
+    m.np = 0;
+    for (k = 0; k < 2; ++k) {
+        if ((d = dot(refn, v[k] - r1)) > 0.0)
+            continue;
+        m.p[m.np] = v[k];
+        m.depth[m.np] = -d;
+        ++m.np;
+    }
+    return m.np > 0;
+}
+
+// Walls are static half-planes.  They go clockwise around the screen,
+// which puts the inside at (-d.y, d.x) of each.
+bool
+collide_poly_with_wall(const World &world, int a, const Point wall[2], Manifold &m) {
+    Point d(wall[1] - wall[0]), in, v;
+    double depth;
+    int j, k;
+
+    in = Point(-d.y, d.x) / d.length();
+    m.a = a;
+    m.b = -1;
+    m.n = in * -1.0;
+    m.np = 0;
+    for (j = 0; j < world.nv[a]; ++j) {
+        v = world.vertex(a, j);
+        if ((depth = -dot(in, v - wall[0])) <= 0.0)
+            continue;
+        // keep the two deepest
+        if (m.np < 2) {
+            m.p[m.np] = v;
+            m.depth[m.np++] = depth;
+        } else {
+            k = m.depth[0] < m.depth[1] ? 0 : 1;
+            if (depth > m.depth[k]) {
+                m.p[k] = v;
+                m.depth[k] = depth;
+            }
+        }
+    }
+    return m.np > 0;
+}
+
+/*
+ * Sequential impulses: every contact point gets an impulse along the
+ * normal that stops the bodies approaching there, plus some bounce, and
+ * one along the surface against sliding, as big as friction allows.
+ * Going over all contacts a few times lets the ones that share a body
+ * settle between them.
+ */
 void
-move_and_collide(double td, PolygonVector &polys, const Point walls[][2], int nwalls) {
-    int i;
-    PolygonVector::iterator it, jt;
-    Point xp;
-    Point v;
-
-    for (i = 0; i < nwalls; ++i) {
-        for (it = polys.begin(); it != polys.end(); ++it) {
-            it->move(td);
-        }
-        for (it = polys.begin(); it != polys.end(); ++it) {
-            for (jt = polys.begin(); jt != polys.end(); ++jt) {
-                if (jt == it)
-                    continue;
-                collide_polys(*it, *jt, td);
+apply_impulses(World &world, Manifold &m) {
+    int a = m.a, b = m.b, i;
+    Point ra, rb, dv, t, P;
+    double ima, iia, imb = 0.0, iib = 0.0, vn, rn, rt, k, j, jt;
+
+    ima = world.im[a];
+    iia = world.ii[a];
+    if (b >= 0) {
+        imb = world.im[b];
+        iib = world.ii[b];
+    }
+    for (i = 0; i < m.np; ++i) {
+        ra = m.p[i] - world.center(a);
+        dv = world.velocity(a, ra).invert();
+        if (b >= 0) {
+            rb = m.p[i] - world.center(b);
+            dv += world.velocity(b, rb);
+        }
+        if ((vn = dot(dv, m.n)) >= 0.0)
+            continue;
+
+        rn = cross(ra, m.n);
+        k = ima + iia * rn * rn;
+        if (b >= 0) {
+            rn = cross(rb, m.n);
+            k += imb + iib * rn * rn;
+        }
+        j = -(1.0 + RESTITUTION) * vn / k;
+        P = m.n * j;
+
+        t = dv - m.n * vn;
+        if (t.length() > E) {
+            t = t / t.length();
+            rt = cross(ra, t);
+            k = ima + iia * rt * rt;
+            if (b >= 0) {
+                rt = cross(rb, t);
+                k += imb + iib * rt * rt;
+            }
+            jt = -dot(dv, t) / k;
+            if (fabs(jt) > FRICTION * j)
+                jt = jt < 0.0 ? -FRICTION * j : FRICTION * j;
+            P += t * jt;
+        }
+
+        world.push(a, P, ra, -1.0);
+        if (b >= 0)
+            world.push(b, P, rb, 1.0);
+    }
+}
+
+// Pushes the bodies out of each other along the normal, by mass.
+void
+separate(World &world, Manifold &m) {
+    double depth, ima, imb, c;
+
+    depth = m.depth[0];
+    if (m.np > 1 && m.depth[1] > depth)
+        depth = m.depth[1];
+    if ((depth -= SLOP) <= 0.0)
+        return;
+    ima = world.im[m.a];
+    imb = m.b >= 0 ? world.im[m.b] : 0.0;
+    c = depth * CORRECTION / (ima + imb);
+    world.shift(m.a, m.n * (-c * ima));
+    if (m.b >= 0)
+        world.shift(m.b, m.n * (c * imb));
+}
+
+/*
+ * Broad phase: a uniform grid over the screen whose cells are at least
+ * as wide as the biggest bounding circle, so two circles can only
+ * overlap if their centres are in the same or in neighbouring cells.
+ * Bodies are bucketed by their centre with a counting sort, which keeps
+ * the whole grid in a few flat arrays that are reused from frame to
+ * frame.
+ */
+struct Grid {
+    typedef pair<int, int> Pair;
+
+    double cell;
+    int w, h;
+    vector<int> cellOf;   // per body
+    vector<int> start;    // per cell, into items, plus one past the end
+    vector<int> items;    // body indices ordered by cell
+
+    int clampedCell(double v, int n) const {
+        int i = (int) floor(v / cell);
+        return i < 0 ? 0 : i >= n ? n - 1 : i;
+    }
+    void build(const World &world) {
+        int i, k, n = world.size();
+        double maxR = 0.0;
+
+        cellOf.resize(n);
+        for (i = 0; i < n; ++i) {
+            if (world.R[i] > maxR)
+                maxR = world.R[i];
+        }
+
+        // no point in having many more cells than bodies
+        cell = 2.0 * maxR;
+        if (n > 0 && cell * cell < (double) SCREEN_W * SCREEN_H / n)
+            cell = sqrt((double) SCREEN_W * SCREEN_H / n);
+        if (cell < 1.0)
+            cell = 1.0;
+        w = (int) ceil(SCREEN_W / cell);
+        h = (int) ceil(SCREEN_H / cell);
+
+        start.assign(w * h + 1, 0);
+        for (i = 0; i < n; ++i) {
+            cellOf[i] = clampedCell(world.py[i], h) * w + clampedCell(world.px[i], w);
+            ++start[cellOf[i] + 1];
+        }
+        for (k = 0; k < w * h; ++k)
+            start[k + 1] += start[k];
+        items.resize(n);
+        for (i = 0; i < n; ++i)
+            items[start[cellOf[i]]++] = i;
+        // the fill loop moved every start to the end of its cell
+        for (k = w * h; k > 0; --k)
+            start[k] = start[k - 1];
+        start[0] = 0;
+    }
+    bool overlap(const World &world, int a, int b) const {
+        double dx = world.px[b] - world.px[a], dy = world.py[b] - world.py[a];
+        double r = world.R[a] + world.R[b];
+
+        return dx * dx + dy * dy < r * r;
+    }
+    // Every pair of bodies whose bounding circles overlap, once.
+    void pairs(const World &world, vector<Pair> &out) const {
+        // the cell itself is done separately, these are the other half
+        static const int nb[][2] = { { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+        int x, y, c, d, i, j, k, nx, ny;
+
+        out.clear();
+        for (y = 0; y < h; ++y) {
+            for (x = 0; x < w; ++x) {
+                c = y * w + x;
+                for (i = start[c]; i < start[c + 1]; ++i) {
+                    for (j = i + 1; j < start[c + 1]; ++j) {
+                        if (overlap(world, items[i], items[j]))
+                            out.push_back(Pair(items[i], items[j]));
+                    }
+                    for (k = 0; k < (int) NELEMS(nb); ++k) {
+                        nx = x + nb[k][0];
+                        ny = y + nb[k][1];
+                        if (nx < 0 || nx >= w || ny >= h)
+                            continue;
+                        d = ny * w + nx;
+                        for (j = start[d]; j < start[d + 1]; ++j) {
+                            if (overlap(world, items[i], items[j]))
+                                out.push_back(Pair(items[i], items[j]));
+                        }
+                    }
+                }
             }
         }
-        for (it = polys.begin(); it != polys.end(); ++it) {
-            collide_poly_with_walls(*it, td);
+    }
+};
+
+/*
+ * Worker threads that run one parallel loop at a time: run() hands out
+ * [0, n) in chunks of grain to whichever thread asks next, the caller
+ * included, and returns when all of them are done.  Needs -pthread.
+ */
+struct Pool {
+    typedef void (*Fn)(void *arg, int begin, int end);
+
+    vector<pthread_t> threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    Fn fn;
+    void *arg;
+    int n, grain, next, busy;
+    unsigned gen;
+    bool quit;
+
+    Pool() : n(0), grain(1), next(0), busy(0), gen(0), quit(false) {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&work, NULL);
+        pthread_cond_init(&done, NULL);
+    }
+    // nthreads counts the caller too.
+    void start(int nthreads) {
+        pthread_t t;
+        int i;
+
+        for (i = 1; i < nthreads; ++i) {
+            if ((errno = pthread_create(&t, NULL, worker, this)) != 0)
+                err(1, "pthread_create");
+            threads.push_back(t);
+        }
+    }
+    void stop(void) {
+        vector<pthread_t>::iterator it;
+
+        pthread_mutex_lock(&lock);
+        quit = true;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&lock);
+        for (it = threads.begin(); it != threads.end(); ++it)
+            pthread_join(*it, NULL);
+        threads.clear();
+    }
+    int size(void) const {
+        return threads.size() + 1;
+    }
+    void run(int n, int grain, Fn fn, void *arg) {
+        if (threads.empty() || n <= grain) {
+            fn(arg, 0, n);
+            return;
+        }
+        pthread_mutex_lock(&lock);
+        this->fn = fn;
+        this->arg = arg;
+        this->n = n;
+        this->grain = grain;
+        next = 0;
+        busy = threads.size();
+        ++gen;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&lock);
+
+        chunks();
+
+        pthread_mutex_lock(&lock);
+        while (busy > 0)
+            pthread_cond_wait(&done, &lock);
+        pthread_mutex_unlock(&lock);
+    }
+    void chunks(void) {
+        int i;
+
+        while ((i = __sync_fetch_and_add(&next, grain)) < n)
+            fn(arg, i, min(i + grain, n));
+    }
+    static void *worker(void *arg) {
+        Pool *pool = (Pool *) arg;
+        unsigned seen = 0;
+
+        pthread_mutex_lock(&pool->lock);
+        for ( ;; ) {
+            while (pool->gen == seen && !pool->quit)
+                pthread_cond_wait(&pool->work, &pool->lock);
+            if (pool->quit)
+                break;
+            seen = pool->gen;
+            pthread_mutex_unlock(&pool->lock);
+
+            pool->chunks();
+
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->busy == 0)
+                pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+} pool;
+
+/*
+ * Contact islands: bodies joined by contacts, found with union-find.
+ * Contacts of different islands share no bodies, so the islands can be
+ * solved at the same time.  Within an island the contacts keep the
+ * order they were found in, which makes the result the same as solving
+ * them all in one go, whatever the number of threads.
+ */
+struct Islands {
+    vector<int> parent; // per body
+    vector<int> label;  // per body, its island or -1
+    vector<int> start;  // per island, into order, plus one past the end
+    vector<int> order;  // contact indices by island
+
+    int find(int b) {
+        while (parent[b] != b)
+            b = parent[b] = parent[parent[b]];
+        return b;
+    }
+    int size(void) const {
+        return start.size() - 1;
+    }
+    void build(int nbodies, const vector<Manifold> &contacts) {
+        int i, a, b, k, n = contacts.size(), nislands = 0;
+        vector<int> &island = order; // per contact, until the sort
+
+        parent.resize(nbodies);
+        for (i = 0; i < nbodies; ++i)
+            parent[i] = i;
+        for (i = 0; i < n; ++i) {
+            if (contacts[i].b < 0)
+                continue;
+            a = find(contacts[i].a);
+            b = find(contacts[i].b);
+            if (a < b)
+                parent[b] = a;
+            else if (b < a)
+                parent[a] = b;
+        }
+
+        label.assign(nbodies, -1);
+        island.resize(n);
+        for (i = 0; i < n; ++i) {
+            a = find(contacts[i].a);
+            if (label[a] < 0)
+                label[a] = nislands++;
+            island[i] = label[a];
         }
-        for (it = polys.begin(); it != polys.end(); ++it) {
-            it->commit();
+        // counting sort of the contacts by island, keeping their order
+        start.assign(nislands + 1, 0);
+        for (i = 0; i < n; ++i)
+            ++start[island[i] + 1];
+        for (k = 0; k < nislands; ++k)
+            start[k + 1] += start[k];
+        pos.assign(start.begin(), start.end() - 1);
+        sorted.resize(n);
+        for (i = 0; i < n; ++i)
+            sorted[pos[island[i]]++] = i;
+        order.swap(sorted);
+    }
+
+    vector<int> pos, sorted; // scratch for build()
+};
+
+// What the parallel parts of a step work on.
+struct Step {
+    World *world;
+    double dt;
+    const Point (*walls)[2];
+    int nwalls;
+    Grid grid;
+    vector<Grid::Pair> pairs;
+    vector<Manifold> found; // per pair, then per body and wall
+    vector<char> hit;
+    vector<Manifold> contacts;
+    Islands islands;
+
+    // Sizes the buffers up front, so that steps don't allocate unless
+    // the bodies crowd together much more than PAIRS_PER_BODY says.
+    void reserve(int nbodies, int nwalls) {
+        int npairs = PAIRS_PER_BODY * nbodies;
+        int ncontacts = npairs + nbodies * nwalls;
+
+        grid.cellOf.reserve(nbodies);
+        grid.items.reserve(nbodies);
+        // cells are at least 1 pixel and about as many as the bodies
+        grid.start.reserve(nbodies + SCREEN_W + SCREEN_H + 2);
+        pairs.reserve(npairs);
+        found.reserve(ncontacts);
+        hit.reserve(ncontacts);
+        contacts.reserve(ncontacts);
+        islands.parent.reserve(nbodies);
+        islands.label.reserve(nbodies);
+        islands.start.reserve(nbodies + 1);
+        islands.order.reserve(ncontacts);
+        islands.pos.reserve(nbodies);
+        islands.sorted.reserve(ncontacts);
+    }
+} step;
+
+void
+integrate_range(void *arg, int begin, int end) {
+    Step *st = (Step *) arg;
+
+    st->world->integrate(st->dt, begin, end);
+}
+
+void
+collide_range(void *arg, int begin, int end) {
+    Step *st = (Step *) arg;
+    int i, k, npairs = st->pairs.size();
+
+    for (i = begin; i < end; ++i) {
+        if (i < npairs) {
+            st->hit[i] = collide_polys(*st->world, st->pairs[i].first, st->pairs[i].second, st->found[i]);
+        } else {
+            k = i - npairs;
+            st->hit[i] = collide_poly_with_wall(*st->world, k / st->nwalls, st->walls[k % st->nwalls], st->found[i]);
         }
     }
 }
 
+void
+solve_range(void *arg, int begin, int end) {
+    Step *st = (Step *) arg;
+    Islands &is = st->islands;
+    int i, k, c;
+
+    for (i = begin; i < end; ++i) {
+        for (k = 0; k < SOLVER_ITERATIONS; ++k) {
+            for (c = is.start[i]; c < is.start[i + 1]; ++c)
+                apply_impulses(*st->world, st->contacts[is.order[c]]);
+        }
+        for (c = is.start[i]; c < is.start[i + 1]; ++c)
+            separate(*st->world, st->contacts[is.order[c]]);
+    }
+}
+
+/*
+ * One step: integrate, find the pairs with the grid, run the narrow
+ * phase on them and on the walls, and solve the contacts island by
+ * island.  All but the grid are spread over the pool; the narrow phase
+ * writes each result to its own slot and they are gathered in order
+ * afterwards, so the threads don't change the outcome.
+ */
+void
+move_and_collide(double td, World &world, const Point walls[][2], int nwalls) {
+    Step &st = step;
+    int i, n;
+
+    st.world = &world;
+    st.dt = td;
+    st.walls = walls;
+    st.nwalls = nwalls;
+
+    world.swapPoses();
+    pool.run(world.size(), 256, integrate_range, &st);
+    st.grid.build(world);
+    st.grid.pairs(world, st.pairs);
+
+    n = st.pairs.size() + world.size() * nwalls;
+    st.found.resize(n);
+    st.hit.resize(n);
+    pool.run(n, 64, collide_range, &st);
+    st.contacts.clear();
+    for (i = 0; i < n; ++i) {
+        if (st.hit[i])
+            st.contacts.push_back(st.found[i]);
+    }
+
+    st.islands.build(world.size(), st.contacts);
+    pool.run(st.islands.size(), 1, solve_range, &st);
+}
+
+// They go clockwise, see collide_poly_with_wall().
+const Point walls[][2] = {
+#   define INS_WALL(a,b,c,d) { Point(a,b), Point(c,d) }
+    INS_WALL(0.0, 0.0, SCREEN_W, 0.0),
+    INS_WALL(SCREEN_W, 0.0, SCREEN_W, SCREEN_H),
+    INS_WALL(SCREEN_W, SCREEN_H, 0.0, SCREEN_H),
+    INS_WALL(0.0, SCREEN_H, 0.0, 0.0)
+};
+const int nwalls = NELEMS(walls);
+
+/*
+ * Every allocation is counted here, so that the headless run can show
+ * how many the steps make; once the buffers have grown there are none.
+ */
+unsigned long nallocs;
+
+void *
+operator new(size_t n) {
+    void *p;
+
+    __sync_fetch_and_add(&nallocs, 1);
+    if ((p = malloc(n > 0 ? n : 1)) == NULL)
+        throw bad_alloc();
+    return p;
+}
+
+void
+operator delete(void *p) throw() {
+    free(p);
+}
+
+void
+operator delete(void *p, size_t) throw() {
+    free(p);
+}
+
+/*
+ * Runs nsteps steps without a window and prints how fast that went and
+ * how many allocations the steps made, with a checksum of the end
+ * state: the bodies come from a fixed seed and every step is STEP long,
+ * so runs of the same build agree.
+ */
+int
+headless(int npolys, int nsteps) {
+    PolygonVector polys;
+    PolygonVector::iterator pit;
+    World world;
+    struct timespec t0, t1;
+    unsigned long allocs, first = 0;
+    double secs;
+    int i;
+
+    if (npolys < 1 || nsteps < 1)
+        return -1;
+
+    srand(SEED);
+    gen_polys(polys, npolys, 3, 7);
+    for (pit = polys.begin(); pit != polys.end(); ++pit)
+        world.add(*pit);
+    step.reserve(world.size(), nwalls);
+
+    allocs = nallocs;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nsteps; ++i) {
+        move_and_collide(STEP, world, walls, nwalls);
+        // the first step's contacts can still outgrow the buffers
+        if (i == 0)
+            first = nallocs - allocs;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    allocs = nallocs - allocs - first;
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%d bodies, %d threads, %d steps in %.3f s, %.1f steps/s, checksum %08x\n",
+        world.size(), pool.size(), nsteps, secs, nsteps / secs, world.checksum());
+    printf("allocations: %lu in the first step, %lu in the rest\n", first, allocs);
+    return 0;
+}
+
+#ifndef NO_SDL
 int
 phys(int npolys) {
     SDL_Event event;
     PolygonVector polys;
-    Uint32 black = 0, white;
-    double angle = 0.0;
+    World world;
+    Renderer renderer;
+    Uint32 white;
     PolygonVector::iterator pit;
-    Uint32 ticks, fps_timer = 0, diff;
+    Uint32 now, last, fps_timer;
     Uint32 fps = 0;
+    double acc = 0.0;
     bool pause = false;
-    const Point walls[][2] = {
-#       define INS_WALL(a,b,c,d) { Point(a,b), Point(c,d) }
-        INS_WALL(0.0, 0.0, SCREEN_W, 0.0),
-        INS_WALL(SCREEN_W, 0.0, SCREEN_W, SCREEN_H),
-        INS_WALL(SCREEN_W, SCREEN_H, 0.0, SCREEN_H),
-        INS_WALL(0.0, SCREEN_H, 0.0, 0.0)
-    };
-    const int nwalls = NELEMS(walls);
+    int n;
 
     if (npolys < 1)
         return -1;
 
     srand(time(NULL));
 
-    timediff.ticks = SDL_GetTicks();
-    timediff.diff = 0; 
-    fps_timer = timediff.ticks + 5000;
-
     gen_polys(polys, npolys, 3, 7);
 
     for (pit = polys.begin(); pit != polys.end(); ++pit) {
         cout << *pit << endl;
+        world.add(*pit);
     } 
+    step.reserve(world.size(), nwalls);
 
     white = SDL_MapRGB(screen->format, 255, 255, 255);
 
+    last = SDL_GetTicks();
+    fps_timer = last + 5000;
     for ( ;; ) {
-        timediff.ticks += timediff.diff;
-
         while (SDL_PollEvent(&event)) {
             switch (event.type) {
             case SDL_QUIT:
@@ -686,50 +1774,79 @@ phys(int npolys) {
             }
         }
 
+        now = SDL_GetTicks();
         if (!pause) {
-            ticks = SDL_GetTicks(); 
-            timediff.diff = ticks - timediff.ticks;
-        
-            /*
-            angle += 0.001 * timediff.diff;
-            while(angle > 360.0)
-                angle -= 360.0; 
-            */
-            for (pit = polys.begin(); pit != polys.end(); ++pit) {
-                //pit->rotoMove(pit->pos, angle).commit();
-                //pit->move(timediff.diff);
-                move_and_collide(timediff.diff, polys, walls, nwalls);
-            } 
+            // the simulation always moves in steps of STEP, whatever the
+            // frame rate, and what is left over goes to the drawing
+            acc += now - last;
+            for (n = 0; acc >= STEP && n < MAX_STEPS; ++n) {
+                move_and_collide(STEP, world, walls, nwalls);
+                acc -= STEP;
+            }
+            if (acc >= STEP)
+                acc = 0.0;
         
             ++fps;
-            if (ticks > fps_timer) {
+            if (now > fps_timer) {
                 double rate = ((double) fps / 5000.0) * 1000;
                 cout << "fps = " << rate << endl;
-                fps_timer = ticks + (ticks - fps_timer) + 5000;
+                fps_timer = now + (now - fps_timer) + 5000;
                 fps = 0;
             }
         }
+        last = now;
 
-        for (pit = polys.begin(); pit != polys.end(); ++pit) {
-            pit->draw(screen, white);
-        }
-        SDL_Flip(screen);
-        SDL_FillRect(screen, NULL, 0); 
+        renderer.draw(screen, world, acc / STEP, white);
         //SDL_Delay(60); 
         //SDL_Delay(40);
 
     }
 }
+#endif
+
+void
+usage(void) {
+    errx(1, "usage: phys [--headless] [--steps N] [--threads T] [--bodies M | M]");
+}
 
 int
 main(int argc, char **argv) {
-    int n = 4;
-
-    if (argc > 1)
-        n = atoi(argv[1]);
-
+    int n = 4, steps = 1000, nthreads, i;
+    bool headless_mode = false;
+
+    if ((nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        nthreads = 1;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--headless") == 0)
+            headless_mode = true;
+        else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc)
+            steps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            nthreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bodies") == 0 && i + 1 < argc)
+            n = atoi(argv[++i]);
+        else if (argv[i][0] != '-')
+            n = atoi(argv[i]);
+        else
+            usage();
+    }
+    if (n < 1 || steps < 1 || nthreads < 1)
+        usage();
+
+    pool.start(nthreads);
+    if (headless_mode) {
+        i = headless(n, steps);
+        pool.stop();
+        return i == 0 ? 0 : 1;
+    }
+#ifdef NO_SDL
+    errx(1, "built without SDL, only --headless is there");
+#else
     init_sdl();
     phys(n);
+#endif
+    pool.stop();
 
     return 0;
 }